@@ -0,0 +1,22 @@
+#!/bin/bash
+# Copyright 2016 Yanqing Sun, Junjie Wang
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+# WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+# MERCHANTABLITY OR NON-INFRINGEMENT.
+# See the Apache 2 License for the specific language governing permissions and
+# limitations under the License.
+#
+
+. ./path.sh || exit 1
+
+# 16 real-time streams, then as fast as the server can go.
+audio-server-bench --port=8010 --num-streams=16 'scp:data/test_clean_example/wav.scp'
+audio-server-bench --port=8010 --num-streams=16 --real-time=false 'scp:data/test_clean_example/wav.scp'
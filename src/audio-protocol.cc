@@ -0,0 +1,182 @@
+// audio-protocol.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "audio-protocol.h"
+
+namespace kaldi {
+
+AudioStreamParser::AudioStreamParser():
+    _mode(kUnknown), _header_bytes(0), _payload_remaining(0),
+    _encoding(kEncodingInt16), _flags(0), _partial_bytes(0),
+    _num_samples(0), _sample_rate(0), _session_id(0),
+    _end_of_stream(false) { }
+
+bool AudioStreamParser::Parse(const char *data, int32 len,
+                              RingBuffer<BaseFloat> *samples,
+                              std::deque<int64> *utt_ends) {
+  int32 pos = 0;
+  while (pos < len && _mode != kBroken) {
+    if (_payload_remaining == 0) {
+      // The format is known after the first four bytes.
+      int32 header_size = (_mode == kFramed ? kFrameHeaderBytes : 4);
+      while (_header_bytes < header_size && pos < len) {
+        _header[_header_bytes++] = data[pos++];
+        if (_mode == kUnknown && _header_bytes == 4) {
+          uint32 magic;
+          memcpy(&magic, _header, 4);
+          _mode = (magic == kFrameMagic ? kFramed : kLegacy);
+          header_size = (_mode == kFramed ? kFrameHeaderBytes : 4);
+        }
+      }
+      if (_header_bytes < header_size) break;
+      _header_bytes = 0;
+      if (!ParseHeader(utt_ends)) _mode = kBroken;
+      continue;
+    }
+
+    int32 n = std::min<int64>(_payload_remaining, len - pos);
+    ParseSamples(data + pos, n, samples);
+    pos += n;
+    _payload_remaining -= n;
+    if (_payload_remaining == 0) EndPayload(utt_ends);
+  }
+  return _mode != kBroken;
+}
+
+bool AudioStreamParser::ParseHeader(std::deque<int64> *utt_ends) {
+  if (_mode == kLegacy) {
+    int32 size;
+    memcpy(&size, _header, 4);
+    if (size < 0 || size % 2 != 0) {
+      KALDI_WARN << "Bad packet size " << size;
+      return false;
+    }
+    _encoding = kEncodingInt16;
+    _flags = (size == 0 ? kFrameEndOfUtterance : 0);
+    _payload_remaining = size;
+    if (size == 0) EndPayload(utt_ends);
+    return true;
+  }
+
+  uint32 magic, sample_rate, session_id, payload_bytes;
+  uint16 flags;
+  memcpy(&magic, _header, 4);
+  uint8 version = _header[4], encoding = _header[5];
+  memcpy(&flags, _header + 6, 2);
+  memcpy(&sample_rate, _header + 8, 4);
+  memcpy(&session_id, _header + 12, 4);
+  memcpy(&payload_bytes, _header + 16, 4);
+
+  if (magic != kFrameMagic || version != kFrameVersion) {
+    KALDI_WARN << "Bad frame header (magic " << magic << ", version "
+               << static_cast<int32>(version) << ")";
+    return false;
+  }
+  int32 sample_bytes;
+  if (encoding == kEncodingInt16) {
+    sample_bytes = 2;
+  } else if (encoding == kEncodingFloat32) {
+    sample_bytes = 4;
+  } else {
+    KALDI_WARN << "Unknown audio encoding " << static_cast<int32>(encoding);
+    return false;
+  }
+  if (payload_bytes % sample_bytes != 0 || payload_bytes > (1u << 30)) {
+    KALDI_WARN << "Bad frame payload size " << payload_bytes;
+    return false;
+  }
+  if (sample_rate != 0) {
+    if (_sample_rate != 0 && sample_rate != _sample_rate) {
+      KALDI_WARN << "Sample rate changed from " << _sample_rate << " to "
+                 << sample_rate << " within a connection";
+      return false;
+    }
+    _sample_rate = sample_rate;
+  }
+  if (session_id != _session_id) {
+    KALDI_VLOG(1) << "Client session id " << session_id;
+    _session_id = session_id;
+  }
+
+  _encoding = encoding;
+  _flags = flags;
+  _payload_remaining = payload_bytes;
+  if (payload_bytes == 0) EndPayload(utt_ends);
+  return true;
+}
+
+void AudioStreamParser::ParseSamples(const char *data, int32 len,
+                                     RingBuffer<BaseFloat> *samples) {
+  int32 sample_bytes = (_encoding == kEncodingFloat32 ? 4 : 2);
+  int16 s16;
+  float f32;
+  // finish a sample split between two reads
+  while (_partial_bytes > 0 && len > 0) {
+    _partial[_partial_bytes++] = *data++;
+    len--;
+    if (_partial_bytes == sample_bytes) {
+      int64 n;
+      BaseFloat *dst = samples->WriteSpan(&n);
+      if (sample_bytes == 2) {
+        memcpy(&s16, _partial, 2);
+        *dst = s16;
+      } else {
+        memcpy(&f32, _partial, 4);
+        *dst = f32 * 32768.0f;
+      }
+      samples->Commit(1);
+      _num_samples++;
+      _partial_bytes = 0;
+    }
+  }
+
+  int64 count = len / sample_bytes;
+  while (count > 0) {
+    int64 n;
+    BaseFloat *dst = samples->WriteSpan(&n);
+    n = std::min(n, count);
+    if (sample_bytes == 2) {
+      for (int64 i = 0; i < n; i++, data += 2) {
+        memcpy(&s16, data, 2);
+        dst[i] = s16;
+      }
+    } else {
+      for (int64 i = 0; i < n; i++, data += 4) {
+        memcpy(&f32, data, 4);
+        dst[i] = f32 * 32768.0f;
+      }
+    }
+    samples->Commit(n);
+    _num_samples += n;
+    count -= n;
+  }
+
+  for (int32 i = 0; i < len % sample_bytes; i++)
+    _partial[_partial_bytes++] = data[i];
+}
+
+void AudioStreamParser::EndPayload(std::deque<int64> *utt_ends) {
+  if (_flags & kFrameEndOfUtterance) utt_ends->push_back(_num_samples);
+  if (_flags & kFrameEndOfStream) _end_of_stream = true;
+  _flags = 0;
+}
+
+}  // namespace kaldi
@@ -0,0 +1,117 @@
+// audio-protocol.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_AUDIO_PROTOCOL_H_
+#define KALDI_AUDIO_SERVER_AUDIO_PROTOCOL_H_
+
+#include <deque>
+
+#include "base/kaldi-common.h"
+#include "ring-buffer.h"
+
+namespace kaldi {
+
+/*
+ * Clients send audio in one of two formats, told apart by the first four
+ * bytes of the connection:
+ *
+ * - the online-audio-client format: packets of an int32 byte count and
+ *   that many bytes of 16 bit PCM; an empty packet ends the utterance.
+ *
+ * - framed: every frame starts with a 20 byte header (all fields little
+ *   endian)
+ *     uint32 magic          kFrameMagic ("KASF")
+ *     uint8  version        kFrameVersion
+ *     uint8  encoding       kEncodingInt16 or kEncodingFloat32
+ *     uint16 flags          kFrameEndOfUtterance | kFrameEndOfStream
+ *     uint32 sample_rate    must not change within a connection
+ *     uint32 session_id     chosen by the client, only used for logging
+ *     uint32 payload_bytes  samples following the header
+ *   The flags take effect after the payload.  Float samples are expected
+ *   in [-1, 1).  The magic is an odd number, which is never a valid
+ *   packet size of the first format.
+ */
+const uint32 kFrameMagic = 0x4653414b;
+const uint8 kFrameVersion = 1;
+const int32 kFrameHeaderBytes = 20;
+
+enum AudioEncoding {
+  kEncodingInt16 = 0,
+  kEncodingFloat32 = 1
+};
+
+enum FrameFlags {
+  kFrameEndOfUtterance = 1,
+  kFrameEndOfStream = 2
+};
+
+/*
+ * Incremental parser for both formats.  Bytes may be handed in split at
+ * any position; samples are converted to floats (in 16 bit range, as
+ * Kaldi expects) straight into the caller's ring buffer.
+ */
+class AudioStreamParser {
+ public:
+  AudioStreamParser();
+
+  // Parses "len" received bytes, appending the samples to "samples" and,
+  // for every end of an utterance, the number of samples parsed so far to
+  // "utt_ends".  Returns false once the stream is malformed; the rest of
+  // it is then ignored.
+  bool Parse(const char *data, int32 len, RingBuffer<BaseFloat> *samples,
+             std::deque<int64> *utt_ends);
+
+  bool Framed() const { return _mode == kFramed; }
+  // True once a frame with kFrameEndOfStream has been parsed; the client
+  // sends nothing after it, as if it had closed the connection.
+  bool EndOfStream() const { return _end_of_stream; }
+  // Sample rate announced by a framed client, or 0.
+  int32 SampleRate() const { return _sample_rate; }
+  uint32 SessionId() const { return _session_id; }
+
+ private:
+  enum Mode { kUnknown, kLegacy, kFramed, kBroken };
+
+  // Interprets the complete header in _header; returns false if it is
+  // malformed.
+  bool ParseHeader(std::deque<int64> *utt_ends);
+  void ParseSamples(const char *data, int32 len,
+                    RingBuffer<BaseFloat> *samples);
+  void EndPayload(std::deque<int64> *utt_ends);
+
+  Mode _mode;
+  char _header[kFrameHeaderBytes];
+  int32 _header_bytes;
+  int64 _payload_remaining;
+
+  // State of the current frame.
+  int32 _encoding;
+  int32 _flags;
+  char _partial[4];       // bytes of a sample split between two reads
+  int32 _partial_bytes;
+
+  int64 _num_samples;
+  int32 _sample_rate;
+  uint32 _session_id;
+  bool _end_of_stream;
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_AUDIO_PROTOCOL_H_
@@ -0,0 +1,535 @@
+// audio-server-bench.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "base/kaldi-common.h"
+#include "feat/wave-reader.h"
+#include "util/common-utils.h"
+
+#include "audio-protocol.h"
+#include "job-queue.h"
+#include "shm-ring.h"
+
+namespace kaldi {
+
+struct BenchConfig {
+  std::string host;
+  int32 port;
+  int32 num_streams;
+  int32 num_utterances;
+  BaseFloat packet_secs;
+  bool real_time;
+  bool framed;
+  BaseFloat timeout;
+  std::string shm_socket;
+  int32 server_pid;
+
+  BenchConfig(): host("localhost"), port(5010), num_streams(1),
+                 num_utterances(0), packet_secs(0.1), real_time(true),
+                 framed(false), timeout(60.0), server_pid(0) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("host", &host, "Host name of the audio server");
+    opts->Register("port", &port, "Port of the audio server");
+    opts->Register("num-streams", &num_streams, "Number of connections "
+                   "sending audio at the same time");
+    opts->Register("num-utterances", &num_utterances, "Number of utterances "
+                   "to send in total, cycling through the corpus; 0 sends "
+                   "every utterance once");
+    opts->Register("packet-secs", &packet_secs, "Seconds of audio per "
+                   "packet");
+    opts->Register("real-time", &real_time, "If true, every stream sends "
+                   "audio at the speed it was recorded at; otherwise as fast "
+                   "as the server takes it");
+    opts->Register("framed", &framed, "If true, use the framed protocol "
+                   "instead of online-audio-client packets");
+    opts->Register("timeout", &timeout, "Seconds to wait for the final "
+                   "result of an utterance before counting it as dropped");
+    opts->Register("shm-socket", &shm_socket, "If set, connect to the "
+                   "--shm-socket-path of a server on this host and write "
+                   "the audio into shared memory instead of --host and "
+                   "--port");
+    opts->Register("server-pid", &server_pid, "If > 0, also report the CPU "
+                   "time the server process with this pid used during the "
+                   "run");
+  }
+};
+
+struct Utterance {
+  std::string key;
+  int32 samp_freq;
+  std::vector<int16> samples;
+};
+
+/*
+ * Results of all streams.  Latencies are measured on the client: the time
+ * to the first partial result from the first packet sent, and the time to
+ * RESULT:DONE from the end of the utterance.
+ */
+class BenchStats {
+ public:
+  BenchStats(): _num_done(0), _num_dropped(0), _num_busy(0),
+                _audio_secs(0.0) {
+    pthread_mutex_init(&_lock, NULL);
+  }
+  ~BenchStats() { pthread_mutex_destroy(&_lock); }
+
+  void AddDone(double audio_secs, double first_partial, double final) {
+    pthread_mutex_lock(&_lock);
+    _num_done++;
+    _audio_secs += audio_secs;
+    if (first_partial >= 0) _first_partial.push_back(first_partial);
+    _final.push_back(final);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  void AddDropped(bool busy) {
+    pthread_mutex_lock(&_lock);
+    _num_dropped++;
+    if (busy) _num_busy++;
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // "server_cpu_secs" < 0 means it is unknown.
+  void Print(double wall_secs, double client_cpu_secs,
+             double server_cpu_secs, int32 num_streams) {
+    pthread_mutex_lock(&_lock);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "Utterances: " << _num_done << " decoded, " << _num_dropped
+        << " dropped (" << _num_busy << " answered RESULT:BUSY)\n";
+    out << "Throughput: " << _audio_secs << " seconds of audio in "
+        << wall_secs << " seconds, " << _audio_secs / wall_secs
+        << "x real time, " << _num_done / wall_secs << " utterances/s\n";
+    out << "CPU time (s): client=" << client_cpu_secs;
+    if (server_cpu_secs >= 0) out << " server=" << server_cpu_secs;
+    out << ", per stream: client=" << client_cpu_secs / num_streams;
+    if (server_cpu_secs >= 0)
+      out << " server=" << server_cpu_secs / num_streams;
+    if (_audio_secs > 0) {
+      out << ", per second of audio (ms): client="
+          << client_cpu_secs / _audio_secs * 1000;
+      if (server_cpu_secs >= 0)
+        out << " server=" << server_cpu_secs / _audio_secs * 1000;
+    }
+    out << "\n";
+    PrintPercentiles("First partial", &_first_partial, &out);
+    PrintPercentiles("Final result", &_final, &out);
+    pthread_mutex_unlock(&_lock);
+    std::cout << out.str();
+  }
+
+ private:
+  static void PrintPercentiles(const std::string &name,
+                               std::vector<double> *values,
+                               std::ostringstream *out) {
+    *out << name << " latency (ms):";
+    if (values->empty()) {
+      *out << " none\n";
+      return;
+    }
+    std::sort(values->begin(), values->end());
+    const double quantiles[] = { 0.5, 0.95, 0.99 };
+    const char *names[] = { "p50", "p95", "p99" };
+    for (int32 i = 0; i < 3; i++) {
+      size_t index = std::min(values->size() - 1, static_cast<size_t>(
+          quantiles[i] * values->size()));
+      *out << " " << names[i] << "=" << (*values)[index] * 1000;
+    }
+    *out << " max=" << values->back() * 1000 << "\n";
+  }
+
+  int64 _num_done, _num_dropped, _num_busy;
+  double _audio_secs;
+  std::vector<double> _first_partial, _final;
+  pthread_mutex_t _lock;
+};
+
+class LoadGenerator {
+ public:
+  LoadGenerator(const BenchConfig &config,
+                const std::vector<Utterance> &corpus):
+      _config(config), _corpus(corpus), _next(0) {
+    pthread_mutex_init(&_lock, NULL);
+  }
+  ~LoadGenerator() { pthread_mutex_destroy(&_lock); }
+
+  void Run();
+
+ private:
+  static void* ThreadProc(void *para);
+  // Returns the next utterance to send, or NULL when all are sent.
+  const Utterance *NextUtterance();
+  // Sends one utterance on a new connection and waits for its result.
+  void SendUtterance(const Utterance &utt);
+
+  // With --shm-socket, also receives the ring to write the audio into.
+  int32 Connect(ShmRing **ring);
+  // Writes into "ring" instead of "socket" unless it is NULL.
+  bool SendPacket(int32 socket, ShmRing *ring, const Utterance &utt,
+                  const int16 *data, int32 num_samples,
+                  bool end_of_utterance);
+  // Reads whatever the server sent within "timeout_secs" and handles the
+  // complete lines.  Returns false if the connection is gone.
+  bool ReadLines(int32 socket, double timeout_secs, std::string *pending,
+                 std::vector<std::string> *lines);
+
+  const BenchConfig &_config;
+  const std::vector<Utterance> &_corpus;
+  int32 _next;
+  pthread_mutex_t _lock;
+  BenchStats _stats;
+};
+
+// CPU time used by this process so far.
+static double ProcessCpuSeconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+// CPU time used by process "pid" so far, from /proc; < 0 if unknown.
+static double ProcessCpuSeconds(int32 pid) {
+  std::ostringstream path;
+  path << "/proc/" << pid << "/stat";
+  std::ifstream stat(path.str().c_str());
+  std::string line;
+  if (!std::getline(stat, line)) return -1.0;
+  // utime and stime are the 14th and 15th fields; the 2nd, the command
+  // name in parentheses, may contain spaces
+  size_t pos = line.rfind(')');
+  if (pos == std::string::npos) return -1.0;
+  std::istringstream fields(line.substr(pos + 1));
+  std::string field;
+  for (int32 i = 3; i < 14; i++) fields >> field;
+  int64 utime, stime;
+  if (!(fields >> utime >> stime)) return -1.0;
+  return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+void LoadGenerator::Run() {
+  std::vector<pthread_t> threads(_config.num_streams);
+  double start = MonotonicSeconds(), client_cpu = ProcessCpuSeconds(),
+      server_cpu = (_config.server_pid > 0 ?
+                    ProcessCpuSeconds(_config.server_pid) : -1.0);
+  if (_config.server_pid > 0 && server_cpu < 0)
+    KALDI_WARN << "Cannot read the CPU time of process "
+               << _config.server_pid;
+  for (size_t i = 0; i < threads.size(); i++) {
+    int32 err = pthread_create(&(threads[i]), NULL, LoadGenerator::ThreadProc,
+                               this);
+    if (err != 0)
+      KALDI_ERR << "Can't create stream thread " << i << ": "
+                << strerror(err);
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  client_cpu = ProcessCpuSeconds() - client_cpu;
+  if (server_cpu >= 0) {
+    double end_cpu = ProcessCpuSeconds(_config.server_pid);
+    server_cpu = (end_cpu >= 0 ? end_cpu - server_cpu : -1.0);
+  }
+  _stats.Print(MonotonicSeconds() - start, client_cpu, server_cpu,
+               _config.num_streams);
+}
+
+void* LoadGenerator::ThreadProc(void *para) {
+  LoadGenerator *generator = reinterpret_cast<LoadGenerator*>(para);
+  const Utterance *utt;
+  while ((utt = generator->NextUtterance()) != NULL)
+    generator->SendUtterance(*utt);
+  return reinterpret_cast<void*>(NULL);
+}
+
+const Utterance *LoadGenerator::NextUtterance() {
+  int32 total = (_config.num_utterances > 0 ? _config.num_utterances
+                                            : _corpus.size());
+  const Utterance *utt = NULL;
+  pthread_mutex_lock(&_lock);
+  if (_next < total) utt = &(_corpus[_next++ % _corpus.size()]);
+  pthread_mutex_unlock(&_lock);
+  return utt;
+}
+
+int32 LoadGenerator::Connect(ShmRing **ring) {
+  *ring = NULL;
+  if (_config.shm_socket != "") {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, _config.shm_socket.c_str(),
+            sizeof(addr.sun_path) - 1);
+    int32 client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client_socket == -1) return -1;
+    if (connect(client_socket, reinterpret_cast<struct sockaddr*>(&addr),
+                sizeof(addr)) == -1 ||
+        (*ring = ReceiveShmRing(client_socket)) == NULL) {
+      close(client_socket);
+      return -1;
+    }
+    return client_socket;
+  }
+
+  struct addrinfo hints, *addrs;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  std::ostringstream port;
+  port << _config.port;
+  if (getaddrinfo(_config.host.c_str(), port.str().c_str(), &hints, &addrs)
+      != 0)
+    return -1;
+  int32 client_socket = -1;
+  for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+    client_socket = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (client_socket == -1) continue;
+    if (connect(client_socket, a->ai_addr, a->ai_addrlen) == 0) break;
+    close(client_socket);
+    client_socket = -1;
+  }
+  freeaddrinfo(addrs);
+  return client_socket;
+}
+
+bool LoadGenerator::SendPacket(int32 socket, ShmRing *ring,
+                               const Utterance &utt, const int16 *data,
+                               int32 num_samples, bool end_of_utterance) {
+  std::string packet;
+  int32 payload_bytes = num_samples * sizeof(int16);
+  if (_config.framed) {
+    char header[kFrameHeaderBytes];
+    uint32 magic = kFrameMagic, samp_freq = utt.samp_freq,
+        session_id = static_cast<uint32>(socket), size = payload_bytes;
+    uint16 flags = (end_of_utterance ? kFrameEndOfUtterance : 0);
+    memcpy(header, &magic, 4);
+    header[4] = kFrameVersion;
+    header[5] = kEncodingInt16;
+    memcpy(header + 6, &flags, 2);
+    memcpy(header + 8, &samp_freq, 4);
+    memcpy(header + 12, &session_id, 4);
+    memcpy(header + 16, &size, 4);
+    packet.append(header, kFrameHeaderBytes);
+    packet.append(reinterpret_cast<const char*>(data), payload_bytes);
+  } else {
+    // online-audio-client packets; an empty one ends the utterance
+    if (num_samples > 0) {
+      packet.append(reinterpret_cast<const char*>(&payload_bytes), 4);
+      packet.append(reinterpret_cast<const char*>(data), payload_bytes);
+    }
+    if (end_of_utterance) {
+      int32 zero = 0;
+      packet.append(reinterpret_cast<const char*>(&zero), 4);
+    }
+  }
+
+  size_t sent = 0;
+  if (ring != NULL) {
+    // wait for the server to make room, but not forever: it may have
+    // dropped the connection
+    double deadline = MonotonicSeconds() + _config.timeout;
+    while (sent < packet.size()) {
+      int32 n = ring->Write(packet.data() + sent, packet.size() - sent);
+      sent += n;
+      if (n == 0) {
+        if (MonotonicSeconds() > deadline) return false;
+        Sleep(0.001);
+      }
+    }
+    return true;
+  }
+  while (sent < packet.size()) {
+    ssize_t ret = send(socket, packet.data() + sent, packet.size() - sent,
+                       MSG_NOSIGNAL);
+    if (ret <= 0) return false;
+    sent += ret;
+  }
+  return true;
+}
+
+bool LoadGenerator::ReadLines(int32 socket, double timeout_secs,
+                              std::string *pending,
+                              std::vector<std::string> *lines) {
+  lines->clear();
+  struct pollfd pfd;
+  pfd.fd = socket;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  int32 ret = poll(&pfd, 1, std::max(0, static_cast<int32>(
+      timeout_secs * 1000)));
+  if (ret <= 0) return true;
+
+  char buffer[4096];
+  ssize_t n = recv(socket, buffer, sizeof(buffer), 0);
+  if (n <= 0) return false;
+  pending->append(buffer, n);
+  size_t pos;
+  while ((pos = pending->find('\n')) != std::string::npos) {
+    lines->push_back(pending->substr(0, pos));
+    pending->erase(0, pos + 1);
+  }
+  return true;
+}
+
+void LoadGenerator::SendUtterance(const Utterance &utt) {
+  ShmRing *ring;
+  int32 client_socket = Connect(&ring);
+  if (client_socket < 0) {
+    if (_config.shm_socket != "") {
+      KALDI_WARN << "Cannot connect to " << _config.shm_socket;
+    } else {
+      KALDI_WARN << "Cannot connect to " << _config.host << ":"
+                 << _config.port;
+    }
+    _stats.AddDropped(false);
+    return;
+  }
+
+  int32 packet_samples = std::max(1, static_cast<int32>(
+      _config.packet_secs * utt.samp_freq));
+  int32 num_samples = utt.samples.size();
+  double start = MonotonicSeconds(), end_sent = -1.0,
+      first_partial = -1.0, done = -1.0;
+  bool busy = false, broken = false;
+  std::string pending;
+  std::vector<std::string> lines;
+
+  int32 offset = 0;
+  while (done < 0 && !busy && !broken) {
+    double now = MonotonicSeconds();
+    double wait;
+    if (end_sent < 0) {
+      int32 n = std::min(packet_samples, num_samples - offset);
+      bool last = (offset + n == num_samples);
+      if (!SendPacket(client_socket, ring, utt, &(utt.samples[0]) + offset,
+                      n, last)) {
+        broken = true;
+        break;
+      }
+      offset += n;
+      if (last) end_sent = MonotonicSeconds();
+      // in real time mode, the next packet is due when its audio would
+      // have been recorded
+      wait = (_config.real_time ?
+              start + static_cast<double>(offset) / utt.samp_freq - now : 0);
+    } else {
+      wait = end_sent + _config.timeout - now;
+      if (wait <= 0) break;
+    }
+
+    if (!ReadLines(client_socket, wait, &pending, &lines)) broken = true;
+    now = MonotonicSeconds();
+    for (size_t i = 0; i < lines.size(); i++) {
+      if (lines[i].compare(0, 7, "PARTIAL") == 0 && first_partial < 0)
+        first_partial = now - start;
+      // with endpointing, RESULT:DONE may also come before the end
+      if (lines[i] == "RESULT:DONE" && end_sent >= 0) done = now;
+      if (lines[i] == "RESULT:BUSY") busy = true;
+    }
+    if (_config.real_time && end_sent < 0) {
+      // sleep off what the read did not wait for
+      double due = start + static_cast<double>(offset) / utt.samp_freq;
+      if (due > now) Sleep(due - now);
+    }
+  }
+  if (ring != NULL) {
+    ring->Close();
+    delete ring;
+  }
+  close(client_socket);
+
+  if (done >= 0) {
+    _stats.AddDone(static_cast<double>(num_samples) / utt.samp_freq,
+                   first_partial, done - end_sent);
+  } else {
+    KALDI_WARN << "No result for " << utt.key
+               << (busy ? ", server is busy" : "");
+    _stats.AddDropped(busy);
+  }
+}
+
+}  // namespace kaldi
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+
+    const char *usage =
+        "Replays a corpus against an audio server from many connections at\n"
+        "once and reports throughput, latency percentiles and dropped\n"
+        "connections.  Every utterance is sent on a connection of its own.\n"
+        "\n"
+        "Usage: audio-server-bench [options] <wav-rspecifier>\n"
+        "e.g.: audio-server-bench --num-streams=32 scp:wav.scp\n";
+
+    ParseOptions po(usage);
+    BenchConfig config;
+    config.Register(&po);
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 1) {
+      po.PrintUsage();
+      return 1;
+    }
+    if (config.num_streams <= 0 || config.packet_secs <= 0)
+      KALDI_ERR << "--num-streams and --packet-secs must be positive";
+
+    // Load the whole corpus first, so reading it does not slow down the
+    // streams.
+    std::vector<Utterance> corpus;
+    SequentialTableReader<WaveHolder> reader(po.GetArg(1));
+    for (; !reader.Done(); reader.Next()) {
+      const WaveData &wave = reader.Value();
+      Utterance utt;
+      utt.key = reader.Key();
+      utt.samp_freq = static_cast<int32>(wave.SampFreq());
+      SubVector<BaseFloat> channel(wave.Data(), 0);
+      utt.samples.resize(channel.Dim());
+      for (int32 i = 0; i < channel.Dim(); i++)
+        utt.samples[i] = static_cast<int16>(channel(i));
+      if (utt.samples.empty()) continue;
+      corpus.push_back(utt);
+    }
+    if (corpus.empty())
+      KALDI_ERR << "No audio in " << po.GetArg(1);
+    KALDI_LOG << "Sending " << corpus.size() << " utterances from "
+              << config.num_streams << " streams"
+              << (config.real_time ? " in real time" : "");
+
+    LoadGenerator generator(config, corpus);
+    generator.Run();
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
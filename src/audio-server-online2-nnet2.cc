@@ -41,24 +41,11 @@
 #include "lat/word-align-lattice-lexicon.h"
 #include "lat/lattice-functions.h"
 
-namespace kaldi {
-
-/*
- * This class is for a very simple TCP server implementation
- * in UNIX sockets.
- */
-class TcpServer {
- public:
-  TcpServer();
-  ~TcpServer();
+#include "graph-io.h"
+#include "job-queue.h"
+#include "tcp-server.h"
 
-  bool Listen(int32 port);  // start listening on a given port
-  int32 Accept();  // accept a client and return its descriptor
-
- private:
-  struct sockaddr_in _h_addr_;
-  int32 _server_desc_;
-};
+namespace kaldi {
 
 class DecoderPool {
  public:
@@ -73,6 +60,7 @@ class DecoderPool {
   OnlineNnet2FeaturePipelineInfo *_feature_info;
   fst::SymbolTable *_word_syms;
   WordAlignLatticeLexiconInfo *_lexicon_info;
+  AdmissionConfig _admission;
 
   struct DecoderThread {
     kaldi::DecoderPool *_pool;
@@ -80,36 +68,29 @@ class DecoderPool {
 
     // Variables for network programming
     int32 _client_socket;
-    pthread_mutex_t _lock;
-    bool _is_free;
   };
   static void* ThreadProc(void* para);
   void Run(const int32 &n);
   void NewTask(int32 client_socket);
   bool IsBusy();
+  // Returns the time in seconds until the oldest pending connection hits
+  // --max-queue-wait, or a negative value if nothing can expire.
+  double NextExpiry();
+  // Answers pending connections that waited longer than --max-queue-wait.
+  void ExpirePending();
 
  private:
   DecoderThread* _decoder_threads;
   int32 _num;
-};
-
-bool WriteLine(int32 socket, std::string line) {
-  line = line + "\n";
 
-  const char* p = line.c_str();
-  int32 to_write = line.size();
-  int32 wrote = 0;
-  while (to_write > 0) {
-    int32 ret = write(socket, p + wrote, to_write);
-    if (ret <= 0)
-      return false;
+  // Accepted client sockets waiting for a decoder thread.
+  JobQueue<int32> *_tasks;
+  // Number of tasks queued or being decoded, protected by _busy_lock.
+  int32 _num_busy;
+  pthread_mutex_t _busy_lock;
 
-    to_write -= ret;
-    wrote += ret;
-  }
-
-  return true;
-}
+  void TaskDone();
+};
 
 void GetDiagnosticsAndPrintOutput(int32 socket,
     bool end_of_utterance,
@@ -234,7 +215,12 @@ int main(int argc, char *argv[]) {
 
     bool modify_ivector_config = false;
     int32 server_port_number = 5010;
+    bool mmap_graph = false;
 
+    po.Register("mmap-graph", &mmap_graph,
+                "If true, memory map the decoding graph instead of reading "
+                "it; it must be a ConstFst, e.g. converted with fstconvert "
+                "--fst_type=const --fst_align=true");
     po.Register("word-symbol-table", &word_syms_rxfilename,
                 "Symbol table for words [for debug output]");
     po.Register("modify-ivector-config", &modify_ivector_config,
@@ -252,6 +238,7 @@ int main(int argc, char *argv[]) {
 
     feature_config.Register(&po);
     decoder_pool._config.Register(&po);
+    decoder_pool._admission.Register(&po);
     endpoint_config.Register(&po);
 
     po.Read(argc, argv);
@@ -293,7 +280,7 @@ int main(int argc, char *argv[]) {
       decoder_pool._tmodel.Read(ki.Stream(), binary);
       decoder_pool._am_nnet.Read(ki.Stream(), binary);
     }
-    decoder_pool._fst = fst::ReadFstKaldiGeneric(fst_rxfilename);
+    decoder_pool._fst = kaldi::ReadDecodingGraph(fst_rxfilename, mmap_graph);
     if (word_syms_rxfilename != "")
       if (!(decoder_pool._word_syms = fst::SymbolTable::ReadText(
           word_syms_rxfilename)))
@@ -303,12 +290,14 @@ int main(int argc, char *argv[]) {
     decoder_pool.Run(kaldi::g_num_threads);
 
     kaldi::TcpServer tcp_server;
-    if (!tcp_server.Listen(server_port_number))
+    if (!tcp_server.Listen(server_port_number,
+                           decoder_pool._admission.listen_backlog))
       return 0;
 
     int testcase_num = 0;
     while (true) {
-      decoder_pool.NewTask(tcp_server.Accept());
+      decoder_pool.NewTask(tcp_server.Accept(decoder_pool.NextExpiry()));
+      decoder_pool.ExpirePending();
       // testcase_num++;
       if (testcase_num > 5) {
         while (true) {
@@ -330,73 +319,6 @@ int main(int argc, char *argv[]) {
 namespace kaldi {
 
 // IMPLEMENTATION OF THE CLASSES/METHODS ABOVE MAIN
-TcpServer::TcpServer() {
-  _server_desc_ = -1;
-}
-
-bool TcpServer::Listen(int32 port) {
-  _h_addr_.sin_addr.s_addr = INADDR_ANY;
-  _h_addr_.sin_port = htons(port);
-  _h_addr_.sin_family = AF_INET;
-
-  _server_desc_ = socket(AF_INET, SOCK_STREAM, 0);
-
-  if (_server_desc_ == -1) {
-    KALDI_ERR << "Cannot create TCP socket!";
-    return false;
-  }
-
-  int32 flag = 1;
-  int32 len = sizeof(int32);
-  if (setsockopt(_server_desc_, SOL_SOCKET, SO_REUSEADDR, &flag, len) == -1) {
-    KALDI_ERR << "Cannot set socket options!\n";
-    return false;
-  }
-
-  if (bind(_server_desc_, (struct sockaddr*) &_h_addr_, sizeof(_h_addr_))
-      == -1) {
-    KALDI_ERR << "Cannot bind to port: " << port << " (is it taken?)";
-    return false;
-  }
-
-  if (listen(_server_desc_, 1) == -1) {
-    KALDI_ERR << "Cannot listen on port!";
-    return false;
-  }
-
-  KALDI_LOG << "TcpServer: Listening on port: " << port;
-
-  return true;
-}
-
-TcpServer::~TcpServer() {
-  if (_server_desc_ != -1)
-    close(_server_desc_);
-}
-
-int32 TcpServer::Accept() {
-  KALDI_LOG << "Waiting for client...";
-
-  socklen_t len;
-
-  len = sizeof(struct sockaddr);
-  int32 client_desc =
-      accept(_server_desc_, (struct sockaddr*) &_h_addr_, &len);
-
-  struct sockaddr_storage addr;
-  char ipstr[20];
-
-  len = sizeof addr;
-  getpeername(client_desc, (struct sockaddr*) &addr, &len);
-
-  struct sockaddr_in *s = (struct sockaddr_in *) &addr;
-  inet_ntop(AF_INET, &s->sin_addr, ipstr, sizeof ipstr);
-
-  KALDI_LOG << "TcpServer: Accepted connection from: " << ipstr;
-
-  return client_desc;
-}
-
 DecoderPool::DecoderPool() {
   _num = 0;
   _decoder_threads = NULL;
@@ -404,6 +326,9 @@ DecoderPool::DecoderPool() {
   _feature_info = NULL;
   _word_syms = NULL;
   _lexicon_info = NULL;
+  _tasks = NULL;
+  _num_busy = 0;
+  pthread_mutex_init(&_busy_lock, NULL);
 }
 
 DecoderPool::~DecoderPool() {
@@ -412,6 +337,8 @@ DecoderPool::~DecoderPool() {
   if (_word_syms != NULL) delete _word_syms;
   if (_decoder_threads != NULL) delete[] _decoder_threads;
   if (_lexicon_info != NULL) delete _lexicon_info;
+  if (_tasks != NULL) delete _tasks;
+  pthread_mutex_destroy(&_busy_lock);
 }
 
 void* DecoderPool::ThreadProc(void* para) {
@@ -421,12 +348,22 @@ void* DecoderPool::ThreadProc(void* para) {
   KALDI_LOG << "Decoder " << dt->_tid << " is ready";
 
   while (true) {
-    if (dt->_client_socket == -1) {
-      Sleep(0.1f);
+    double wait_secs;
+    if (!dt->_pool->_tasks->Pop(&(dt->_client_socket), &wait_secs))
+      break;
+    BaseFloat max_queue_wait = dt->_pool->_admission.max_queue_wait;
+    if (max_queue_wait > 0 && wait_secs > max_queue_wait) {
+      // expired before ExpirePending() got to it
+      RejectBusyClient(dt->_client_socket);
+      dt->_client_socket = -1;
+      dt->_pool->TaskDone();
       continue;
     }
-    pthread_mutex_lock(&(dt->_lock));
-    KALDI_LOG << "Decoder " << dt->_tid << " is running";
+    JobQueueStats stats = dt->_pool->_tasks->Stats();
+    KALDI_LOG << "Decoder " << dt->_tid << " is running, queue wait "
+        << wait_secs * 1000 << " ms (average " << stats.AverageWait() * 1000
+        << " ms, max " << stats.max_wait * 1000 << " ms over "
+        << stats.num_jobs << " connections)";
     OnlineIvectorExtractorAdaptationState adaptation_state(
           dt->_pool->_feature_info->ivector_extractor_info);
     while (true) {
@@ -485,9 +422,8 @@ void* DecoderPool::ThreadProc(void* para) {
       WriteLine(dt->_client_socket, "RESULT:DONE");
     }
     close(dt->_client_socket);
-    dt->_is_free = true;
     dt->_client_socket = -1;
-    pthread_mutex_unlock(&(dt->_lock));
+    dt->_pool->TaskDone();
   }
 
   return reinterpret_cast<void*> (NULL);
@@ -499,12 +435,10 @@ void DecoderPool::Run(const int32 &n) {
   _num = n;
   _decoder_threads = new DecoderThread[_num];
   KALDI_ASSERT(_decoder_threads != NULL);
+  _tasks = new JobQueue<int32>(_num + _admission.max_pending);
 
   for (i = 0; i < _num; i++) {
     _decoder_threads[i]._pool = this;
-
-    pthread_mutex_init(&(_decoder_threads[i]._lock), NULL);
-    _decoder_threads[i]._is_free = true;
     _decoder_threads[i]._client_socket = -1;
   }
 
@@ -520,26 +454,56 @@ void DecoderPool::Run(const int32 &n) {
 }
 
 void DecoderPool::NewTask(int32 client_socket) {
-  for (int32 i = 0; i < _num; i++) {
-    if (_decoder_threads[i]._is_free) {
-      KALDI_LOG << "Decoder " << _decoder_threads[i]._tid << " is free";
-      pthread_mutex_lock(&(_decoder_threads[i]._lock));
-      _decoder_threads[i]._is_free = false;
-      _decoder_threads[i]._client_socket = client_socket;
-      pthread_mutex_unlock(&(_decoder_threads[i]._lock));
-      return;
-    }
+  if (client_socket < 0) return;
+
+  // Up to _num tasks are picked up by idle decoder threads right away, the
+  // next --max-pending-connections ones wait in the queue for a free one.
+  pthread_mutex_lock(&_busy_lock);
+  bool accepted = (_num_busy < _num + _admission.max_pending &&
+                   _tasks->TryPush(client_socket));
+  if (accepted) _num_busy++;
+  int32 num_busy = _num_busy;
+  pthread_mutex_unlock(&_busy_lock);
+
+  if (!accepted) {
+    KALDI_WARN << "Too many pending connections, rejecting client";
+    RejectBusyClient(client_socket);
+  } else if (num_busy > _num) {
+    KALDI_LOG << "All decoders are busy, " << num_busy - _num
+        << " connection(s) waiting";
   }
-  close(client_socket);
 }
 
 bool DecoderPool::IsBusy() {
-  for (int32 i = 0; i < _num; i++) {
-    if (!_decoder_threads[i]._is_free) {
-      return true;
-    }
+  pthread_mutex_lock(&_busy_lock);
+  bool busy = (_num_busy > 0);
+  pthread_mutex_unlock(&_busy_lock);
+  return busy;
+}
+
+double DecoderPool::NextExpiry() {
+  if (_admission.max_queue_wait <= 0) return -1.0;
+  double oldest_wait = _tasks->OldestWait();
+  if (oldest_wait < 0) return -1.0;
+  return std::max(0.0, _admission.max_queue_wait - oldest_wait);
+}
+
+void DecoderPool::ExpirePending() {
+  if (_admission.max_queue_wait <= 0) return;
+  std::vector<int32> expired;
+  _tasks->PopExpired(_admission.max_queue_wait, &expired);
+  for (size_t i = 0; i < expired.size(); i++) {
+    KALDI_WARN << "No decoder became free within " << _admission.max_queue_wait
+               << " seconds, rejecting client";
+    RejectBusyClient(expired[i]);
+    TaskDone();
   }
-  return false;
+}
+
+void DecoderPool::TaskDone() {
+  pthread_mutex_lock(&_busy_lock);
+  _num_busy--;
+  pthread_mutex_unlock(&_busy_lock);
 }
 
 }  // namespace kaldi
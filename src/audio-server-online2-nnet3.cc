@@ -23,9 +23,14 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
 #include <ctime>
+#include <deque>
+#include <map>
+#include <sstream>
 
 #include "feat/wave-reader.h"
 #include "online2/online-nnet2-feature-pipeline.h"
@@ -33,17 +38,44 @@
 #include "online2/onlinebin-util.h"
 #include "online2/online-timing.h"
 #include "online2/online-endpoint.h"
-#include "online/online-tcp-source.h"
 #include "fstext/fstext-lib.h"
 #include "lat/lattice-functions.h"
 #include "lat/kaldi-lattice.h"
 #include "lat/word-align-lattice-lexicon.h"
 #include "util/kaldi-thread.h"
 #include "nnet3/nnet-utils.h"
-
-int32 packet_size = 512;
+#include "nnet3/decodable-online-looped.h"
+#include "decoder/lattice-faster-online-decoder.h"
+
+#include "audio-protocol.h"
+#include "beam-controller.h"
+#include "chunk-scheduler.h"
+#include "cpu-affinity.h"
+#include "decoder-arena.h"
+#include "epoll-reactor.h"
+#include "graph-io.h"
+#include "job-queue.h"
+#include "latency-metrics.h"
+#include "nnet-batch-inference.h"
+#include "nnet-quantize.h"
+#include "partial-result.h"
+#include "polyphase-resampler.h"
+#include "result-writer.h"
+#include "shm-ring.h"
+#include "vad-gate.h"
+#include "tcp-server.h"
+
+int32 packet_size = 4096;
 kaldi::BaseFloat chunk_length_secs = 0.18;
 kaldi::BaseFloat secs_per_frame = 0.01;
+bool reuse_decoders = false;
+// A session stops reading from its client once this much audio waits for
+// a decoder thread.
+const kaldi::BaseFloat kMaxBufferedSecs = 10.0;
+// Set by SIGHUP, which reloads the models.
+volatile sig_atomic_t reload_requested = 0;
+// Bytes read from the shared memory ring of a client at a time.
+const int32 kRingReadBytes = 65536;
 kaldi::nnet3::NnetSimpleLoopedComputationOptions decodable_opts;
 
 namespace kaldi {
@@ -72,65 +104,311 @@ struct OnlineCmvnNnet2FeaturePipelineConfig :
 struct OnlineCmvnNnet2FeaturePipelineInfo :
     public OnlineNnet2FeaturePipelineInfo {
   OnlineCmvnNnet2FeaturePipelineConfig config_;
+  // Read once here, rather than by every feature pipeline.
+  Matrix<BaseFloat> global_cmvn_stats_;
+  OnlineCmvnOptions cmvn_opts_;
 
   OnlineCmvnNnet2FeaturePipelineInfo(
       const OnlineCmvnNnet2FeaturePipelineConfig &config) :
       OnlineNnet2FeaturePipelineInfo(config) {
     config_ = config;
+    if (config_.global_cmvn_stats_rxfilename != "") {
+      ReadKaldiObject(config_.global_cmvn_stats_rxfilename,
+                      &global_cmvn_stats_);
+    }
+    if (config_.cmvn_config != "") {
+      ReadConfigFromFile(config_.cmvn_config, &cmvn_opts_);
+    }
   }
 };
 
 class OnlineCmvnNnet2FeaturePipeline: public OnlineNnet2FeaturePipeline {
-  Matrix<BaseFloat> global_cmvn_stats_;  // Global CMVN stats.
-  OnlineCmvnOptions cmvn_opts;  // Options for online CMN/CMVN computation.
   OnlineCmvn *cmvn_;
 
  public:
   OnlineCmvnNnet2FeaturePipeline(
       const OnlineCmvnNnet2FeaturePipelineInfo &info) :
       OnlineNnet2FeaturePipeline(info) {
-    if (info.config_.global_cmvn_stats_rxfilename != "") {
-      ReadKaldiObject(info.config_.global_cmvn_stats_rxfilename,
-                      &global_cmvn_stats_);
-    }
-
     if (info.config_.cmvn_config != "") {
-      ReadConfigFromFile(info.config_.cmvn_config, &cmvn_opts);
-      KALDI_ASSERT(global_cmvn_stats_.NumRows() != 0);
+      KALDI_ASSERT(info.global_cmvn_stats_.NumRows() != 0);
       if (info.add_pitch || info.use_ivectors) {
         KALDI_ERR << "CMVN does not support pitch and ivector.";
       }
-      Matrix<double> global_cmvn_stats_dbl(global_cmvn_stats_);
+      Matrix<double> global_cmvn_stats_dbl(info.global_cmvn_stats_);
       OnlineCmvnState initial_state(global_cmvn_stats_dbl);
-      cmvn_ = new OnlineCmvn(cmvn_opts,
+      cmvn_ = new OnlineCmvn(info.cmvn_opts_,
                              initial_state,
                              OnlineNnet2FeaturePipeline::InputFeature());
-      KALDI_VLOG(1) << "CMVN is enabled for feature pipeline";
+      KALDI_VLOG(2) << "CMVN is enabled for feature pipeline";
     } else {
       cmvn_ = NULL;
     }
   }
 
+  virtual ~OnlineCmvnNnet2FeaturePipeline() {
+    if (cmvn_ != NULL) delete cmvn_;
+  }
+
   virtual OnlineFeatureInterface *InputFeature() {
     return (cmvn_ != NULL) ? cmvn_ : OnlineNnet2FeaturePipeline::InputFeature();
   }
 };
 
+// The sample rate the features are computed at.
+BaseFloat FeatureSampFreq(const OnlineNnet2FeaturePipelineInfo &info) {
+  if (info.feature_type == "mfcc")
+    return info.mfcc_opts.frame_opts.samp_freq;
+  else if (info.feature_type == "plp")
+    return info.plp_opts.frame_opts.samp_freq;
+  else if (info.feature_type == "fbank")
+    return info.fbank_opts.frame_opts.samp_freq;
+  KALDI_ERR << "Unknown feature type " << info.feature_type;
+  return 0;
+}
+
+/*
+ * Keeps one DecodableNnetSimpleLoopedInfo per distinct set of looped
+ * computation options.  Building one compiles and optimizes the looped nnet
+ * computation, so it is done once per process and the result is shared
+ * read-only by all decoder threads.
+ */
+class DecodableInfoCache {
+ public:
+  explicit DecodableInfoCache(nnet3::AmNnetSimple *am_nnet);
+  ~DecodableInfoCache();
+
+  const nnet3::DecodableNnetSimpleLoopedInfo &Get(
+      const nnet3::NnetSimpleLoopedComputationOptions &opts);
+
+ private:
+  // The settings that change the compiled computation.
+  struct Key {
+    int32 frames_per_chunk;
+    int32 frame_subsampling_factor;
+    int32 extra_left_context_initial;
+    BaseFloat acoustic_scale;
+
+    explicit Key(const nnet3::NnetSimpleLoopedComputationOptions &opts);
+    bool operator < (const Key &other) const;
+  };
+  struct Entry {
+    // DecodableNnetSimpleLoopedInfo only keeps a reference to its options.
+    nnet3::NnetSimpleLoopedComputationOptions opts;
+    nnet3::DecodableNnetSimpleLoopedInfo *info;
+  };
+
+  nnet3::AmNnetSimple *_am_nnet;
+  std::map<Key, Entry*> _entries;
+  pthread_mutex_t _lock;
+};
+
+/*
+ * Decodes utterances one at a time, like SingleUtteranceNnet3Decoder, but
+ * the log-likelihoods come either from the usual looped computation of
+ * this stream alone or, with --nnet-batch-size > 1, from
+ * NnetBatchInference.  The search, with its token hash, can be kept for
+ * the next utterance on the same graph; only the decodable object, which
+ * is bound to the features, is made per utterance.
+ */
+class UtteranceDecoder {
+ public:
+  // The tokens of the search come from "arena" if it is not NULL.
+  UtteranceDecoder(const LatticeFasterDecoderConfig &config,
+                   const fst::Fst<fst::StdArc> &fst, DecoderArena *arena);
+  ~UtteranceDecoder();
+
+  // Starts an utterance on "features", dropping what is left of the last
+  // one.  Exactly one of "info" and "batch" must be non-NULL.
+  void StartUtterance(const TransitionModel &tmodel,
+                      const nnet3::DecodableNnetSimpleLoopedInfo *info,
+                      NnetBatchInference *batch,
+                      OnlineNnet2FeaturePipeline *features);
+  // Lets go of the features of the utterance, so that they can be
+  // deleted; the search is kept.
+  void EndUtterance();
+
+  // Decodes all frames the features are ready for.  The time spent in the
+  // nnet and in the search is recorded separately.
+  void AdvanceDecoding();
+  void FinalizeDecoding();
+  int32 NumFramesDecoded() const { return _decoder.NumFramesDecoded(); }
+  // Takes effect from the next frame decoded.
+  void SetOptions(const LatticeFasterDecoderConfig &config) {
+    _decoder.SetOptions(config);
+  }
+  void GetBestPath(bool end_of_utterance, Lattice *best_path) const;
+  const LatticeFasterOnlineDecoder &Decoder() const { return _decoder; }
+  DecoderArena *Arena() const { return _arena; }
+
+ private:
+  DecodableInterface *_decodable;  // NULL before the first utterance
+  DecodableNnetBatched *_batched;  // same as _decodable, or NULL
+  int32 _frames_per_chunk;  // output frames per looped nnet chunk
+  DecoderArena *_arena;
+  LatticeFasterOnlineDecoder _decoder;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(UtteranceDecoder);
+};
+
+// Where the models are read from; the same files are read again on every
+// reload.
+struct ModelSource {
+  std::string lexicon_rxfilename, nnet3_rxfilename, fst_rxfilename;
+  std::string hcl_rxfilename, word_syms_rxfilename;
+  bool mmap_graph;
+  bool quantize_nnet;
+  int32 graph_cache_mb;
+  NnetBatchInferenceConfig batch_opts;
+
+  ModelSource(): mmap_graph(false), quantize_nnet(false),
+                 graph_cache_mb(16) { }
+};
+
 /*
- * This class is for a very simple TCP server implementation
- * in UNIX sockets.
+ * The acoustic model, decoding graph, word symbols and alignment lexicon
+ * read from a ModelSource, with everything derived from them.  The pool
+ * keeps the current snapshot; an utterance takes a reference to it when
+ * it starts and gives it back when it ends.  A reload makes a new
+ * snapshot current, and the old one is deleted when the last utterance
+ * decoded with it is done.
  */
-class TcpServer {
+class ModelSnapshot {
  public:
-  TcpServer();
-  ~TcpServer();
+  explicit ModelSnapshot(int32 generation);
+  ~ModelSnapshot();
+
+  // What a decoder thread reads while decoding; with --numa-replicate
+  // every NUMA node in use has a copy of its own, otherwise there is one
+  // entry, which like entry 0 points at the members below.
+  struct NodeModels {
+    nnet3::AmNnetSimple *am_nnet;
+    fst::Fst<fst::StdArc> *fst;
+    DecodableInfoCache *decodable_infos;
+    NnetBatchInference *batch_inference;
+  };
+
+  int32 _generation;  // 1 for the models read at startup
+  TransitionModel _tmodel;
+  nnet3::AmNnetSimple _am_nnet;
+  fst::Fst<fst::StdArc> *_fst;
+  bool _fst_on_the_fly;  // _fst is composed lazily, copied per session
+  DecodableInfoCache *_decodable_infos;
+  NnetBatchInference *_batch_inference;  // NULL unless --nnet-batch-size > 1
+  fst::SymbolTable *_word_syms;
+  WordAlignLatticeLexiconInfo *_lexicon_info;
+  std::vector<NodeModels> _node_models;
+  int32 _num_refs;  // protected by DecoderPool::_models_lock
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(ModelSnapshot);
+};
 
-  bool Listen(int32 port);  // start listening on a given port
-  int32 Accept();  // accept a client and return its descriptor
+class DecoderPool;
+
+/*
+ * Decoding state of one client connection.  The reactor thread buffers
+ * the audio it receives from the client; once a chunk (--chunk-length)
+ * worth of audio, the end of an utterance or the end of the connection is
+ * buffered, the session is queued and one of the decoder threads decodes
+ * it.  A session is never run by two decoder threads at the same time, so
+ * a slow client only ties up memory, not a decoder thread.
+ */
+class DecoderSession : public EpollReactor::Handler {
+ public:
+  // "node" picks the copy of the models to use with --numa-replicate.  If
+  // "ring" is not NULL, the session takes it over and reads the audio
+  // from it instead of from the socket.
+  DecoderSession(DecoderPool *pool, int32 client_socket, ShmRing *ring,
+                 int32 node);
+  ~DecoderSession();
+
+  int32 Socket() const { return _client_socket; }
+  // What the reactor watches for input: the socket, or with a ring an
+  // epoll instance watching both the socket and the ring's doorbell.
+  // Negative if it could not be set up.
+  int32 InputFd() const { return _input_fd; }
+  int32 Node() const { return _node; }
+  const BeamController &Beam() const { return _beam; }
+
+  // Reads from the client socket; called on the reactor thread.
+  virtual void OnReadable();
+
+  // Decodes the audio buffered so far; called on a decoder thread.  If
+  // "wav_buffer" is not NULL the audio is copied into it, otherwise into a
+  // freshly allocated vector.  "wait_secs" is how long the session waited
+  // in the ready queue.  Returns true once the session is over and may be
+  // deleted.
+  bool Process(Vector<BaseFloat> *wav_buffer, double wait_secs);
 
  private:
-  struct sockaddr_in _h_addr_;
-  int32 _server_desc_;
+  // True if a decoder thread has something to do; needs _lock.
+  bool ReadyLocked() const;
+  // Reads from _ring into _recv_buffer the way recv() reads from the
+  // socket: returns the number of bytes, 0 at the end of the stream, or -1
+  // with errno EAGAIN if there is nothing to read yet, or another errno if
+  // the ring is corrupt.
+  ssize_t ReadRing();
+  void StartUtterance();
+  // Resamples "wav_data" and passes it through the VAD gate, if any, to
+  // the feature pipeline; "flush" ends the utterance.
+  void AcceptAudio(const VectorBase<BaseFloat> &wav_data, bool flush);
+  void DecodeChunk(const VectorBase<BaseFloat> &wav_data);
+  // EndpointDetected() on the decoder, with the audio the VAD gate dropped
+  // counted as if it had been decoded.
+  bool EndpointReached();
+  void SendPartialResult();
+  // Returns false if the utterance was empty.
+  bool FinishUtterance();
+
+  DecoderPool *_pool;
+  int32 _client_socket;
+  int32 _node;
+
+  // Receive side, only used on the reactor thread.
+  ShmRing *_ring;             // NULL for audio sent over the socket
+  int32 _input_fd;
+  std::vector<char> _recv_buffer;
+
+  // Buffered input, shared with the decoder threads and protected by _lock.
+  pthread_mutex_t _lock;
+  AudioStreamParser _parser;
+  RingBuffer<BaseFloat> _input;
+  int64 _input_offset;        // sample index of the first one in _input
+  std::deque<int64> _utt_ends;  // sample indexes where utterances end
+  bool _input_closed;         // the reactor is done with this session
+  bool _scheduled;            // queued or being run by a decoder thread
+  bool _paused;               // the reactor stopped reading, buffer is full
+  BaseFloat _chunk_length;    // seconds, as chosen by _scheduler
+
+  // Decoding state, only used by the decoder thread running the session.
+  ModelSnapshot *_models;     // of the running utterance, or NULL
+  fst::Fst<fst::StdArc> *_graph;  // own copy of an on-the-fly graph
+  int32 _graph_generation;    // of the models _graph was copied from
+  OnlineCmvnNnet2FeaturePipeline *_feature_pipeline;
+  // Kept for the next utterance with --reuse-decoders, NULL otherwise.
+  UtteranceDecoder *_decoder;
+  int32 _decoder_generation;  // of the models _decoder searches the graph of
+  DecoderArena *_arena;       // tokens of _decoder, NULL if not enabled
+  BaseFloat _samp_freq;       // of the client's audio
+  PolyphaseResampler *_resampler;  // NULL if it is the feature rate
+  std::vector<BaseFloat> _resampled;
+  ChunkScheduler _scheduler;
+  BeamController _beam;
+  double _process_start;      // when the running Process() call started
+  double _utt_compute_secs;   // decoder thread time spent on the utterance
+  int64 _samp_offset, _samp_partial;
+  int64 _num_allocs;          // made for the utterance in earlier Process()
+  int64 _alloc_start;         // NumThreadAllocations() when Process() began
+  Lattice _lat;
+  IncrementalTraceback _traceback;
+  ResultWriter _writer;       // results are queued here and sent at once
+  int32 _num_words_sent;      // length of the last partial result sent
+  int32 _num_words_kept;      // how much of it the best path still has
+  VadGate _vad;
+  std::vector<BaseFloat> _vad_output;  // audio passed on by _vad
+  bool _finished;             // no more results are sent to the client
+  bool _endpointed;           // the last utterance ended at an endpoint
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(DecoderSession);
 };
 
 class DecoderPool {
@@ -140,159 +418,244 @@ class DecoderPool {
 
   // Decoder related data structures
   LatticeFasterDecoderConfig _config;
-  TransitionModel _tmodel;
-  nnet3::AmNnetSimple _am_nnet;
-  fst::Fst<fst::StdArc> *_fst;
+  OnlineEndpointConfig _endpoint_config;
+  bool _do_endpointing;
+  ModelSource _source;
   OnlineCmvnNnet2FeaturePipelineInfo *_feature_info;
-  fst::SymbolTable *_word_syms;
-  WordAlignLatticeLexiconInfo *_lexicon_info;
+  BaseFloat _feature_samp_freq;
+  int32 _input_samp_freq;  // of online-audio-client format streams
+  CpuAffinityConfig _affinity;
+  CpuTopology _topology;
+
+  // Network related data structures
+  AdmissionConfig _admission;
+  PartialResultConfig _partial_config;
+  ChunkSchedulerConfig _chunk_config;
+  BeamControlConfig _beam_config;
+  VadGateConfig _vad_config;
+  ResultWriter::Format _result_format;
+  int32 _max_sessions;
+  EpollReactor _reactor;
 
   struct DecoderThread {
     DecoderPool *_pool;
     pthread_t _tid;
-
-    // Variables for network programming
-    int32 _client_socket;
-    pthread_mutex_t _lock;
-    bool _is_free;
+    int32 _node;  // index into ModelSnapshot::_node_models and _ready
   };
+
+  // Reads the models named by _source into a new snapshot; KALDI_ERRs if
+  // something cannot be read.
+  ModelSnapshot *LoadModels();
+  // Makes "models" the snapshot new utterances are decoded with.
+  void SetModels(ModelSnapshot *models);
+  // Returns the current snapshot with a reference to it, which the caller
+  // gives back with ReleaseModels().
+  ModelSnapshot *AcquireModels();
+  void ReleaseModels(ModelSnapshot *models);
+  // Loads the models again on a thread of its own and switches to them
+  // when done; does nothing while a reload is running.
+  void Reload();
+  // Number of NUMA nodes that get models of their own.
+  int32 NumModelNodes() const;
+
   static void* ThreadProc(void* para);
   void Run(const int32 &n);
-  void NewTask(int32 client_socket);
+  // Starts a session for a new connection, with the ring of a client of
+  // the shared memory transport if "ring" is not NULL.
+  void NewTask(int32 client_socket, ShmRing *ring = NULL);
+  // Accepts clients on the Unix domain socket "path" on a thread of its
+  // own.  If "ring_bytes" > 0, they use the shared memory transport and
+  // each gets a ring of that size.
+  bool StartUnixListener(const std::string &path, int32 ring_bytes);
+  // Starts "num_threads" threads accepting clients on "port" of "address",
+  // each on a socket of its own, bound with SO_REUSEPORT like the one of
+  // the main thread.
+  bool StartTcpListeners(const std::string &address, int32 port,
+                         int32 num_threads);
   bool IsBusy();
+  // Returns the time in seconds until the oldest pending connection hits
+  // --max-queue-wait, or a negative value if nothing can expire.
+  double NextExpiry();
+  // Answers pending connections that waited longer than --max-queue-wait.
+  void ExpirePending();
+
+  // Hands a session with buffered input to the decoder threads.
+  void Schedule(DecoderSession *session);
 
  private:
   DecoderThread* _decoder_threads;
   int32 _num;
+
+  // Sessions with input ready for a decoder thread, one queue per node
+  // with models of its own.
+  std::vector<JobQueue<DecoderSession*>*> _ready;
+  // Accepted clients waiting for a free session slot.
+  struct PendingClient {
+    int32 socket;
+    ShmRing *ring;
+  };
+  JobQueue<PendingClient> *_pending;
+  // Number of open sessions, in total and per entry of _ready, protected
+  // by _session_lock.
+  int32 _num_sessions;
+  std::vector<int32> _node_sessions;
+  pthread_mutex_t _session_lock;
+
+  // The current snapshot, the number of snapshots loaded so far and
+  // whether a reload is running, protected by _models_lock.
+  ModelSnapshot *_models;
+  int32 _num_loads;
+  bool _reloading;
+  pthread_mutex_t _models_lock;
+
+  void StartSession(int32 client_socket, ShmRing *ring);
+  // Tells a client that no session became free and closes it.
+  void RejectClient(const PendingClient &client);
+  void EndSession(DecoderSession *session);
+  // Adds the copies of --numa-replicate to "models".
+  void ReplicateModels(ModelSnapshot *models);
+  static void* ReloadThreadProc(void* para);
+
+  // A socket accepted on by a thread of its own, besides the one of the
+  // main thread.  Owned by the thread, which runs until the program exits.
+  struct Listener {
+    DecoderPool *pool;
+    TcpServer server;
+    int32 ring_bytes;  // > 0 for the shared memory transport
+  };
+  bool StartListener(Listener *listener);
+  static void* ListenerProc(void* para);
 };
 
-bool WriteLine(int32 socket, std::string line) {
-  line = line + "\n";
+/*
+ * Decodes a table of wav files, e.g. recorded calls, with the models of a
+ * DecoderPool instead of serving clients.  Every decoder thread takes the
+ * next file from the table as soon as it is done with one, so that all
+ * cores stay busy however long the files are, and decodes it as a single
+ * utterance, all audio at once, without partial results.  Words go to a
+ * CTM file and/or a text file, in the order the files are finished.
+ */
+class BatchDecoder {
+ public:
+  explicit BatchDecoder(DecoderPool *pool);
+  ~BatchDecoder();
+
+  // Empty filenames mean no output of that kind.  Returns the number of
+  // files that could not be decoded.
+  int32 Run(const std::string &wav_rspecifier,
+            const std::string &ctm_wxfilename,
+            const std::string &text_wxfilename, int32 num_threads);
 
-  const char* p = line.c_str();
-  int32 to_write = line.size();
-  int32 wrote = 0;
-  while (to_write > 0) {
-    int32 ret = write(socket, p + wrote, to_write);
-    if (ret <= 0)
-      return false;
+ private:
+  struct Worker {
+    BatchDecoder *_batch;
+    pthread_t _tid;
+    int32 _node;  // index into ModelSnapshot::_node_models
+    fst::Fst<fst::StdArc> *_graph;  // own copy of an on-the-fly graph
+    int32 _graph_generation;
+    DecoderArena *_arena;
+  };
 
-    to_write -= ret;
-    wrote += ret;
-  }
+  static void* ThreadProc(void* para);
+  // Hands out the next file, channel 0 only; returns false at the end.
+  bool NextFile(std::string *key, Vector<BaseFloat> *wave,
+                BaseFloat *samp_freq);
+  // Returns false if the file could not be decoded.
+  bool DecodeFile(Worker *worker, const std::string &key,
+                  const Vector<BaseFloat> &wave, BaseFloat samp_freq);
+
+  DecoderPool *_pool;
+  // The table, the outputs and the counts, protected by _lock.
+  pthread_mutex_t _lock;
+  SequentialTableReader<WaveHolder> *_reader;
+  Output *_ctm;
+  Output *_text;
+  int32 _num_done, _num_failed;
+  double _audio_secs;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(BatchDecoder);
+};
 
-  return true;
+// Word-aligns the best path "lat" and returns the words, their start
+// frames and lengths, silences included as word 0.
+void AlignBestPath(const Lattice &lat, const TransitionModel &tmodel,
+                   const WordAlignLatticeLexiconInfo &lexicon_info,
+                   std::vector<int32> *words, std::vector<int32> *times,
+                   std::vector<int32> *lengths) {
+  ScopedLatency timer(kStageWordAlign);
+  CompactLattice best_path_clat;
+  ConvertLattice(lat, &best_path_clat);
+
+  CompactLattice aligned_clat;
+  WordAlignLatticeLexiconOpts opts;
+  bool ok = WordAlignLatticeLexicon(best_path_clat, tmodel, lexicon_info,
+                                    opts, &aligned_clat);
+  TopSortCompactLatticeIfNeeded(&aligned_clat);
+  CompactLatticeToWordAlignment((ok ? aligned_clat : best_path_clat),
+                                words, times, lengths);
 }
 
 void GetDiagnosticsAndPrintOutput(
-    int32 socket,
-    bool end_of_utterance,
-    int32 start_time,
+    ResultWriter *writer,
+    double reco_secs,
     const std::string &utt,
     const TransitionModel &tmodel,
     const WordAlignLatticeLexiconInfo &lexicon_info,
     const fst::SymbolTable *word_syms,
+    const VadGate *vad,
     const Lattice &lat,
-    int64 tot_samples) {
-  if (!end_of_utterance) {
-    LatticeWeight weight;
-    std::vector<int32> alignment;
-    std::vector<int32> words;
-    GetLinearSymbolSequence(lat, &alignment, &words, &weight);
-
-    if (word_syms != NULL) {
-      std::string result = "";
-      for (size_t i = 0; i < words.size(); i++) {
-        std::string s = word_syms->Find(words[i]);
-        if (s != "") {
-          if (result != "") result += " ";
-          result += s;
-        }
-      }
-      if (result != "") {
-        result = "PARTIAL:" + result;
-        WriteLine(socket, result);
-        KALDI_VLOG(1) << "Partial result: " << result;
-      }
-    }
-  } else {
-    std::vector<int32> words, times, lengths;
-
-    CompactLattice best_path_clat;
-    CompactLattice aligned_lat;
-    ConvertLattice(lat, &best_path_clat);
-
-    CompactLattice aligned_clat;
-    WordAlignLatticeLexiconOpts opts;
-    bool ok = WordAlignLatticeLexicon(best_path_clat, tmodel, lexicon_info,
-                                      opts, &aligned_clat);
-    TopSortCompactLatticeIfNeeded(&aligned_clat);
-    CompactLatticeToWordAlignment((ok ? aligned_clat : best_path_clat), &words,
-                                  &times, &lengths);
+    double input_secs) {
+  std::vector<int32> words, times, lengths;
+  AlignBestPath(lat, tmodel, lexicon_info, &words, &times, &lengths);
+
+  int32 words_num = 0;
+  for (size_t i = 0; i < words.size(); i++) {
+    if (words[i] != 0)
+      words_num++;
+  }
 
-    int32 words_num = 0;
-    for (size_t i = 0; i < words.size(); i++) {
-      if (words[i] != 0)
-        words_num++;
+  // RECO-DUR is the wall clock time decoder threads spent on the
+  // utterance.
+  float dur = reco_secs;
+  float input_dur = input_secs;
+
+  ScopedLatency timer(kStageResultWrite);
+  writer->BeginFinal(words_num, dur, input_dur);
+  std::string result = "";
+  for (size_t i = 0; i < words.size(); i++) {
+    if (words[i] == 0)
+      continue;   // skip silences...
+
+    std::string word;
+    if (word_syms != NULL) word = word_syms->Find(words[i]);
+    if (word.empty()) {
+      word = "???";
+    } else if (GetVerboseLevel() >= 1) {
+      if (result != "") result += " ";
+      result += word;
     }
 
-    float dur = (clock() - start_time) / static_cast<float> (CLOCKS_PER_SEC);
-    float input_dur = tot_samples / 16000.0;
-
-    std::stringstream sstr;
-    sstr << "RESULT:NUM=" << words_num << ",FORMAT=WSE,RECO-DUR=" << dur
-         << ",INPUT-DUR=" << input_dur;
-    WriteLine(socket, sstr.str());
-    KALDI_VLOG(1) << sstr.str();
-
-    std::string result = "";
-    for (size_t i = 0; i < words.size(); i++) {
-      if (words[i] == 0)
-        continue;   // skip silences...
-
-      std::string word;
-      if (word_syms != NULL) word = word_syms->Find(words[i]);
-      if (word.empty()) {
-        word = "???";
-      } else {
-        if (result != "") result += " ";
-        result += word;
-      }
-
-      float start = times[i] * secs_per_frame;
-      float len = lengths[i] * secs_per_frame;
-
-      std::stringstream wstr;
-      wstr << "RESULT:WORD=" << word << "," << start << "," << (start + len);
-
-      WriteLine(socket, wstr.str());
-      KALDI_VLOG(1) << wstr.str();
-    }
-    if (result != "") {
-      KALDI_VLOG(1) << "FINAL result: " << result;
+    float start = times[i] * secs_per_frame;
+    float end = (times[i] + lengths[i]) * secs_per_frame;
+    if (vad != NULL) {
+      // times refer to the audio the VAD let through
+      start = vad->FedToReceivedSecs(start);
+      end = vad->FedToReceivedSecs(end);
     }
+    writer->AddFinalWord(word, start, end);
+  }
+  writer->EndFinal();
+  if (result != "") {
+    KALDI_VLOG(1) << "FINAL result: " << result;
   }
-}
-
-fst::Fst<fst::StdArc> *ReadFstKaldi_(std::string rxfilename) {
-  if (rxfilename == "") rxfilename = "-";  // interpret "" as stdin,
-  // for compatibility with OpenFst conventions.
-  kaldi::Input ki(rxfilename);
-  fst::FstHeader hdr;
-  if (!hdr.Read(ki.Stream(), rxfilename))
-    KALDI_ERR << "Reading FST: error reading FST header from "
-              << kaldi::PrintableRxfilename(rxfilename);
-  fst::FstReadOptions ropts("<unspecified>", &hdr);
-  KALDI_VLOG(1) << "fst type is " << hdr.FstType();
-  fst::Fst<fst::StdArc> *fst = fst::Fst<fst::StdArc>::Read(ki.Stream(), ropts);
-  if (!fst)
-    KALDI_ERR << "Could not read fst from "
-              << kaldi::PrintableRxfilename(rxfilename);
-  return fst;
 }
 
 }  // namespace kaldi
 
+static void RequestReload(int signum) {
+  reload_requested = 1;
+}
+
 int main(int argc, char *argv[]) {
   mcheck(NULL);
   try {
@@ -308,26 +671,50 @@ int main(int argc, char *argv[]) {
         "whose filenames are passed as options\n"
         "\n"
         "Usage: audio-server-online2-nnet3 [options] <lexicon-file> "
-        "<nnet3-in> <fst-in>\n";
+        "<nnet3-in> <fst-in>\n"
+        "<fst-in> is HCLG, or G if --hcl-fst is given.\n";
 
     kaldi::DecoderPool decoder_pool;
     kaldi::ParseOptions po(usage);
+    kaldi::NnetBatchInferenceConfig batch_opts;
+    kaldi::ResultWriterConfig result_config;
 
     std::string word_syms_rxfilename;
 
     // feature_opts includes configuration for the iVector adaptation,
     // as well as the basic features.
     kaldi::OnlineCmvnNnet2FeaturePipelineConfig feature_opts;
-    kaldi::OnlineEndpointConfig endpoint_opts;
 
     bool modify_ivector_config = false;
     int32 server_port_number = 5010;
+    int32 metrics_port_number = 0;
+    bool mmap_graph = false;
+    bool quantize_nnet = false;
+    int32 decoder_arena_mb = 0;
+    std::string hcl_rxfilename;
+    int32 graph_cache_mb = 16;
+    std::string batch_wav_rspecifier, batch_ctm_wxfilename,
+        batch_text_wxfilename;
+    std::string shm_socket_path;
+    int32 shm_ring_kb = 1024;
+    kaldi::ListenConfig listen_config;
 
     po.Register("chunk-length", &chunk_length_secs,
                 "Length of chunk size in seconds, that we process.  "
                 "Set to <= 0 to use all input in one chunk.");
     po.Register("packet-size", &packet_size,
-                "Send this many bytes per packet");
+                "Read at most this many bytes from a client at a time");
+    po.Register("mmap-graph", &mmap_graph,
+                "If true, memory map the decoding graph instead of reading "
+                "it; it must be a ConstFst, e.g. converted with fstconvert "
+                "--fst_type=const --fst_align=true");
+    po.Register("hcl-fst", &hcl_rxfilename,
+                "If set, <fst-in> is the grammar G, and the decoding graph "
+                "is composed on the fly from this olabel_lookahead HCL and "
+                "G instead of being read as a static HCLG");
+    po.Register("graph-cache-mb", &graph_cache_mb,
+                "With --hcl-fst, maximum size in MB of the graph states "
+                "each session keeps expanded");
     po.Register("word-symbol-table", &word_syms_rxfilename,
                 "Symbol table for words [for debug output]");
     po.Register("modify-ivector-config", &modify_ivector_config,
@@ -342,41 +729,149 @@ int main(int argc, char *argv[]) {
                 "Number of threads used when initializing iVector extractor.");
     po.Register("server-port-number", &server_port_number,
                 "Tcp based Server port number for accepting tasks");
+    po.Register("metrics-port-number", &metrics_port_number,
+                "If > 0, per-stage latency percentiles and real-time factors "
+                "are served as text on this port of the loopback interface");
+    po.Register("reuse-decoders", &reuse_decoders,
+                "If true, each session keeps its search, with the token "
+                "hash, from one utterance to the next, and each decoder "
+                "thread copies audio into one buffer for all sessions "
+                "instead of allocating one for every chunk.  Allocation "
+                "counts per utterance are logged at verbose level 1.");
+    po.Register("do-endpointing", &decoder_pool._do_endpointing,
+                "If true, apply endpoint detection: an utterance also ends "
+                "at an endpoint, and decoding continues on the same "
+                "connection with a new utterance");
+    po.Register("input-sample-rate", &decoder_pool._input_samp_freq,
+                "Sample rate of clients sending the online-audio-client "
+                "format; framed clients announce theirs.  Audio at another "
+                "rate than the features is resampled.  0 means the feature "
+                "rate.");
+    po.Register("quantize-nnet", &quantize_nnet,
+                "If true, affine components of the acoustic model are "
+                "quantized to 8 bits and run with integer kernels on the "
+                "CPU.  See nnet-quantize-compare for the effect on "
+                "accuracy.");
+    po.Register("decoder-arena-mb", &decoder_arena_mb,
+                "If > 0, address space in MB reserved for slab allocators "
+                "that hold the tokens and lattice links of the search, one "
+                "per session, emptied at the end of every utterance.  0 "
+                "leaves them to malloc().");
+    po.Register("batch-wav-rspecifier", &batch_wav_rspecifier,
+                "If set, no clients are served; the wav files of this table "
+                "are decoded instead, each as one utterance, with all "
+                "--num-threads-startup threads, and the program exits");
+    po.Register("batch-ctm-wxfilename", &batch_ctm_wxfilename,
+                "With --batch-wav-rspecifier, where to write the words as "
+                "CTM");
+    po.Register("batch-text-wxfilename", &batch_text_wxfilename,
+                "With --batch-wav-rspecifier, where to write the words as "
+                "text, one line per file");
+    po.Register("shm-socket-path", &shm_socket_path,
+                "If set, clients on this host may connect to this Unix "
+                "domain socket and write their audio into a shared memory "
+                "ring instead of sending it over TCP; results still go "
+                "over the socket");
+    po.Register("shm-ring-kb", &shm_ring_kb,
+                "With --shm-socket-path, size in KB of the ring of each "
+                "client, rounded up to a power of 2");
+    po.Register("max-sessions", &decoder_pool._max_sessions,
+                "Maximum number of connections decoded at the same time; "
+                "they share the --num-threads-startup decoder threads");
 
     decoder_pool._config.Register(&po);
+    decoder_pool._admission.Register(&po);
+    listen_config.Register(&po);
+    decoder_pool._partial_config.Register(&po);
+    decoder_pool._chunk_config.Register(&po);
+    decoder_pool._beam_config.Register(&po);
+    decoder_pool._vad_config.Register(&po);
+    decoder_pool._affinity.Register(&po);
+    result_config.Register(&po);
 
     feature_opts.Register(&po);
     decodable_opts.Register(&po);
-    endpoint_opts.Register(&po);
+    batch_opts.Register(&po);
+    decoder_pool._endpoint_config.Register(&po);
 
     po.Read(argc, argv);
     secs_per_frame = 0.01 * decodable_opts.frame_subsampling_factor;
+    if (decoder_pool._max_sessions <= 0 || packet_size <= 0 ||
+        batch_opts.batch_size <= 0 || graph_cache_mb <= 0)
+      KALDI_ERR << "--max-sessions, --packet-size, --nnet-batch-size and "
+                << "--graph-cache-mb must be positive";
+    if (!kaldi::ResultWriter::ParseFormat(result_config.format,
+                                          &decoder_pool._result_format))
+      KALDI_ERR << "Unknown --result-format " << result_config.format;
+    if (decoder_arena_mb > 0 &&
+        !kaldi::InitDecoderArenas(static_cast<int64>(decoder_arena_mb) << 20))
+      KALDI_ERR << "Cannot set up --decoder-arena-mb=" << decoder_arena_mb;
+    const kaldi::ChunkSchedulerConfig &chunk_config =
+        decoder_pool._chunk_config;
+    if (chunk_config.adaptive &&
+        (chunk_length_secs <= 0 ||
+         chunk_config.max_chunk_length < chunk_length_secs ||
+         chunk_config.shrink_wait >= chunk_config.grow_wait))
+      KALDI_ERR << "--adaptive-chunk needs a positive --chunk-length, a "
+                << "--max-chunk-length at least as long and "
+                << "--chunk-shrink-wait below --chunk-grow-wait";
+    const kaldi::BeamControlConfig &beam_config = decoder_pool._beam_config;
+    if (beam_config.adaptive &&
+        (beam_config.min_beam <= 0 || beam_config.min_max_active <= 0 ||
+         beam_config.relax_rtf >= beam_config.tighten_rtf))
+      KALDI_ERR << "--adaptive-beam needs a positive --min-beam and "
+                << "--min-max-active, and --beam-relax-rtf below "
+                << "--beam-tighten-rtf";
+    if (shm_socket_path != "" && (shm_ring_kb <= 0 || shm_ring_kb > (1 << 20)))
+      KALDI_ERR << "--shm-ring-kb must be between 1 and " << (1 << 20);
+    if (listen_config.num_acceptors <= 0)
+      KALDI_ERR << "--num-acceptors must be positive";
+    if (shm_socket_path != "" &&
+        shm_socket_path == listen_config.unix_socket_path)
+      KALDI_ERR << "--shm-socket-path and --unix-socket-path must differ";
+    kaldi::CpuAffinityConfig &affinity = decoder_pool._affinity;
+    if (affinity.pin_threads != "none" && affinity.pin_threads != "node" &&
+        affinity.pin_threads != "cpu")
+      KALDI_ERR << "Unknown --pin-decoder-threads " << affinity.pin_threads;
+    if (affinity.numa_replicate && affinity.pin_threads == "none")
+      affinity.pin_threads = "node";
 
     if (po.NumArgs() != 3) {
       po.PrintUsage();
       return 1;
     }
 
-    std::string align_lexicon_rxfilename = po.GetArg(1),
-        nnet3_rxfilename = po.GetArg(2),
-        fst_rxfilename = po.GetArg(3);
-
-    std::vector<std::vector<int32> > lexicon;
-    {
-      bool binary_in;
-      kaldi::Input ki(align_lexicon_rxfilename, &binary_in);
-      KALDI_ASSERT(!binary_in && "Not expecting binary file for lexicon");
-      if (!kaldi::ReadLexiconForWordAlign(ki.Stream(), &lexicon)) {
-        KALDI_ERR << "Error reading alignment lexicon from "
-                  << align_lexicon_rxfilename;
-      }
-    }
-
-    decoder_pool._lexicon_info =
-        new kaldi::WordAlignLatticeLexiconInfo(lexicon);
+    kaldi::ModelSource &source = decoder_pool._source;
+    source.lexicon_rxfilename = po.GetArg(1);
+    source.nnet3_rxfilename = po.GetArg(2);
+    source.fst_rxfilename = po.GetArg(3);
+    source.hcl_rxfilename = hcl_rxfilename;
+    source.word_syms_rxfilename = word_syms_rxfilename;
+    source.mmap_graph = mmap_graph;
+    source.quantize_nnet = quantize_nnet;
+    source.graph_cache_mb = graph_cache_mb;
+    source.batch_opts = batch_opts;
+
+    // SIGHUP reloads the models.  It is blocked in every thread started
+    // from here on, so that only this one takes it, interrupting the wait
+    // for connections.
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, NULL);
 
     decoder_pool._feature_info =
         new kaldi::OnlineCmvnNnet2FeaturePipelineInfo(feature_opts);
+    decoder_pool._feature_samp_freq =
+        kaldi::FeatureSampFreq(*decoder_pool._feature_info);
+    if (decoder_pool._input_samp_freq == 0)
+      decoder_pool._input_samp_freq = decoder_pool._feature_samp_freq;
+    if (decoder_pool._input_samp_freq != decoder_pool._feature_samp_freq &&
+        !kaldi::PolyphaseResampler::Supported(
+            decoder_pool._input_samp_freq, decoder_pool._feature_samp_freq))
+      KALDI_ERR << "Cannot resample --input-sample-rate="
+                << decoder_pool._input_samp_freq << " to "
+                << decoder_pool._feature_samp_freq;
     if (modify_ivector_config) {
       decoder_pool._feature_info
           ->ivector_extractor_info.use_most_recent_ivector = true;
@@ -384,42 +879,56 @@ int main(int argc, char *argv[]) {
           ->ivector_extractor_info.greedy_ivector_extractor = true;
     }
 
-    {
-      bool binary;
-      kaldi::Input ki(nnet3_rxfilename, &binary);
-      decoder_pool._tmodel.Read(ki.Stream(), binary);
-      decoder_pool._am_nnet.Read(ki.Stream(), binary);
-      kaldi::nnet3::SetBatchnormTestMode(
-          true, &(decoder_pool._am_nnet.GetNnet()));
-      kaldi::nnet3::SetDropoutTestMode(
-          true, &(decoder_pool._am_nnet.GetNnet()));
-      kaldi::nnet3::CollapseModel(
-          kaldi::nnet3::CollapseModelConfig(),
-            &(decoder_pool._am_nnet.GetNnet()));
+    decoder_pool.SetModels(decoder_pool.LoadModels());
+    if (batch_wav_rspecifier != "") {
+      if (batch_ctm_wxfilename == "" && batch_text_wxfilename == "")
+        KALDI_WARN << "Neither --batch-ctm-wxfilename nor "
+                   << "--batch-text-wxfilename is given";
+      kaldi::BatchDecoder batch_decoder(&decoder_pool);
+      int32 num_failed = batch_decoder.Run(
+          batch_wav_rspecifier, batch_ctm_wxfilename, batch_text_wxfilename,
+          kaldi::g_num_threads);
+      KALDI_VLOG(1) << "\n" << kaldi::FormatLatencyMetrics();
+      return (num_failed == 0 ? 0 : 1);
     }
-
-    // this object contains precomputed stuff that is used by all decodable
-    // objects.  It takes a pointer to am_nnet because if it has iVectors it has
-    // to modify the nnet to accept iVectors at intervals.
-    kaldi::nnet3::DecodableNnetSimpleLoopedInfo decodable_info(
-        decodable_opts, &(decoder_pool._am_nnet));
-
-    decoder_pool._fst = fst::ReadFstKaldiGeneric(fst_rxfilename);
-    if (word_syms_rxfilename != "")
-      if (!(decoder_pool._word_syms =
-          fst::SymbolTable::ReadText(word_syms_rxfilename)))
-        KALDI_ERR << "Could not read symbol table from file "
-                  << word_syms_rxfilename;
-
     decoder_pool.Run(kaldi::g_num_threads);
 
+    kaldi::MetricsServer metrics_server;
+    if (metrics_port_number > 0 && !metrics_server.Start(metrics_port_number))
+      return 0;
+
+    // The main thread accepts on the first socket, the other
+    // --num-acceptors threads each on one of their own.
     kaldi::TcpServer tcp_server;
-    if (!tcp_server.Listen(server_port_number))
+    if (!tcp_server.Listen(listen_config.address, server_port_number,
+                           decoder_pool._admission.listen_backlog,
+                           listen_config.num_acceptors > 1) ||
+        !decoder_pool.StartTcpListeners(listen_config.address,
+                                        server_port_number,
+                                        listen_config.num_acceptors - 1))
+      return 0;
+    if (listen_config.unix_socket_path != "" &&
+        !decoder_pool.StartUnixListener(listen_config.unix_socket_path, 0))
       return 0;
+    if (shm_socket_path != "" &&
+        !decoder_pool.StartUnixListener(shm_socket_path, shm_ring_kb << 10))
+      return 0;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = RequestReload;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);  // no SA_RESTART: accept() returns
+    pthread_sigmask(SIG_UNBLOCK, &reload_signals, NULL);
 
     int testcase_num = 0;
     while (true) {
-      decoder_pool.NewTask(tcp_server.Accept());
+      decoder_pool.NewTask(tcp_server.Accept(decoder_pool.NextExpiry()));
+      decoder_pool.ExpirePending();
+      if (reload_requested) {
+        reload_requested = 0;
+        decoder_pool.Reload();
+      }
       // testcase_num++;
       if (testcase_num > 5) {
         while (true) {
@@ -441,88 +950,851 @@ int main(int argc, char *argv[]) {
 namespace kaldi {
 
 // IMPLEMENTATION OF THE CLASSES/METHODS ABOVE MAIN
-TcpServer::TcpServer() {
-  _server_desc_ = -1;
+DecodableInfoCache::Key::Key(
+    const nnet3::NnetSimpleLoopedComputationOptions &opts):
+    frames_per_chunk(opts.frames_per_chunk),
+    frame_subsampling_factor(opts.frame_subsampling_factor),
+    extra_left_context_initial(opts.extra_left_context_initial),
+    acoustic_scale(opts.acoustic_scale) { }
+
+bool DecodableInfoCache::Key::operator < (const Key &other) const {
+  if (frames_per_chunk != other.frames_per_chunk)
+    return frames_per_chunk < other.frames_per_chunk;
+  if (frame_subsampling_factor != other.frame_subsampling_factor)
+    return frame_subsampling_factor < other.frame_subsampling_factor;
+  if (extra_left_context_initial != other.extra_left_context_initial)
+    return extra_left_context_initial < other.extra_left_context_initial;
+  return acoustic_scale < other.acoustic_scale;
 }
 
-bool TcpServer::Listen(int32 port) {
-  _h_addr_.sin_addr.s_addr = INADDR_ANY;
-  _h_addr_.sin_port = htons(port);
-  _h_addr_.sin_family = AF_INET;
+DecodableInfoCache::DecodableInfoCache(nnet3::AmNnetSimple *am_nnet):
+    _am_nnet(am_nnet) {
+  pthread_mutex_init(&_lock, NULL);
+}
 
-  _server_desc_ = socket(AF_INET, SOCK_STREAM, 0);
+DecodableInfoCache::~DecodableInfoCache() {
+  std::map<Key, Entry*>::iterator iter;
+  for (iter = _entries.begin(); iter != _entries.end(); ++iter) {
+    delete iter->second->info;
+    delete iter->second;
+  }
+  pthread_mutex_destroy(&_lock);
+}
 
-  if (_server_desc_ == -1) {
-    KALDI_ERR << "Cannot create TCP socket!";
-    return false;
+const nnet3::DecodableNnetSimpleLoopedInfo &DecodableInfoCache::Get(
+    const nnet3::NnetSimpleLoopedComputationOptions &opts) {
+  Key key(opts);
+  // The lock is held while compiling, because DecodableNnetSimpleLoopedInfo
+  // may modify the nnet.
+  pthread_mutex_lock(&_lock);
+  std::map<Key, Entry*>::iterator iter = _entries.find(key);
+  if (iter == _entries.end()) {
+    Timer timer;
+    Entry *entry = new Entry;
+    entry->opts = opts;
+    entry->info = new nnet3::DecodableNnetSimpleLoopedInfo(entry->opts,
+                                                          _am_nnet);
+    iter = _entries.insert(std::make_pair(key, entry)).first;
+    KALDI_VLOG(1) << "Compiled looped computation for frames-per-chunk="
+                  << key.frames_per_chunk << " in " << timer.Elapsed()
+                  << " seconds";
   }
+  const nnet3::DecodableNnetSimpleLoopedInfo &info = *(iter->second->info);
+  pthread_mutex_unlock(&_lock);
+  return info;
+}
 
-  int32 flag = 1;
-  int32 len = sizeof(int32);
-  if (setsockopt(_server_desc_, SOL_SOCKET, SO_REUSEADDR, &flag, len) == -1) {
-    KALDI_ERR << "Cannot set socket options!\n";
-    return false;
+ModelSnapshot::ModelSnapshot(int32 generation):
+    _generation(generation), _fst(NULL), _fst_on_the_fly(false),
+    _decodable_infos(NULL), _batch_inference(NULL), _word_syms(NULL),
+    _lexicon_info(NULL), _num_refs(0) { }
+
+ModelSnapshot::~ModelSnapshot() {
+  for (size_t n = 1; n < _node_models.size(); n++) {
+    delete _node_models[n].batch_inference;
+    delete _node_models[n].decodable_infos;
+    delete _node_models[n].fst;
+    delete _node_models[n].am_nnet;
   }
+  if (_fst != NULL) delete _fst;
+  if (_decodable_infos != NULL) delete _decodable_infos;
+  if (_batch_inference != NULL) delete _batch_inference;
+  if (_word_syms != NULL) delete _word_syms;
+  if (_lexicon_info != NULL) delete _lexicon_info;
+}
 
-  if (bind(_server_desc_, (struct sockaddr*) &_h_addr_, sizeof(_h_addr_))
-      == -1) {
-    KALDI_ERR << "Cannot bind to port: " << port << " (is it taken?)";
-    return false;
+DecoderPool::DecoderPool() {
+  _num = 0;
+  _decoder_threads = NULL;
+  _feature_info = NULL;
+  _feature_samp_freq = 16000;
+  _input_samp_freq = 0;
+  _do_endpointing = false;
+  _result_format = ResultWriter::kText;
+  _max_sessions = 64;
+  _pending = NULL;
+  _num_sessions = 0;
+  _models = NULL;
+  _num_loads = 0;
+  _reloading = false;
+  pthread_mutex_init(&_session_lock, NULL);
+  pthread_mutex_init(&_models_lock, NULL);
+}
+
+DecoderPool::~DecoderPool() {
+  if (_models != NULL) ReleaseModels(_models);
+  if (_feature_info != NULL) delete _feature_info;
+  if (_decoder_threads != NULL) delete[] _decoder_threads;
+  for (size_t n = 0; n < _ready.size(); n++) delete _ready[n];
+  if (_pending != NULL) delete _pending;
+  pthread_mutex_destroy(&_session_lock);
+  pthread_mutex_destroy(&_models_lock);
+}
+
+UtteranceDecoder::UtteranceDecoder(
+    const LatticeFasterDecoderConfig &config,
+    const fst::Fst<fst::StdArc> &fst, DecoderArena *arena):
+    _decodable(NULL), _batched(NULL), _frames_per_chunk(1), _arena(arena),
+    _decoder(fst, config) { }
+
+UtteranceDecoder::~UtteranceDecoder() {
+  if (_decodable != NULL) delete _decodable;
+}
+
+void UtteranceDecoder::StartUtterance(
+    const TransitionModel &tmodel,
+    const nnet3::DecodableNnetSimpleLoopedInfo *info,
+    NnetBatchInference *batch, OnlineNnet2FeaturePipeline *features) {
+  KALDI_ASSERT((info == NULL) != (batch == NULL));
+  if (_decodable != NULL) delete _decodable;
+  _batched = NULL;
+  _frames_per_chunk = 1;
+  if (batch != NULL) {
+    _batched = new DecodableNnetBatched(tmodel, batch,
+                                        features->InputFeature());
+    _decodable = _batched;
+  } else {
+    _decodable = new nnet3::DecodableAmNnetLoopedOnline(
+        tmodel, *info, features->InputFeature(), features->IvectorFeature());
+    _frames_per_chunk = std::max(
+        1, info->frames_per_chunk / info->opts.frame_subsampling_factor);
   }
+  // frees the tokens of the last utterance, if any
+  ScopedDecoderArena scope(_arena);
+  _decoder.InitDecoding();
+}
 
-  if (listen(_server_desc_, 1) == -1) {
-    KALDI_ERR << "Cannot listen on port!";
-    return false;
+void UtteranceDecoder::EndUtterance() {
+  if (_decodable != NULL) delete _decodable;
+  _decodable = NULL;
+  _batched = NULL;
+}
+
+void UtteranceDecoder::AdvanceDecoding() {
+  double nnet_secs = 0.0, decode_secs = 0.0, start = MonotonicSeconds();
+  if (_batched != NULL) {
+    _batched->ComputeReadyChunks(_decoder.NumFramesDecoded());
+    double now = MonotonicSeconds();
+    nnet_secs = now - start;
+    {
+      ScopedDecoderArena scope(_arena);
+      _decoder.AdvanceDecoding(_decodable);
+    }
+    decode_secs = MonotonicSeconds() - now;
+  } else {
+    // The looped decodable runs the nnet lazily, a chunk at a time, when
+    // the search first asks for a frame of it.  Asking for the first frame
+    // of each chunk before searching it keeps the two apart.
+    int32 num_frames_ready = _decodable->NumFramesReady();
+    while (_decoder.NumFramesDecoded() < num_frames_ready) {
+      int32 frame = _decoder.NumFramesDecoded();
+      _decodable->LogLikelihood(frame, 1);  // transition-ids start at 1
+      double now = MonotonicSeconds();
+      nnet_secs += now - start;
+      {
+        ScopedDecoderArena scope(_arena);
+        _decoder.AdvanceDecoding(
+            _decodable, _frames_per_chunk - frame % _frames_per_chunk);
+      }
+      start = MonotonicSeconds();
+      decode_secs += start - now;
+      if (_decoder.NumFramesDecoded() == frame) break;
+    }
   }
+  RecordLatency(kStageNnet, nnet_secs);
+  RecordLatency(kStageDecode, decode_secs);
+}
 
-  KALDI_VLOG(1) << "TcpServer: Listening on port: " << port;
+void UtteranceDecoder::FinalizeDecoding() {
+  ScopedLatency timer(kStageDecode);
+  ScopedDecoderArena scope(_arena);
+  _decoder.FinalizeDecoding();
+}
 
-  return true;
+void UtteranceDecoder::GetBestPath(bool end_of_utterance,
+                                   Lattice *best_path) const {
+  ScopedLatency timer(kStageBestPath);
+  _decoder.GetBestPath(best_path, end_of_utterance);
 }
 
-TcpServer::~TcpServer() {
-  if (_server_desc_ != -1)
-    close(_server_desc_);
+DecoderSession::DecoderSession(DecoderPool *pool, int32 client_socket,
+                               ShmRing *ring, int32 node):
+    _pool(pool), _client_socket(client_socket), _node(node), _ring(ring),
+    _input_fd(client_socket), _input_offset(0),
+    _input_closed(false), _scheduled(false), _paused(false),
+    _chunk_length(chunk_length_secs), _models(NULL),
+    _graph(NULL), _graph_generation(0), _feature_pipeline(NULL), _decoder(NULL),
+    _decoder_generation(0),
+    _arena(DecoderArenasEnabled() ? new DecoderArena : NULL),
+    _samp_freq(pool->_input_samp_freq), _resampler(NULL),
+    _scheduler(pool->_chunk_config, chunk_length_secs,
+               pool->_partial_config.interval),
+    _beam(pool->_beam_config, pool->_config),
+    _process_start(0.0), _utt_compute_secs(0.0), _samp_offset(0),
+    _samp_partial(0), _num_allocs(0), _alloc_start(0), _num_words_sent(0),
+    _num_words_kept(0),
+    _vad(pool->_vad_config), _finished(false), _endpointed(false) {
+  _writer.SetFormat(_pool->_result_format);
+  pthread_mutex_init(&_lock, NULL);
+  if (_ring != NULL) {
+    // The reactor calls a handler once per ready descriptor, so the two
+    // descriptors are merged into one.
+    _input_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = NULL;
+    if (_input_fd == -1 ||
+        epoll_ctl(_input_fd, EPOLL_CTL_ADD, _client_socket, &ev) == -1 ||
+        epoll_ctl(_input_fd, EPOLL_CTL_ADD, _ring->DoorbellFd(), &ev) == -1) {
+      KALDI_WARN << "Cannot watch the ring of session " << _client_socket
+                 << ": " << strerror(errno);
+      if (_input_fd != -1) close(_input_fd);
+      _input_fd = -1;
+    }
+  }
 }
 
-int32 TcpServer::Accept() {
-  KALDI_VLOG(1) << "Waiting for client...";
+DecoderSession::~DecoderSession() {
+  if (_decoder != NULL) delete _decoder;
+  if (_feature_pipeline != NULL) delete _feature_pipeline;
+  if (_graph != NULL) delete _graph;
+  if (_arena != NULL) delete _arena;
+  if (_models != NULL) _pool->ReleaseModels(_models);
+  if (_resampler != NULL) delete _resampler;
+  if (_ring != NULL) {
+    if (_input_fd != -1) close(_input_fd);
+    delete _ring;
+  }
+  close(_client_socket);
+  pthread_mutex_destroy(&_lock);
+}
 
-  socklen_t len;
+bool DecoderSession::ReadyLocked() const {
+  int32 chunk_length;
+  if (_chunk_length > 0) {
+    chunk_length = static_cast <int32> (_samp_freq * _chunk_length);
+    if (chunk_length == 0) chunk_length = 1;
+  } else {
+    chunk_length = std::numeric_limits<int32>::max();
+  }
+  return _input_closed || !_utt_ends.empty() || _input.Size() >= chunk_length;
+}
 
-  len = sizeof(struct sockaddr);
-  int32 client_desc = accept(_server_desc_, (struct sockaddr*) &_h_addr_, &len);
+void DecoderSession::OnReadable() {
+  ScopedLatency timer(kStageSocketRead);
+  ssize_t ret;
+  if (_ring != NULL) {
+    ret = ReadRing();
+  } else {
+    _recv_buffer.resize(packet_size);
+    ret = recv(_client_socket, &(_recv_buffer[0]), _recv_buffer.size(),
+               MSG_DONTWAIT);
+  }
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+
+  bool schedule = false, pause = false, closed = (ret <= 0);
+  if (ret > 0) {
+    pthread_mutex_lock(&_lock);
+    bool ok = _parser.Parse(&(_recv_buffer[0]), ret, &_input, &_utt_ends);
+    // the rate never changes once it is known, see AudioStreamParser
+    int32 rate = _parser.SampleRate();
+    if (rate > 0 && rate != _pool->_feature_samp_freq &&
+        !PolyphaseResampler::Supported(rate, _pool->_feature_samp_freq)) {
+      KALDI_WARN << "Session " << _client_socket << " sends audio at "
+                 << rate << " Hz, which cannot be resampled";
+      ok = false;
+    } else if (rate > 0) {
+      _samp_freq = rate;
+    }
+    // a malformed stream is ended as if the client had closed it
+    closed = (!ok || _parser.EndOfStream());
+    if (!closed) {
+      if (_input.Size() > kMaxBufferedSecs * _samp_freq && !_paused) {
+        _paused = pause = true;
+      }
+      if (!_scheduled && ReadyLocked()) _scheduled = schedule = true;
+    }
+    pthread_mutex_unlock(&_lock);
+    if (pause) _pool->_reactor.Pause(_input_fd, this);
+  }
+  if (closed) {
+    // the client closed the connection (or it broke); this session will not
+    // be called again by the reactor.
+    _pool->_reactor.Remove(_input_fd);
+    pthread_mutex_lock(&_lock);
+    _input_closed = true;
+    if (!_scheduled) _scheduled = schedule = true;
+    pthread_mutex_unlock(&_lock);
+  }
+  if (schedule) _pool->Schedule(this);
+}
 
-  struct sockaddr_storage addr;
-  char ipstr[20];
+ssize_t DecoderSession::ReadRing() {
+  // There are no packets to keep apart, so the ring is read in bigger
+  // pieces than the socket.
+  _recv_buffer.resize(std::max<int32>(packet_size, kRingReadBytes));
+  _ring->ClearDoorbell();
+  int32 n = _ring->Read(&(_recv_buffer[0]), _recv_buffer.size());
+  if (n < 0) {
+    KALDI_WARN << "Session " << _client_socket
+               << " corrupted its shared memory ring";
+    errno = EPROTO;
+    return -1;
+  }
+  if (n == static_cast<int32>(_recv_buffer.size())) {
+    _ring->Notify();  // come back for the rest
+    return n;
+  }
+  if (n == 0 && _ring->Done()) return 0;
+  if (n == 0) {
+    // Nothing is sent over the socket, it only becomes readable when the
+    // client goes away.
+    char byte;
+    ssize_t ret = recv(_client_socket, &byte, 1, MSG_DONTWAIT);
+    if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                     errno != EINTR))
+      return 0;
+  }
+  // the producer rings the doorbell for what it writes from now on
+  if (!_ring->PrepareWait()) _ring->Notify();
+  if (n > 0) return n;
+  errno = EAGAIN;
+  return -1;
+}
 
-  len = sizeof addr;
-  getpeername(client_desc, (struct sockaddr*) &addr, &len);
+bool DecoderSession::Process(Vector<BaseFloat> *wav_buffer,
+                             double wait_secs) {
+  _process_start = MonotonicSeconds();
+  _alloc_start = NumThreadAllocations();
+  // Take everything up to the end of the current utterance.
+  pthread_mutex_lock(&_lock);
+  int64 num_samples = _input.Size();
+  bool utt_end = false;
+  if (!_utt_ends.empty()) {
+    num_samples = _utt_ends.front() - _input_offset;
+    _utt_ends.pop_front();
+    utt_end = true;
+  }
+  Vector<BaseFloat> chunk_buffer;
+  if (wav_buffer == NULL) wav_buffer = &chunk_buffer;
+  if (wav_buffer->Dim() < num_samples)
+    wav_buffer->Resize(num_samples, kUndefined);
+  if (num_samples > 0) {
+    _input.Read(wav_buffer->Data(), num_samples);
+    _input_offset += num_samples;
+  }
+  bool input_closed = _input_closed && _input.Empty() && _utt_ends.empty();
+  bool resume = false;
+  if (_paused && _input.Size() < kMaxBufferedSecs * _samp_freq / 2) {
+    _paused = false;
+    resume = !_input_closed;
+  }
+  pthread_mutex_unlock(&_lock);
+  if (resume) _pool->_reactor.Resume(_input_fd, this);
+
+  if (!_finished) {
+    if (num_samples > 0)
+      DecodeChunk(SubVector<BaseFloat>(*wav_buffer, 0, num_samples));
+    // As before, an empty utterance or the end of the connection ends the
+    // session.  The client does not know about endpoints though, so an
+    // utterance that is empty because it ended at an endpoint just gets its
+    // RESULT:DONE.
+    if (utt_end) {
+      bool empty = !FinishUtterance();
+      if (empty && _endpointed) {
+        _writer.Done();
+        _writer.Flush(_client_socket);
+      } else if (empty) {
+        _finished = true;
+      }
+      _endpointed = false;
+    }
+    if (input_closed) {
+      FinishUtterance();
+      _finished = true;
+    }
+    if (_finished && !input_closed) {
+      // make the reactor see the end of the connection
+      shutdown(_client_socket, SHUT_RDWR);
+    }
+  }
+  if (_finished && input_closed)
+    return true;
+  double compute_secs = MonotonicSeconds() - _process_start;
+  _utt_compute_secs += compute_secs;
+  _num_allocs += NumThreadAllocations() - _alloc_start;
+
+  if (num_samples > 0) {
+    double audio_secs = num_samples / _samp_freq;
+    RecordChunkLength(_scheduler.ChunkLength());
+    if (_scheduler.Update(wait_secs, audio_secs)) {
+      KALDI_VLOG(2) << "Session " << _client_socket << " now decodes "
+                    << _scheduler.ChunkLength() << " second chunks";
+    }
+    if (_beam.Update(wait_secs, compute_secs, audio_secs)) {
+      KALDI_VLOG(2) << "Session " << _client_socket << " now decodes with "
+                    << "beam " << _beam.Options().beam << ", max-active "
+                    << _beam.Options().max_active;
+      if (_decoder != NULL) _decoder->SetOptions(_beam.Options());
+    }
+  }
 
-  struct sockaddr_in *s = (struct sockaddr_in *) &addr;
-  inet_ntop(AF_INET, &s->sin_addr, ipstr, sizeof ipstr);
+  bool requeue = false;
+  pthread_mutex_lock(&_lock);
+  _chunk_length = _scheduler.ChunkLength();
+  if (ReadyLocked() && !(_finished && !_input_closed))
+    requeue = true;
+  else
+    _scheduled = false;
+  pthread_mutex_unlock(&_lock);
+  if (requeue) _pool->Schedule(this);
+  return false;
+}
 
-  KALDI_VLOG(1) << "TcpServer: Accepted connection from: " << ipstr;
-  signal(SIGPIPE, SIG_IGN);
+void DecoderSession::StartUtterance() {
+  // Kaldi has no way to reset a feature pipeline, and the decodable object
+  // inside the decoder is bound to it, so both are created per utterance.
+  _feature_pipeline = new OnlineCmvnNnet2FeaturePipeline(
+      *_pool->_feature_info);
+  // The whole utterance is decoded with the models current when it starts,
+  // even if they are reloaded in the meantime.
+  _models = _pool->AcquireModels();
+  if (_decoder != NULL && _decoder_generation != _models->_generation) {
+    // a kept search refers to the graph of older models
+    delete _decoder;
+    _decoder = NULL;
+  }
+  if (_graph != NULL && _graph_generation != _models->_generation) {
+    delete _graph;
+    _graph = NULL;
+  }
+  if (_models->_fst_on_the_fly && _graph == NULL) {
+    // The cache of a lazily composed graph is not thread-safe, so every
+    // session expands states into a copy of its own, kept across
+    // utterances until the graph is reloaded.
+    _graph = _models->_fst->Copy(true);
+    _graph_generation = _models->_generation;
+  }
+  const ModelSnapshot::NodeModels &models = _models->_node_models[_node];
+  const nnet3::DecodableNnetSimpleLoopedInfo *decodable_info = NULL;
+  if (models.batch_inference == NULL)
+    decodable_info = &(models.decodable_infos->Get(decodable_opts));
+  if (_decoder == NULL) {
+    // A lazily composed graph expands its cache while the search runs, and
+    // the cache outlives the utterance, so it must not come from the arena.
+    _decoder = new UtteranceDecoder(
+        _beam.Options(), (_graph != NULL ? *_graph : *models.fst),
+        (_models->_fst_on_the_fly ? NULL : _arena));
+    _decoder_generation = _models->_generation;
+  } else {
+    _decoder->SetOptions(_beam.Options());
+  }
+  _decoder->StartUtterance(_models->_tmodel, decodable_info,
+                           models.batch_inference, _feature_pipeline);
+  _samp_offset = 0;
+  _samp_partial = 0;
+  _traceback.Reset();
+  if (_samp_freq != _pool->_feature_samp_freq) {
+    if (_resampler == NULL) {
+      _resampler = new PolyphaseResampler(_samp_freq,
+                                          _pool->_feature_samp_freq);
+    }
+    _resampler->Reset();
+  }
+  if (_pool->_vad_config.enabled) _vad.Reset(_pool->_feature_samp_freq);
+  _num_words_sent = 0;
+  _num_words_kept = 0;
+}
 
-  return client_desc;
+void DecoderSession::AcceptAudio(const VectorBase<BaseFloat> &wav_data,
+                                 bool flush) {
+  ScopedLatency timer(kStageFeatures);
+  std::vector<BaseFloat> *audio = NULL;  // NULL means wav_data itself
+  if (_resampler != NULL) {
+    _resampled.clear();
+    if (wav_data.Dim() > 0)
+      _resampler->Resample(wav_data.Data(), wav_data.Dim(), &_resampled);
+    if (flush) _resampler->Flush(&_resampled);
+    audio = &_resampled;
+  }
+  if (_pool->_vad_config.enabled) {
+    _vad_output.clear();
+    if (audio == NULL)
+      _vad.Process(wav_data, &_vad_output);
+    else if (!audio->empty())
+      _vad.Process(SubVector<BaseFloat>(&(*audio)[0], audio->size()),
+                   &_vad_output);
+    if (flush) _vad.Flush(&_vad_output);
+    audio = &_vad_output;
+  }
+
+  BaseFloat samp_freq = _pool->_feature_samp_freq;
+  if (audio == NULL && wav_data.Dim() > 0)
+    _feature_pipeline->AcceptWaveform(samp_freq, wav_data);
+  else if (audio != NULL && !audio->empty())
+    _feature_pipeline->AcceptWaveform(
+        samp_freq, SubVector<BaseFloat>(&(*audio)[0], audio->size()));
+  if (flush) _feature_pipeline->InputFinished();
 }
 
-DecoderPool::DecoderPool() {
-  _num = 0;
-  _decoder_threads = NULL;
-  _fst = NULL;
-  _feature_info = NULL;
-  _word_syms = NULL;
-  _lexicon_info = NULL;
+bool DecoderSession::EndpointReached() {
+  const OnlineEndpointConfig &config = _pool->_endpoint_config;
+  const LatticeFasterOnlineDecoder &decoder = _decoder->Decoder();
+  if (!_pool->_vad_config.enabled)
+    return EndpointDetected(config, _models->_tmodel, secs_per_frame,
+                            decoder);
+
+  // The rules need seconds of trailing silence, more than the gate passes
+  // on, so the silence it dropped at the end is added, as long as the
+  // decoded audio ends in silence (or there is none).
+  int32 num_frames = decoder.NumFramesDecoded();
+  int32 trailing_silence = TrailingSilenceLength(
+      _models->_tmodel, config.silence_phones, decoder);
+  BaseFloat samples_per_frame = secs_per_frame * _pool->_feature_samp_freq;
+  if (trailing_silence > 0 || num_frames == 0)
+    trailing_silence += _vad.NumTrailingDropped() / samples_per_frame;
+  num_frames += _vad.NumDropped() / samples_per_frame;
+  return EndpointDetected(config, num_frames, trailing_silence,
+                          secs_per_frame, decoder.FinalRelativeCost());
 }
 
-DecoderPool::~DecoderPool() {
-  if (_fst != NULL) delete _fst;
-  if (_feature_info != NULL) delete _feature_info;
-  if (_word_syms != NULL) delete _word_syms;
-  if (_decoder_threads != NULL) delete[] _decoder_threads;
-  if (_lexicon_info != NULL) delete _lexicon_info;
+void DecoderSession::DecodeChunk(const VectorBase<BaseFloat> &wav_data) {
+  if (_feature_pipeline == NULL) StartUtterance();
+
+  AcceptAudio(wav_data, false);
+  _samp_offset += wav_data.Dim();
+  _decoder->AdvanceDecoding();
+
+  if (_pool->_do_endpointing && EndpointReached()) {
+    KALDI_VLOG(1) << "Session " << _client_socket << " reached an endpoint "
+                  << "after " << _samp_offset / _samp_freq << " seconds";
+    // The rest of the chunk is trailing silence; the next chunk starts a
+    // new utterance with a fresh decoder and feature pipeline.
+    FinishUtterance();
+    _endpointed = true;
+    return;
+  }
+
+  if (_samp_offset - _samp_partial >
+      _scheduler.PartialInterval() * _samp_freq
+      && _decoder->NumFramesDecoded() > 0) {
+    _samp_partial = _samp_offset;
+    SendPartialResult();
+  }
+}
+
+void DecoderSession::SendPartialResult() {
+  const fst::SymbolTable *word_syms = _models->_word_syms;
+  if (word_syms == NULL) return;
+  const PartialResultConfig &config = _pool->_partial_config;
+
+  int32 num_kept;
+  {
+    ScopedLatency timer(kStageBestPath);
+    num_kept = _traceback.Update(_decoder->Decoder());
+  }
+  // The words kept by every update since the last partial result are
+  // also a prefix of that one.
+  _num_words_kept = std::min(_num_words_kept, num_kept);
+  const std::vector<int32> &words = _traceback.Words();
+  int32 num_changed = (_num_words_sent - _num_words_kept) +
+      (static_cast<int32>(words.size()) - _num_words_kept);
+  // An empty best path only matters if it retracts words already sent,
+  // which the client must not keep until the final result.
+  if (words.empty() ? _num_words_sent == 0 : num_changed < config.min_change)
+    return;
+
+  ScopedLatency timer(kStageResultWrite);
+  int32 first = config.suffix_only ? _num_words_kept : 0;
+  _writer.BeginPartial(config.suffix_only ? _num_words_kept : -1);
+  for (size_t i = first; i < words.size(); i++) {
+    std::string s = word_syms->Find(words[i]);
+    if (s != "") _writer.AddWord(s);
+  }
+  _writer.EndPartial();
+  _writer.Flush(_client_socket);
+  KALDI_VLOG(1) << "Partial result of session " << _client_socket << " with "
+                << words.size() << " words";
+  _num_words_sent = words.size();
+  _num_words_kept = words.size();
+}
+
+bool DecoderSession::FinishUtterance() {
+  if (_feature_pipeline == NULL) return false;
+
+  AcceptAudio(Vector<BaseFloat>(), true);
+  if (_pool->_vad_config.enabled) {
+    KALDI_VLOG(1) << "Session " << _client_socket << ": VAD dropped "
+                  << _vad.NumDropped() / _pool->_feature_samp_freq << " of "
+                  << _vad.NumReceived() / _pool->_feature_samp_freq
+                  << " seconds";
+  }
+  _decoder->AdvanceDecoding();
+  _decoder->FinalizeDecoding();
+
+  bool end_of_utterance = true;
+  _decoder->GetBestPath(end_of_utterance, &_lat);
+  // time spent on this utterance in earlier Process() calls and this one
+  double now = MonotonicSeconds();
+  double reco_secs = _utt_compute_secs + now - _process_start;
+  if (_samp_offset > 0)
+    RecordRealTimeFactor(reco_secs * _samp_freq / _samp_offset);
+  _utt_compute_secs = 0.0;
+  _process_start = now;
+
+  GetDiagnosticsAndPrintOutput(
+      &_writer, reco_secs, "", _models->_tmodel, *_models->_lexicon_info,
+      _models->_word_syms, (_pool->_vad_config.enabled ? &_vad : NULL),
+      _lat,
+      _samp_offset / _samp_freq);
+  KALDI_VLOG(1) << "Session " << _client_socket << " finished an utterance, "
+                << _num_allocs + NumThreadAllocations() - _alloc_start
+                << " allocations"
+                << (reuse_decoders ? " (reusing decoders)" : "");
+  {
+    // the final result and RESULT:DONE go out in one send()
+    ScopedLatency timer(kStageResultWrite);
+    _writer.Done();
+    _writer.Flush(_client_socket);
+  }
+
+  _decoder->EndUtterance();
+  delete _feature_pipeline;
+  _feature_pipeline = NULL;
+  if (!reuse_decoders) {
+    delete _decoder;
+    _decoder = NULL;
+    // the tokens of the utterance go back to the pool in one piece; a kept
+    // search holds on to its arena until the session ends
+    if (_arena != NULL && !_arena->Release())
+      KALDI_WARN << "Session " << _client_socket << ": "
+                 << _arena->NumLiveObjects() << " objects left in its arena";
+  }
+  _pool->ReleaseModels(_models);
+  _models = NULL;
+  _num_allocs = 0;
+  _alloc_start = NumThreadAllocations();
+  return true;
+}
+
+ModelSnapshot *DecoderPool::LoadModels() {
+  pthread_mutex_lock(&_models_lock);
+  int32 generation = ++_num_loads;
+  pthread_mutex_unlock(&_models_lock);
+  ModelSnapshot *models = new ModelSnapshot(generation);
+  Timer timer;
+  try {
+    // With --numa-replicate, the models read here are the copy of the
+    // first node, so they are read on it.
+    std::vector<int32> no_cpus;
+    ScopedThreadAffinity affinity(_affinity.numa_replicate ?
+                                  _topology.NodeCpus(0) : no_cpus);
+
+    std::vector<std::vector<int32> > lexicon;
+    {
+      bool binary_in;
+      Input ki(_source.lexicon_rxfilename, &binary_in);
+      KALDI_ASSERT(!binary_in && "Not expecting binary file for lexicon");
+      if (!ReadLexiconForWordAlign(ki.Stream(), &lexicon)) {
+        KALDI_ERR << "Error reading alignment lexicon from "
+                  << _source.lexicon_rxfilename;
+      }
+    }
+    models->_lexicon_info = new WordAlignLatticeLexiconInfo(lexicon);
+
+    {
+      bool binary;
+      Input ki(_source.nnet3_rxfilename, &binary);
+      models->_tmodel.Read(ki.Stream(), binary);
+      models->_am_nnet.Read(ki.Stream(), binary);
+      nnet3::SetBatchnormTestMode(true, &(models->_am_nnet.GetNnet()));
+      nnet3::SetDropoutTestMode(true, &(models->_am_nnet.GetNnet()));
+      nnet3::CollapseModel(nnet3::CollapseModelConfig(),
+                           &(models->_am_nnet.GetNnet()));
+      if (_source.quantize_nnet)
+        nnet3::QuantizeNnet(&(models->_am_nnet.GetNnet()));
+    }
+
+    // this object contains precomputed stuff that is used by all decodable
+    // objects.  It takes a pointer to am_nnet because if it has iVectors it
+    // has to modify the nnet to accept iVectors at intervals, so we build
+    // the default one here, before any decoder thread reads the nnet.
+    models->_decodable_infos = new DecodableInfoCache(&(models->_am_nnet));
+    if (_source.batch_opts.batch_size > 1) {
+      models->_batch_inference = new NnetBatchInference(
+          _source.batch_opts, decodable_opts, models->_am_nnet);
+    } else {
+      models->_decodable_infos->Get(decodable_opts);
+    }
+
+    if (_source.hcl_rxfilename != "") {
+      fst::Fst<fst::StdArc> *hcl_fst =
+          ReadDecodingGraph(_source.hcl_rxfilename, _source.mmap_graph);
+      fst::Fst<fst::StdArc> *g_fst =
+          ReadDecodingGraph(_source.fst_rxfilename, _source.mmap_graph);
+      models->_fst = ComposeDecodingGraph(*hcl_fst, *g_fst,
+                                          _source.graph_cache_mb);
+      models->_fst_on_the_fly = true;
+      delete hcl_fst;
+      delete g_fst;
+    } else {
+      models->_fst = ReadDecodingGraph(_source.fst_rxfilename,
+                                       _source.mmap_graph);
+    }
+    if (_source.word_syms_rxfilename != "")
+      if (!(models->_word_syms =
+          fst::SymbolTable::ReadText(_source.word_syms_rxfilename)))
+        KALDI_ERR << "Could not read symbol table from file "
+                  << _source.word_syms_rxfilename;
+  } catch(...) {
+    delete models;
+    throw;
+  }
+
+  ReplicateModels(models);
+  KALDI_LOG << "Loaded models #" << generation << " in " << timer.Elapsed()
+            << " seconds; resident memory is " << GetResidentMemoryKb()
+            << " kB";
+  return models;
+}
+
+int32 DecoderPool::NumModelNodes() const {
+  if (!_affinity.numa_replicate) return 1;
+  return std::min(_topology.NumNodes(), g_num_threads);
+}
+
+void DecoderPool::ReplicateModels(ModelSnapshot *models) {
+  ModelSnapshot::NodeModels primary;
+  primary.am_nnet = &(models->_am_nnet);
+  primary.fst = models->_fst;
+  primary.decodable_infos = models->_decodable_infos;
+  primary.batch_inference = models->_batch_inference;
+  models->_node_models.assign(1, primary);
+
+  int32 num_nodes = NumModelNodes();
+  for (int32 n = 1; n < num_nodes; n++) {
+    // Pages are placed on the node of the CPU that first touches them, so
+    // the copies are made from a CPU of their node.  The batch inference
+    // thread started here keeps running on that node.
+    ScopedThreadAffinity affinity(_topology.NodeCpus(n));
+    Timer timer;
+    ModelSnapshot::NodeModels copy;
+    copy.am_nnet = new nnet3::AmNnetSimple(models->_am_nnet);
+    if (models->_fst_on_the_fly) {
+      // sessions expand states into caches of their own anyway
+      copy.fst = models->_fst->Copy();
+    } else {
+      copy.fst = new fst::ConstFst<fst::StdArc>(*models->_fst);
+    }
+    copy.decodable_infos = new DecodableInfoCache(copy.am_nnet);
+    copy.batch_inference = NULL;
+    if (models->_batch_inference != NULL) {
+      copy.batch_inference = new NnetBatchInference(
+          _source.batch_opts, decodable_opts, *copy.am_nnet);
+    } else {
+      copy.decodable_infos->Get(decodable_opts);
+    }
+    models->_node_models.push_back(copy);
+    KALDI_LOG << "Copied the acoustic model and graph to NUMA node "
+              << _topology.NodeId(n) << " in " << timer.Elapsed()
+              << " seconds; resident memory is " << GetResidentMemoryKb()
+              << " kB";
+  }
+}
+
+void DecoderPool::SetModels(ModelSnapshot *models) {
+  pthread_mutex_lock(&_models_lock);
+  models->_num_refs++;  // the pool's own reference
+  ModelSnapshot *old_models = _models;
+  _models = models;
+  pthread_mutex_unlock(&_models_lock);
+  // utterances running with the old models keep them alive
+  if (old_models != NULL) ReleaseModels(old_models);
+}
+
+ModelSnapshot *DecoderPool::AcquireModels() {
+  pthread_mutex_lock(&_models_lock);
+  ModelSnapshot *models = _models;
+  models->_num_refs++;
+  pthread_mutex_unlock(&_models_lock);
+  return models;
+}
+
+void DecoderPool::ReleaseModels(ModelSnapshot *models) {
+  pthread_mutex_lock(&_models_lock);
+  bool unused = (--models->_num_refs == 0);
+  pthread_mutex_unlock(&_models_lock);
+  if (unused) {
+    KALDI_LOG << "Models #" << models->_generation << " are no longer used";
+    delete models;
+  }
+}
+
+void DecoderPool::Reload() {
+  pthread_mutex_lock(&_models_lock);
+  bool busy = _reloading;
+  _reloading = true;
+  pthread_mutex_unlock(&_models_lock);
+  if (busy) {
+    KALDI_WARN << "Models are being reloaded already";
+    return;
+  }
+
+  // The reload thread must not take SIGHUP either.
+  sigset_t signals, saved;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, &saved);
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int32 err = pthread_create(&tid, &attr, DecoderPool::ReloadThreadProc,
+                             this);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (err != 0) {
+    KALDI_WARN << "Can't create the reload thread: " << strerror(err);
+    pthread_mutex_lock(&_models_lock);
+    _reloading = false;
+    pthread_mutex_unlock(&_models_lock);
+  }
+}
+
+void* DecoderPool::ReloadThreadProc(void* para) {
+  DecoderPool *pool = reinterpret_cast <DecoderPool*> (para);
+  KALDI_LOG << "Reloading models";
+  try {
+    pool->SetModels(pool->LoadModels());
+  } catch(const std::exception& e) {
+    KALDI_WARN << "Reloading failed, keeping the current models: "
+               << e.what();
+  }
+  pthread_mutex_lock(&pool->_models_lock);
+  pool->_reloading = false;
+  pthread_mutex_unlock(&pool->_models_lock);
+  return reinterpret_cast <void*> (NULL);
 }
 
 void* DecoderPool::ThreadProc(void* para) {
@@ -530,92 +1802,27 @@ void* DecoderPool::ThreadProc(void* para) {
   KALDI_ASSERT(dt != NULL);
   KALDI_ASSERT(dt->_pool != NULL);
   KALDI_VLOG(1) << "Decoder " << dt->_tid << " is ready";
+  JobQueue<DecoderSession*> *ready = dt->_pool->_ready[dt->_node];
 
-  while (true) {
-    if (dt->_client_socket == -1) {
-      Sleep(0.1f);
-      continue;
-    }
-    pthread_mutex_lock(&(dt->_lock));
-    KALDI_VLOG(1) << "Decoder " << dt->_tid << " is running";
-    while (true) {
-      OnlineCmvnNnet2FeaturePipeline feature_pipeline(
-          *dt->_pool->_feature_info);
-      // this object contains precomputed stuff that is used by all decodable
-      // objects.  It takes a pointer to am_nnet because if it has iVectors it
-      // has to modify the nnet to accept iVectors at intervals.
-      nnet3::DecodableNnetSimpleLoopedInfo decodable_info(decodable_opts,
-                                                          &dt->_pool->_am_nnet);
-      SingleUtteranceNnet3Decoder decoder(
-          dt->_pool->_config, dt->_pool->_tmodel, decodable_info,
-          *dt->_pool->_fst, &feature_pipeline);
-
-      OnlineTcpVectorSource au_src(dt->_client_socket);
-      std::string utt = "";
-      BaseFloat samp_freq = 16000;
-      int32 chunk_length;
-      if (chunk_length_secs > 0) {
-        chunk_length = static_cast <int32> (samp_freq * chunk_length_secs);
-        if (chunk_length == 0) chunk_length = 1;
-      } else {
-        chunk_length = std::numeric_limits<int32>::max();
-      }
-
-      int32 start_time = clock();
-
-      OnlineTimer decoding_timer(utt);
-      int32 samp_offset = 0, samp_partial = 0, samp_process = 0;
-      Lattice lat;
-      bool end_of_utterance;
-
-      // Client loop to receive wav data
-      while (true) {
-        Vector<BaseFloat> wav_data(packet_size / 2);
-        bool ans = au_src.Read(&wav_data);
-
-        feature_pipeline.AcceptWaveform(samp_freq, wav_data);
-
-        if (ans) samp_offset += packet_size / 2;
-        // by introducing minor delay, you'll get speedup.
-        if (samp_offset - samp_process < chunk_length && ans) continue;
-        samp_process = samp_offset;
-        decoder.AdvanceDecoding();
-
-        if (samp_offset - samp_partial > 0.3 * samp_freq
-            && decoder.NumFramesDecoded() > 0) {
-          samp_partial = samp_offset;
-          end_of_utterance = false;
-          decoder.GetBestPath(end_of_utterance, &lat);
-          GetDiagnosticsAndPrintOutput(
-              dt->_client_socket, end_of_utterance, start_time,
-              utt, dt->_pool->_tmodel, *dt->_pool->_lexicon_info,
-              dt->_pool->_word_syms, lat, samp_offset);
-        }
-        if (!ans) break;
-      }
-      if (samp_offset == 0) {
-        KALDI_VLOG(1) << "Decoder " << dt->_tid << " break";
-        break;
-      }
+  // Audio buffer kept by this thread for all sessions with
+  // --reuse-decoders.
+  Vector<BaseFloat> thread_wav_data;
 
-      feature_pipeline.InputFinished();
-      Timer timer;
-      decoder.AdvanceDecoding();
-      decoder.FinalizeDecoding();
-
-      end_of_utterance = true;
-      decoder.GetBestPath(end_of_utterance, &lat);
-      GetDiagnosticsAndPrintOutput(
-          dt->_client_socket, end_of_utterance, start_time,
-          utt, dt->_pool->_tmodel, *dt->_pool->_lexicon_info,
-          dt->_pool->_word_syms, lat, samp_offset);
-      KALDI_VLOG(1) << "Decoder " << dt->_tid << " finished";
-      WriteLine(dt->_client_socket, "RESULT:DONE");
-    }
-    close(dt->_client_socket);
-    dt->_is_free = true;
-    dt->_client_socket = -1;
-    pthread_mutex_unlock(&(dt->_lock));
+  while (true) {
+    DecoderSession *session;
+    double wait_secs;
+    if (!ready->Pop(&session, &wait_secs))
+      break;
+    JobQueueStats stats = ready->Stats();
+    KALDI_VLOG(2) << "Decoder " << dt->_tid << " runs session "
+        << session->Socket() << ", queue wait " << wait_secs * 1000
+        << " ms (average " << stats.AverageWait() * 1000 << " ms, max "
+        << stats.max_wait * 1000 << " ms over " << stats.num_jobs
+        << " chunks)";
+    RecordLatency(kStageQueueWait, wait_secs);
+    if (session->Process(reuse_decoders ? &thread_wav_data : NULL,
+                         wait_secs))
+      dt->_pool->EndSession(session);
   }
 
   return reinterpret_cast <void*> (NULL);
@@ -627,48 +1834,441 @@ void DecoderPool::Run(const int32 &n) {
   _num = n;
   _decoder_threads = new DecoderThread[_num];
   KALDI_ASSERT(_decoder_threads != NULL);
+  KALDI_ASSERT(_models != NULL);
+  // every session is queued at most once
+  int32 num_nodes = NumModelNodes();
+  for (int32 n = 0; n < num_nodes; n++)
+    _ready.push_back(new JobQueue<DecoderSession*>(_max_sessions));
+  _node_sessions.assign(num_nodes, 0);
+  _pending = new JobQueue<PendingClient>(
+      std::max(_admission.max_pending, 1));
+
+  if (!_reactor.Start())
+    KALDI_ERR << "Cannot start the network reactor";
 
   for (i = 0; i < _num; i++) {
     _decoder_threads[i]._pool = this;
-
-    pthread_mutex_init(&(_decoder_threads[i]._lock), NULL);
-    _decoder_threads[i]._is_free = true;
-    _decoder_threads[i]._client_socket = -1;
+    // with one copy of the models, threads serve all sessions wherever
+    // they run
+    _decoder_threads[i]._node = (num_nodes > 1 ?
+                                 _topology.ThreadNode(i) : 0);
   }
 
   for (i = 0; i < _num; i++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (_affinity.pin_threads != "none") {
+      std::vector<int32> cpus;
+      _topology.ThreadCpus(i, _affinity.pin_threads == "cpu", &cpus);
+      SetThreadAttrCpus(cpus, &attr);
+      KALDI_VLOG(1) << "Decoder thread " << i << " runs on node "
+                    << _topology.NodeId(_topology.ThreadNode(i)) << ", "
+                    << cpus.size() << " CPU(s) starting at " << cpus[0];
+    }
     int32 err = pthread_create(&(_decoder_threads[i]._tid),
-                                NULL,
+                                &attr,
                                 DecoderPool::ThreadProc,
                                 &(_decoder_threads[i]));
+    pthread_attr_destroy(&attr);
     if (err != 0) {
       KALDI_LOG << "Can't create thread " << i << ": " << strerror(err);
     }
   }
 }
 
-void DecoderPool::NewTask(int32 client_socket) {
-  for (int32 i = 0; i < _num; i++) {
-    if (_decoder_threads[i]._is_free) {
-      KALDI_VLOG(1) << "Decoder " << _decoder_threads[i]._tid \
-          << " is free to used";
-      pthread_mutex_lock(&(_decoder_threads[i]._lock));
-      _decoder_threads[i]._is_free = false;
-      _decoder_threads[i]._client_socket = client_socket;
-      pthread_mutex_unlock(&(_decoder_threads[i]._lock));
-      return;
-    }
+void DecoderPool::NewTask(int32 client_socket, ShmRing *ring) {
+  if (client_socket < 0) return;
+  PendingClient client;
+  client.socket = client_socket;
+  client.ring = ring;
+
+  // Up to --max-sessions connections are decoded at the same time, the
+  // next --max-pending-connections ones wait for a session to end.
+  pthread_mutex_lock(&_session_lock);
+  bool start = (_num_sessions < _max_sessions);
+  bool pending = false;
+  if (start)
+    _num_sessions++;
+  else
+    pending = (_admission.max_pending > 0 && _pending->TryPush(client));
+  pthread_mutex_unlock(&_session_lock);
+
+  if (start) {
+    StartSession(client_socket, ring);
+  } else if (pending) {
+    KALDI_VLOG(1) << "All sessions are taken, " << _pending->Size()
+                  << " connection(s) waiting";
+  } else {
+    KALDI_WARN << "Too many pending connections, rejecting client";
+    RejectClient(client);
   }
-  close(client_socket);
 }
 
 bool DecoderPool::IsBusy() {
-  for (int32 i = 0; i < _num; i++) {
-    if (!_decoder_threads[i]._is_free) {
-      return true;
+  pthread_mutex_lock(&_session_lock);
+  bool busy = (_num_sessions > 0);
+  pthread_mutex_unlock(&_session_lock);
+  return busy;
+}
+
+void DecoderPool::Schedule(DecoderSession *session) {
+  bool ok = _ready[session->Node()]->TryPush(session);
+  KALDI_ASSERT(ok);
+}
+
+void DecoderPool::RejectClient(const PendingClient &client) {
+  if (client.ring != NULL) delete client.ring;
+  RejectBusyClient(client.socket);
+}
+
+void DecoderPool::StartSession(int32 client_socket, ShmRing *ring) {
+  // the node with the fewest sessions gets the new one
+  pthread_mutex_lock(&_session_lock);
+  int32 node = std::min_element(_node_sessions.begin(),
+                                _node_sessions.end()) -
+      _node_sessions.begin();
+  _node_sessions[node]++;
+  pthread_mutex_unlock(&_session_lock);
+  if (_ready.size() > 1) {
+    KALDI_VLOG(1) << "Session " << client_socket << " started on node "
+                  << _topology.NodeId(node);
+  } else {
+    KALDI_VLOG(1) << "Session " << client_socket << " started";
+  }
+  DecoderSession *session = new DecoderSession(this, client_socket, ring,
+                                               node);
+  if (session->InputFd() < 0 || !_reactor.Add(session->InputFd(), session))
+    EndSession(session);
+}
+
+void DecoderPool::EndSession(DecoderSession *session) {
+  KALDI_VLOG(1) << "Session " << session->Socket() << " ended, resident "
+                << "memory is " << GetResidentMemoryKb() << " kB";
+  if (_beam_config.adaptive) {
+    KALDI_VLOG(1) << "Session " << session->Socket() << " was decoded with "
+                  << session->Beam().Stats();
+  }
+  int32 node = session->Node();
+  delete session;
+  if (DecoderArenasEnabled()) {
+    int64 in_use_bytes, idle_bytes;
+    GetDecoderArenaStats(&in_use_bytes, &idle_bytes);
+    KALDI_VLOG(1) << "Decoder arenas use " << (in_use_bytes >> 10)
+                  << " kB, " << (idle_bytes >> 10) << " kB idle";
+  }
+
+  // hand the slot over to the oldest pending connection, if any
+  PendingClient client;
+  client.socket = -1;
+  pthread_mutex_lock(&_session_lock);
+  _node_sessions[node]--;
+  if (!_pending->TryPop(&client, NULL)) {
+    _num_sessions--;
+    client.socket = -1;
+  }
+  pthread_mutex_unlock(&_session_lock);
+  if (client.socket >= 0) StartSession(client.socket, client.ring);
+}
+
+double DecoderPool::NextExpiry() {
+  if (_admission.max_queue_wait <= 0) return -1.0;
+  double oldest_wait = _pending->OldestWait();
+  if (oldest_wait < 0) return -1.0;
+  return std::max(0.0, _admission.max_queue_wait - oldest_wait);
+}
+
+void DecoderPool::ExpirePending() {
+  if (_admission.max_queue_wait <= 0) return;
+  std::vector<PendingClient> expired;
+  _pending->PopExpired(_admission.max_queue_wait, &expired);
+  for (size_t i = 0; i < expired.size(); i++) {
+    KALDI_WARN << "No session became free within "
+               << _admission.max_queue_wait << " seconds, rejecting client";
+    RejectClient(expired[i]);
+  }
+}
+
+bool DecoderPool::StartUnixListener(const std::string &path,
+                                    int32 ring_bytes) {
+  Listener *listener = new Listener;
+  listener->pool = this;
+  listener->ring_bytes = ring_bytes;
+  if (!listener->server.ListenUnix(path, _admission.listen_backlog)) {
+    delete listener;
+    return false;
+  }
+  return StartListener(listener);
+}
+
+bool DecoderPool::StartTcpListeners(const std::string &address, int32 port,
+                                    int32 num_threads) {
+  for (int32 i = 0; i < num_threads; i++) {
+    Listener *listener = new Listener;
+    listener->pool = this;
+    listener->ring_bytes = 0;
+    if (!listener->server.Listen(address, port, _admission.listen_backlog,
+                                 true)) {
+      delete listener;
+      return false;
     }
+    if (!StartListener(listener)) return false;
   }
-  return false;
+  return true;
+}
+
+bool DecoderPool::StartListener(Listener *listener) {
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int32 err = pthread_create(&tid, &attr, DecoderPool::ListenerProc,
+                             listener);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    KALDI_WARN << "Can't create a listener thread: " << strerror(err);
+    delete listener;
+    return false;
+  }
+  return true;
+}
+
+void* DecoderPool::ListenerProc(void* para) {
+  Listener *listener = reinterpret_cast <Listener*> (para);
+  DecoderPool *pool = listener->pool;
+  while (true) {
+    // the main thread may not wake up in time for clients queued here
+    int32 client_socket = listener->server.Accept(1.0);
+    pool->ExpirePending();
+    if (client_socket < 0) continue;
+    ShmRing *ring = NULL;
+    if (listener->ring_bytes > 0) {
+      // the ring is handed over right away; the client may fill it while
+      // it waits for a session
+      ring = ShmRing::Create(listener->ring_bytes);
+      if (ring == NULL || !SendShmRing(client_socket, *ring)) {
+        if (ring != NULL) delete ring;
+        close(client_socket);
+        continue;
+      }
+    }
+    pool->NewTask(client_socket, ring);
+  }
+  return reinterpret_cast <void*> (NULL);
+}
+
+BatchDecoder::BatchDecoder(DecoderPool *pool):
+    _pool(pool), _reader(NULL), _ctm(NULL), _text(NULL), _num_done(0),
+    _num_failed(0), _audio_secs(0.0) {
+  pthread_mutex_init(&_lock, NULL);
+}
+
+BatchDecoder::~BatchDecoder() {
+  if (_reader != NULL) delete _reader;
+  if (_ctm != NULL) delete _ctm;
+  if (_text != NULL) delete _text;
+  pthread_mutex_destroy(&_lock);
+}
+
+int32 BatchDecoder::Run(const std::string &wav_rspecifier,
+                        const std::string &ctm_wxfilename,
+                        const std::string &text_wxfilename,
+                        int32 num_threads) {
+  _reader = new SequentialTableReader<WaveHolder>(wav_rspecifier);
+  if (ctm_wxfilename != "") _ctm = new Output(ctm_wxfilename, false);
+  if (text_wxfilename != "") _text = new Output(text_wxfilename, false);
+
+  std::vector<Worker> workers(num_threads);
+  bool one_copy = (_pool->NumModelNodes() == 1);
+  double start = MonotonicSeconds();
+  for (int32 i = 0; i < num_threads; i++) {
+    Worker &worker = workers[i];
+    worker._batch = this;
+    worker._node = (one_copy ? 0 : _pool->_topology.ThreadNode(i));
+    worker._graph = NULL;
+    worker._graph_generation = 0;
+    worker._arena = (DecoderArenasEnabled() ? new DecoderArena : NULL);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (_pool->_affinity.pin_threads != "none") {
+      std::vector<int32> cpus;
+      _pool->_topology.ThreadCpus(i, _pool->_affinity.pin_threads == "cpu",
+                                  &cpus);
+      SetThreadAttrCpus(cpus, &attr);
+    }
+    int32 err = pthread_create(&(worker._tid), &attr, BatchDecoder::ThreadProc,
+                               &worker);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+      KALDI_ERR << "Can't create thread " << i << ": " << strerror(err);
+  }
+  for (int32 i = 0; i < num_threads; i++) {
+    pthread_join(workers[i]._tid, NULL);
+    if (workers[i]._graph != NULL) delete workers[i]._graph;
+    if (workers[i]._arena != NULL) delete workers[i]._arena;
+  }
+  double secs = MonotonicSeconds() - start;
+
+  if (_ctm != NULL && !_ctm->Close())
+    KALDI_ERR << "Could not write " << ctm_wxfilename;
+  if (_text != NULL && !_text->Close())
+    KALDI_ERR << "Could not write " << text_wxfilename;
+  KALDI_LOG << "Decoded " << _num_done << " files, " << _num_failed
+            << " failed; " << _audio_secs / 3600.0 << " hours of audio in "
+            << secs << " seconds, " << (secs > 0.0 ? _audio_secs / secs : 0.0)
+            << " times real time";
+  return _num_failed;
+}
+
+bool BatchDecoder::NextFile(std::string *key, Vector<BaseFloat> *wave,
+                            BaseFloat *samp_freq) {
+  pthread_mutex_lock(&_lock);
+  bool ok = false;
+  try {
+    ok = !_reader->Done();
+    if (ok) {
+      const WaveData &wave_data = _reader->Value();
+      *key = _reader->Key();
+      *samp_freq = wave_data.SampFreq();
+      // a copy, so that the next thread may read the next file
+      *wave = wave_data.Data().Row(0);
+      _reader->Next();
+    }
+  } catch(const std::exception& e) {
+    KALDI_WARN << "Could not read the next file, stopping: " << e.what();
+    ok = false;
+  }
+  pthread_mutex_unlock(&_lock);
+  return ok;
+}
+
+void* BatchDecoder::ThreadProc(void* para) {
+  Worker *worker = reinterpret_cast <Worker*> (para);
+  BatchDecoder *batch = worker->_batch;
+  std::string key;
+  Vector<BaseFloat> wave;
+  BaseFloat samp_freq;
+  while (batch->NextFile(&key, &wave, &samp_freq)) {
+    bool ok = false;
+    try {
+      ok = batch->DecodeFile(worker, key, wave, samp_freq);
+    } catch(const std::exception& e) {
+      KALDI_WARN << "Could not decode " << key << ": " << e.what();
+    }
+    pthread_mutex_lock(&batch->_lock);
+    if (ok)
+      batch->_num_done++;
+    else
+      batch->_num_failed++;
+    pthread_mutex_unlock(&batch->_lock);
+  }
+  return reinterpret_cast <void*> (NULL);
+}
+
+bool BatchDecoder::DecodeFile(Worker *worker, const std::string &key,
+                              const Vector<BaseFloat> &wave,
+                              BaseFloat samp_freq) {
+  BaseFloat feature_samp_freq = _pool->_feature_samp_freq;
+  const VectorBase<BaseFloat> *audio = &wave;
+  Vector<BaseFloat> resampled_wave;
+  if (samp_freq != feature_samp_freq) {
+    if (!PolyphaseResampler::Supported(samp_freq, feature_samp_freq)) {
+      KALDI_WARN << key << " is sampled at " << samp_freq << " Hz, which "
+                 << "cannot be resampled";
+      return false;
+    }
+    PolyphaseResampler resampler(samp_freq, feature_samp_freq);
+    std::vector<BaseFloat> resampled;
+    resampler.Resample(wave.Data(), wave.Dim(), &resampled);
+    resampler.Flush(&resampled);
+    resampled_wave.Resize(resampled.size(), kUndefined);
+    for (size_t i = 0; i < resampled.size(); i++)
+      resampled_wave(i) = resampled[i];
+    audio = &resampled_wave;
+  }
+  if (audio->Dim() == 0) {
+    KALDI_WARN << key << " is empty";
+    return false;
+  }
+
+  double start = MonotonicSeconds();
+  ModelSnapshot *models = _pool->AcquireModels();
+  // KALDI_ERR may be raised anywhere below; the next file needs the arena
+  // empty, and the snapshot must not stay referenced.
+  std::ostringstream ctm, text;
+  try {
+    if (worker->_graph != NULL &&
+        worker->_graph_generation != models->_generation) {
+      delete worker->_graph;
+      worker->_graph = NULL;
+    }
+    if (models->_fst_on_the_fly && worker->_graph == NULL) {
+      worker->_graph = models->_fst->Copy(true);
+      worker->_graph_generation = models->_generation;
+    }
+    const ModelSnapshot::NodeModels &node_models =
+        models->_node_models[worker->_node];
+    const nnet3::DecodableNnetSimpleLoopedInfo *decodable_info = NULL;
+    if (node_models.batch_inference == NULL)
+      decodable_info = &(node_models.decodable_infos->Get(decodable_opts));
+
+    Lattice lat;
+    {
+      OnlineCmvnNnet2FeaturePipeline features(*_pool->_feature_info);
+      UtteranceDecoder decoder(
+          _pool->_config,
+          (worker->_graph != NULL ? *worker->_graph : *node_models.fst),
+          (models->_fst_on_the_fly ? NULL : worker->_arena));
+      decoder.StartUtterance(models->_tmodel, decodable_info,
+                             node_models.batch_inference, &features);
+      {
+        ScopedLatency timer(kStageFeatures);
+        features.AcceptWaveform(feature_samp_freq, *audio);
+        features.InputFinished();
+      }
+      decoder.AdvanceDecoding();
+      decoder.FinalizeDecoding();
+      decoder.GetBestPath(true, &lat);
+    }
+    if (worker->_arena != NULL && !worker->_arena->Release())
+      KALDI_WARN << key << ": " << worker->_arena->NumLiveObjects()
+                 << " objects left in the arena";
+
+    std::vector<int32> words, times, lengths;
+    AlignBestPath(lat, models->_tmodel, *models->_lexicon_info, &words, &times,
+                  &lengths);
+    text << key;
+    for (size_t i = 0; i < words.size(); i++) {
+      if (words[i] == 0) continue;  // silence
+      std::string word;
+      if (models->_word_syms != NULL) word = models->_word_syms->Find(words[i]);
+      if (word.empty()) {
+        std::ostringstream id;
+        id << words[i];
+        word = id.str();
+      }
+      text << " " << word;
+      ctm << key << " 1 " << times[i] * secs_per_frame << " "
+          << lengths[i] * secs_per_frame << " " << word << "\n";
+    }
+    text << "\n";
+  } catch(...) {
+    if (worker->_arena != NULL) worker->_arena->Release();
+    _pool->ReleaseModels(models);
+    throw;
+  }
+  _pool->ReleaseModels(models);
+
+  double audio_secs = wave.Dim() / samp_freq;
+  double secs = MonotonicSeconds() - start;
+  RecordRealTimeFactor(secs / audio_secs);
+  KALDI_VLOG(1) << "Decoded " << key << ", " << audio_secs << " seconds, in "
+                << secs << " seconds";
+  pthread_mutex_lock(&_lock);
+  if (_ctm != NULL) _ctm->Stream() << ctm.str();
+  if (_text != NULL) _text->Stream() << text.str();
+  _audio_secs += audio_secs;
+  pthread_mutex_unlock(&_lock);
+  return true;
 }
 
 }  // namespace kaldi
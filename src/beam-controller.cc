@@ -0,0 +1,103 @@
+// beam-controller.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "beam-controller.h"
+
+namespace kaldi {
+
+// Weight of the latest chunk in the running average of the real-time
+// factor.
+static const double kRtfSmoothing = 0.3;
+// Without a --max-active, tightening starts from this many times
+// --min-max-active.
+static const int32 kUnlimitedMaxActiveRange = 8;
+
+BeamController::BeamController(
+    const BeamControlConfig &config,
+    const LatticeFasterDecoderConfig &decoder_config):
+    _config(config), _widest(decoder_config), _options(decoder_config),
+    _tightness(0.0), _avg_rtf(0.0), _audio_secs(0.0), _beam_secs(0.0),
+    _narrowed_secs(0.0), _lowest_beam(decoder_config.beam),
+    _lowest_max_active(decoder_config.max_active), _num_tightened(0),
+    _num_relaxed(0) { }
+
+void BeamController::SetTightness(double tightness) {
+  _tightness = tightness;
+  _options = _widest;
+  if (tightness == 0.0) return;
+
+  BaseFloat min_beam = std::min(_config.min_beam, _widest.beam);
+  _options.beam = _widest.beam - tightness * (_widest.beam - min_beam);
+  _options.lattice_beam = std::min(_widest.lattice_beam, _options.beam);
+
+  int32 min_max_active = std::min(_config.min_max_active, _widest.max_active);
+  double max_active = std::min<double>(
+      _widest.max_active,
+      static_cast<double>(min_max_active) * kUnlimitedMaxActiveRange);
+  _options.max_active = static_cast<int32>(
+      min_max_active * std::pow(max_active / min_max_active,
+                                1.0 - tightness) + 0.5);
+  _options.max_active = std::max(_options.max_active, _widest.min_active);
+}
+
+bool BeamController::Update(double wait_secs, double compute_secs,
+                            double audio_secs) {
+  if (audio_secs <= 0.0) return false;
+  _audio_secs += audio_secs;
+  _beam_secs += _options.beam * audio_secs;
+  if (_tightness > 0.0) _narrowed_secs += audio_secs;
+  if (!_config.adaptive) return false;
+
+  double rtf = (wait_secs + compute_secs) / audio_secs;
+  _avg_rtf = kRtfSmoothing * rtf + (1.0 - kRtfSmoothing) * _avg_rtf;
+  double tightness = _tightness;
+  if (_avg_rtf > _config.tighten_rtf)
+    tightness = std::min(1.0, _tightness + 0.25);
+  else if (_avg_rtf < _config.relax_rtf)
+    tightness = std::max(0.0, _tightness - 0.1);
+  if (tightness == _tightness) return false;
+
+  if (tightness > _tightness)
+    _num_tightened++;
+  else
+    _num_relaxed++;
+  SetTightness(tightness);
+  _lowest_beam = std::min(_lowest_beam, _options.beam);
+  _lowest_max_active = std::min(_lowest_max_active, _options.max_active);
+  return true;
+}
+
+std::string BeamController::Stats() const {
+  std::ostringstream stats;
+  if (_audio_secs > 0.0) {
+    stats << "beam " << _beam_secs / _audio_secs << " on average, "
+          << _lowest_beam << " lowest, max-active " << _lowest_max_active
+          << " lowest; " << 100.0 * _narrowed_secs / _audio_secs
+          << "% of the audio narrowed, ";
+  }
+  stats << "narrowed " << _num_tightened << " times, widened "
+        << _num_relaxed << " times";
+  return stats.str();
+}
+
+}  // namespace kaldi
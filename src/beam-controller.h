@@ -0,0 +1,109 @@
+// beam-controller.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_BEAM_CONTROLLER_H_
+#define KALDI_AUDIO_SERVER_BEAM_CONTROLLER_H_
+
+#include <string>
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+#include "decoder/lattice-faster-decoder.h"
+
+namespace kaldi {
+
+struct BeamControlConfig {
+  bool adaptive;
+  BaseFloat min_beam;
+  int32 min_max_active;
+  BaseFloat tighten_rtf;
+  BaseFloat relax_rtf;
+
+  BeamControlConfig(): adaptive(false), min_beam(8.0), min_max_active(1000),
+                       tighten_rtf(1.0), relax_rtf(0.6) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("adaptive-beam", &adaptive, "If true, a stream that "
+                   "falls behind real time is decoded with a narrower "
+                   "--beam and a lower --max-active (which are the widest "
+                   "ones) until it catches up");
+    opts->Register("min-beam", &min_beam, "With --adaptive-beam, the "
+                   "narrowest beam a stream is decoded with");
+    opts->Register("min-max-active", &min_max_active, "With "
+                   "--adaptive-beam, the lowest max-active a stream is "
+                   "decoded with");
+    opts->Register("beam-tighten-rtf", &tighten_rtf, "With --adaptive-beam, "
+                   "the beam is narrowed while the real-time factor of a "
+                   "stream, including the time its chunks wait for a "
+                   "decoder thread, is above this on average");
+    opts->Register("beam-relax-rtf", &relax_rtf, "... and widened again "
+                   "while it is below this");
+  }
+};
+
+/*
+ * Chooses the beam, max-active and lattice beam of one stream between the
+ * configured decoder options and the floors of BeamControlConfig.  The
+ * options are interpolated by a single tightness in [0, 1]: the beam
+ * linearly, max-active geometrically.  Tightness goes up by a quarter
+ * whenever the averaged real-time factor of the stream is above
+ * --beam-tighten-rtf and down by a tenth whenever it is below
+ * --beam-relax-rtf, so a stream that falls behind is pruned harder at
+ * once and gets its accuracy back gradually.  The decoder picks up new
+ * options at the next frame it decodes.
+ */
+class BeamController {
+ public:
+  BeamController(const BeamControlConfig &config,
+                 const LatticeFasterDecoderConfig &decoder_config);
+
+  // Accounts for "audio_secs" seconds of audio that waited "wait_secs" for
+  // a decoder thread and were decoded in "compute_secs"; returns true if
+  // Options() changed.
+  bool Update(double wait_secs, double compute_secs, double audio_secs);
+
+  // The decoder options to use now.
+  const LatticeFasterDecoderConfig &Options() const { return _options; }
+
+  // The beam averaged over the audio decoded so far, the lowest beam and
+  // max-active, how much of the audio was decoded with narrowed options
+  // and how often they changed, as one line of text.
+  std::string Stats() const;
+
+ private:
+  void SetTightness(double tightness);
+
+  const BeamControlConfig &_config;
+  const LatticeFasterDecoderConfig &_widest;
+  LatticeFasterDecoderConfig _options;
+  double _tightness;
+  double _avg_rtf;
+
+  // statistics
+  double _audio_secs;
+  double _beam_secs;      // beam times seconds of audio
+  double _narrowed_secs;  // audio decoded with narrowed options
+  BaseFloat _lowest_beam;
+  int32 _lowest_max_active;
+  int32 _num_tightened, _num_relaxed;
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_BEAM_CONTROLLER_H_
@@ -0,0 +1,62 @@
+// chunk-scheduler.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+
+#include "chunk-scheduler.h"
+
+namespace kaldi {
+
+// Weight of the latest chunk in the running average of the wait.
+static const double kWaitSmoothing = 0.3;
+
+ChunkScheduler::ChunkScheduler(const ChunkSchedulerConfig &config,
+                               BaseFloat chunk_length,
+                               BaseFloat partial_interval):
+    _config(config), _min_chunk_length(chunk_length),
+    _min_partial_interval(partial_interval), _chunk_length(chunk_length),
+    _avg_wait(0.0) { }
+
+bool ChunkScheduler::Update(double wait_secs, double audio_secs) {
+  if (!_config.adaptive || audio_secs <= 0.0) return false;
+  // Relative to the chunk length rather than to the audio decoded, which
+  // is more than a chunk exactly when the stream fell behind.
+  double wait = wait_secs / _chunk_length;
+  _avg_wait = kWaitSmoothing * wait + (1.0 - kWaitSmoothing) * _avg_wait;
+
+  BaseFloat chunk_length = _chunk_length;
+  if (_avg_wait > _config.grow_wait)
+    chunk_length = std::min(_chunk_length * 1.5f, _config.max_chunk_length);
+  else if (_avg_wait < _config.shrink_wait)
+    chunk_length = std::max(_chunk_length * 0.9f, _min_chunk_length);
+  if (chunk_length == _chunk_length) return false;
+  // the wait of the old chunk length says little about the new one
+  _avg_wait *= _chunk_length / chunk_length;
+  _chunk_length = chunk_length;
+  return true;
+}
+
+BaseFloat ChunkScheduler::PartialInterval() const {
+  BaseFloat interval =
+      _min_partial_interval * _chunk_length / _min_chunk_length;
+  return std::max(_min_partial_interval,
+                  std::min(interval, _config.max_partial_interval));
+}
+
+}  // namespace kaldi
@@ -0,0 +1,96 @@
+// chunk-scheduler.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_CHUNK_SCHEDULER_H_
+#define KALDI_AUDIO_SERVER_CHUNK_SCHEDULER_H_
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+
+namespace kaldi {
+
+struct ChunkSchedulerConfig {
+  bool adaptive;
+  BaseFloat max_chunk_length;
+  BaseFloat max_partial_interval;
+  BaseFloat grow_wait;
+  BaseFloat shrink_wait;
+
+  ChunkSchedulerConfig(): adaptive(false), max_chunk_length(0.72),
+                          max_partial_interval(1.2), grow_wait(0.5),
+                          shrink_wait(0.1) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("adaptive-chunk", &adaptive, "If true, every stream "
+                   "decodes in longer chunks, and sends partial results "
+                   "less often, while its chunks wait for a decoder "
+                   "thread, and goes back towards --chunk-length and "
+                   "--partial-interval when they do not");
+    opts->Register("max-chunk-length", &max_chunk_length, "With "
+                   "--adaptive-chunk, longest chunk in seconds a stream is "
+                   "decoded in");
+    opts->Register("max-partial-interval", &max_partial_interval, "With "
+                   "--adaptive-chunk, most seconds of audio between partial "
+                   "results");
+    opts->Register("chunk-grow-wait", &grow_wait, "With --adaptive-chunk, "
+                   "a stream's chunks grow when they wait for a decoder "
+                   "thread longer than this fraction of the chunk length "
+                   "on average");
+    opts->Register("chunk-shrink-wait", &shrink_wait, "... and shrink when "
+                   "they wait less than this fraction");
+  }
+};
+
+/*
+ * Chooses the chunk length and partial result interval of one stream.
+ * While the decoder threads keep up, a chunk is picked up soon after it
+ * is complete; once they are saturated, chunks wait in the ready queue.
+ * Longer chunks then cut the per-chunk overhead (nnet computations, best
+ * path tracebacks, partial results) of every stream so that they all stay
+ * closer to real time, at the price of latency bounded by
+ * --max-chunk-length and --max-partial-interval.  The chunk length grows
+ * by half when the average wait exceeds --chunk-grow-wait and shrinks by a
+ * tenth when it falls below --chunk-shrink-wait, so it grows fast at the
+ * start of a peak and goes back slowly.
+ */
+class ChunkScheduler {
+ public:
+  // "chunk_length" and "partial_interval" are the shortest ones, used
+  // while there is no load or without --adaptive-chunk.
+  ChunkScheduler(const ChunkSchedulerConfig &config, BaseFloat chunk_length,
+                 BaseFloat partial_interval);
+
+  // Accounts for a chunk of "audio_secs" seconds that waited "wait_secs"
+  // for a decoder thread; returns true if the chunk length changed.
+  bool Update(double wait_secs, double audio_secs);
+
+  BaseFloat ChunkLength() const { return _chunk_length; }
+  BaseFloat PartialInterval() const;
+
+ private:
+  const ChunkSchedulerConfig &_config;
+  BaseFloat _min_chunk_length;
+  BaseFloat _min_partial_interval;
+  BaseFloat _chunk_length;
+  double _avg_wait;  // running average of wait / chunk length
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_CHUNK_SCHEDULER_H_
@@ -0,0 +1,139 @@
+// cpu-affinity.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+#include "util/text-utils.h"
+
+#include "cpu-affinity.h"
+
+namespace kaldi {
+
+// Parses a sysfs list such as "0-7,16-23" into "ids"; an empty list is
+// fine.
+static bool ParseIdList(const std::string &list, std::vector<int32> *ids) {
+  ids->clear();
+  std::vector<std::string> ranges;
+  SplitStringToVector(list, ",", true, &ranges);
+  for (size_t i = 0; i < ranges.size(); i++) {
+    std::vector<int32> bounds;
+    if (!SplitStringToIntegers(ranges[i], "-", false, &bounds) ||
+        bounds.empty() || bounds.size() > 2 ||
+        bounds[0] < 0 || bounds.back() < bounds[0])
+      return false;
+    for (int32 id = bounds[0]; id <= bounds.back(); id++)
+      ids->push_back(id);
+  }
+  return true;
+}
+
+static bool ReadIdList(const std::string &filename, std::vector<int32> *ids) {
+  std::ifstream is(filename.c_str());
+  std::string line;
+  if (!std::getline(is, line)) return false;
+  return ParseIdList(line, ids);
+}
+
+CpuTopology::CpuTopology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    KALDI_WARN << "Cannot get the CPU affinity: " << strerror(errno);
+    for (int32 cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &allowed);
+  }
+
+  std::vector<int32> node_ids;
+  if (ReadIdList("/sys/devices/system/node/online", &node_ids)) {
+    for (size_t n = 0; n < node_ids.size(); n++) {
+      std::ostringstream filename;
+      filename << "/sys/devices/system/node/node" << node_ids[n]
+               << "/cpulist";
+      std::vector<int32> cpus;
+      if (!ReadIdList(filename.str(), &cpus)) continue;
+      Node node;
+      node.id = node_ids[n];
+      for (size_t c = 0; c < cpus.size(); c++)
+        if (cpus[c] < CPU_SETSIZE && CPU_ISSET(cpus[c], &allowed))
+          node.cpus.push_back(cpus[c]);
+      // nodes with memory only, or none of our CPUs, run no threads
+      if (!node.cpus.empty()) _nodes.push_back(node);
+    }
+  }
+  if (_nodes.empty()) {
+    Node node;
+    node.id = 0;
+    for (int32 cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed)) node.cpus.push_back(cpu);
+    _nodes.push_back(node);
+  }
+}
+
+void CpuTopology::ThreadCpus(int32 thread, bool one_cpu,
+                             std::vector<int32> *cpus) const {
+  const std::vector<int32> &node_cpus = NodeCpus(ThreadNode(thread));
+  if (one_cpu) {
+    int32 index = (thread / NumNodes()) % node_cpus.size();
+    cpus->assign(1, node_cpus[index]);
+  } else {
+    *cpus = node_cpus;
+  }
+}
+
+static void CpusToSet(const std::vector<int32> &cpus, cpu_set_t *set) {
+  CPU_ZERO(set);
+  for (size_t c = 0; c < cpus.size(); c++)
+    CPU_SET(cpus[c], set);
+}
+
+bool SetThreadAttrCpus(const std::vector<int32> &cpus, pthread_attr_t *attr) {
+  cpu_set_t set;
+  CpusToSet(cpus, &set);
+  int32 err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+  if (err != 0) {
+    KALDI_WARN << "Cannot set the CPU affinity of a thread: "
+               << strerror(err);
+    return false;
+  }
+  return true;
+}
+
+ScopedThreadAffinity::ScopedThreadAffinity(const std::vector<int32> &cpus):
+    _pinned(false) {
+  if (cpus.empty() ||
+      pthread_getaffinity_np(pthread_self(), sizeof(_saved), &_saved) != 0)
+    return;
+  cpu_set_t set;
+  CpusToSet(cpus, &set);
+  int32 err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0)
+    KALDI_WARN << "Cannot move to other CPUs: " << strerror(err);
+  else
+    _pinned = true;
+}
+
+ScopedThreadAffinity::~ScopedThreadAffinity() {
+  if (_pinned)
+    pthread_setaffinity_np(pthread_self(), sizeof(_saved), &_saved);
+}
+
+}  // namespace kaldi
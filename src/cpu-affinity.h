@@ -0,0 +1,109 @@
+// cpu-affinity.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_CPU_AFFINITY_H_
+#define KALDI_AUDIO_SERVER_CPU_AFFINITY_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+
+namespace kaldi {
+
+struct CpuAffinityConfig {
+  std::string pin_threads;
+  bool numa_replicate;
+
+  CpuAffinityConfig(): pin_threads("none"), numa_replicate(false) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("pin-decoder-threads", &pin_threads, "none, node (every "
+                   "decoder thread runs on the CPUs of one NUMA node, the "
+                   "threads being dealt out to the nodes in turn) or cpu "
+                   "(every decoder thread also gets a CPU of its own, as "
+                   "long as there are enough)");
+    opts->Register("numa-replicate", &numa_replicate, "If true, every NUMA "
+                   "node gets its own copy of the acoustic model and the "
+                   "decoding graph, and a session is only decoded by the "
+                   "threads of the node it was assigned to when it started. "
+                   " Implies --pin-decoder-threads=node if that is none.");
+  }
+};
+
+/*
+ * The NUMA nodes of the machine and their CPUs, as listed in
+ * /sys/devices/system/node, restricted to the CPUs the process may run on
+ * (taskset, cgroups).  Without NUMA information all CPUs form one node.
+ */
+class CpuTopology {
+ public:
+  CpuTopology();
+
+  int32 NumNodes() const { return _nodes.size(); }
+  // The kernel's number of node "node", for messages.
+  int32 NodeId(int32 node) const { return _nodes[node].id; }
+  const std::vector<int32> &NodeCpus(int32 node) const {
+    return _nodes[node].cpus;
+  }
+
+  // Node of the "thread"-th decoder thread; threads are dealt out to the
+  // nodes in turn.
+  int32 ThreadNode(int32 thread) const { return thread % NumNodes(); }
+  // The CPUs the "thread"-th decoder thread runs on: all of its node's,
+  // or with "one_cpu" a single one, the next one of the node not taken by
+  // an earlier thread.
+  void ThreadCpus(int32 thread, bool one_cpu, std::vector<int32> *cpus) const;
+
+ private:
+  struct Node {
+    int32 id;
+    std::vector<int32> cpus;
+  };
+  std::vector<Node> _nodes;
+};
+
+// Makes threads created with "attr" start on "cpus" only.
+bool SetThreadAttrCpus(const std::vector<int32> &cpus, pthread_attr_t *attr);
+
+/*
+ * Moves the calling thread to "cpus" for the lifetime of the object and
+ * back to the CPUs it had before afterwards.  Memory that the thread
+ * allocates and touches first in the meantime is placed on the node of
+ * those CPUs by the kernel's default NUMA policy, and threads it creates
+ * inherit the affinity.  With no "cpus" the thread stays where it is.
+ */
+class ScopedThreadAffinity {
+ public:
+  explicit ScopedThreadAffinity(const std::vector<int32> &cpus);
+  ~ScopedThreadAffinity();
+
+ private:
+  cpu_set_t _saved;
+  bool _pinned;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(ScopedThreadAffinity);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_CPU_AFFINITY_H_
@@ -0,0 +1,279 @@
+// decoder-arena.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <new>
+
+#include "decoder-arena.h"
+
+namespace kaldi {
+
+// Chunks are aligned to their size, so the header of the chunk an object
+// lives in is found by masking its address.
+static const size_t kChunkSize = 64 << 10;
+static const size_t kChunkHeaderSize = 64;
+static const size_t kGranularity = 16;
+// Idle chunks the pool keeps resident; the pages of any more are dropped.
+static const int64 kMaxIdleChunks = (16 << 20) / kChunkSize;
+
+struct ChunkHeader {
+  DecoderArena *owner;  // NULL once the owner is gone
+  char *next;           // next chunk of the same arena
+  int32 size_class;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set once by InitDecoderArenas(), before there are other threads.
+static char *region_begin = NULL, *region_end = NULL;
+static char *region_next = NULL;   // chunks from here on were never used
+static char **idle_chunks = NULL;  // stack of chunks given back
+static int64 num_idle = 0, num_in_use = 0;
+
+static __thread DecoderArena *current_arena = NULL;
+// Calls of operator new made by the thread, with or without an arena.
+static __thread int64 num_thread_allocations = 0;
+
+static inline bool InArenaRegion(const void *ptr) {
+  return static_cast<const char*>(ptr) >= region_begin &&
+      static_cast<const char*>(ptr) < region_end;
+}
+
+static inline ChunkHeader *ChunkOf(void *ptr) {
+  size_t offset = static_cast<char*>(ptr) - region_begin;
+  return reinterpret_cast<ChunkHeader*>(
+      region_begin + (offset & ~(kChunkSize - 1)));
+}
+
+bool InitDecoderArenas(int64 region_bytes) {
+  KALDI_ASSERT(region_begin == NULL);
+  int64 num_chunks = region_bytes / kChunkSize;
+  if (num_chunks <= 0) return false;
+  // Address space only; pages are backed when a chunk is first used.
+  size_t length = (num_chunks + 1) * kChunkSize;
+  void *region = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    KALDI_WARN << "Cannot reserve " << (region_bytes >> 20) << " MB for "
+               << "decoder arenas: " << strerror(errno);
+    return false;
+  }
+  idle_chunks = static_cast<char**>(malloc(num_chunks * sizeof(char*)));
+  if (idle_chunks == NULL) {
+    munmap(region, length);
+    return false;
+  }
+  uintptr_t begin = reinterpret_cast<uintptr_t>(region);
+  begin = (begin + kChunkSize - 1) & ~(kChunkSize - 1);
+  region_begin = region_next = reinterpret_cast<char*>(begin);
+  region_end = region_begin + num_chunks * kChunkSize;
+  KALDI_LOG << "Reserved " << (region_bytes >> 20) << " MB for decoder "
+            << "arenas";
+  return true;
+}
+
+bool DecoderArenasEnabled() {
+  return region_begin != NULL;
+}
+
+void GetDecoderArenaStats(int64 *in_use_bytes, int64 *idle_bytes) {
+  pthread_mutex_lock(&pool_lock);
+  *in_use_bytes = num_in_use * kChunkSize;
+  *idle_bytes = num_idle * kChunkSize;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+DecoderArena::DecoderArena(): _chunks(NULL), _num_chunks(0), _num_live(0) {
+  for (int32 c = 0; c < kNumSizeClasses; c++) {
+    _free[c] = NULL;
+    _next[c] = _end[c] = NULL;
+  }
+}
+
+DecoderArena::~DecoderArena() {
+  if (Release()) return;
+  // Whatever is still alive will be freed into chunks nobody owns, which
+  // are never used again.
+  KALDI_WARN << "Decoder arena deleted with " << _num_live << " objects "
+             << "alive; leaking " << _num_chunks << " chunks";
+  for (char *chunk = _chunks; chunk != NULL; ) {
+    ChunkHeader *header = reinterpret_cast<ChunkHeader*>(chunk);
+    header->owner = NULL;
+    chunk = header->next;
+  }
+}
+
+bool DecoderArena::NewChunk(int32 size_class) {
+  char *chunk = NULL;
+  pthread_mutex_lock(&pool_lock);
+  if (num_idle > 0) {
+    chunk = idle_chunks[--num_idle];
+  } else if (region_next < region_end) {
+    chunk = region_next;
+    region_next += kChunkSize;
+  }
+  if (chunk != NULL) num_in_use++;
+  pthread_mutex_unlock(&pool_lock);
+  if (chunk == NULL) return false;
+
+  ChunkHeader *header = reinterpret_cast<ChunkHeader*>(chunk);
+  header->owner = this;
+  header->next = _chunks;
+  header->size_class = size_class;
+  _chunks = chunk;
+  _num_chunks++;
+  _next[size_class] = chunk + kChunkHeaderSize;
+  _end[size_class] = chunk + kChunkSize;
+  return true;
+}
+
+void *DecoderArena::Allocate(size_t size) {
+  if (size > kMaxObjectSize) return NULL;
+  int32 c = (size == 0 ? 0 : (size - 1) / kGranularity);
+  void *ptr = _free[c];
+  if (ptr != NULL) {
+    _free[c] = *static_cast<void**>(ptr);
+  } else {
+    size_t bytes = (c + 1) * kGranularity;
+    if (_next[c] + bytes > _end[c] && !NewChunk(c)) return NULL;
+    ptr = _next[c];
+    _next[c] += bytes;
+  }
+  _num_live++;
+  return ptr;
+}
+
+bool DecoderArena::Release() {
+  if (_num_live != 0) return false;
+  if (_chunks == NULL) return true;
+  pthread_mutex_lock(&pool_lock);
+  for (char *chunk = _chunks; chunk != NULL; ) {
+    char *next = reinterpret_cast<ChunkHeader*>(chunk)->next;
+    if (num_idle >= kMaxIdleChunks)
+      madvise(chunk, kChunkSize, MADV_DONTNEED);
+    idle_chunks[num_idle++] = chunk;
+    chunk = next;
+  }
+  num_in_use -= _num_chunks;
+  pthread_mutex_unlock(&pool_lock);
+
+  _chunks = NULL;
+  _num_chunks = 0;
+  for (int32 c = 0; c < kNumSizeClasses; c++) {
+    _free[c] = NULL;
+    _next[c] = _end[c] = NULL;
+  }
+  return true;
+}
+
+void FreeArenaObject(void *ptr) {
+  ChunkHeader *header = ChunkOf(ptr);
+  DecoderArena *arena = header->owner;
+  if (arena == NULL) return;
+  int32 c = header->size_class;
+  *static_cast<void**>(ptr) = arena->_free[c];
+  arena->_free[c] = ptr;
+  arena->_num_live--;
+}
+
+int64 NumThreadAllocations() {
+  return num_thread_allocations;
+}
+
+ScopedDecoderArena::ScopedDecoderArena(DecoderArena *arena):
+    _previous(current_arena) {
+  if (arena != NULL) current_arena = arena;
+}
+
+ScopedDecoderArena::~ScopedDecoderArena() {
+  current_arena = _previous;
+}
+
+static void *MallocOrThrow(size_t size) {
+  if (size == 0) size = 1;
+  void *ptr;
+  while ((ptr = malloc(size)) == NULL) {
+    std::new_handler handler = std::get_new_handler();
+    if (handler == NULL) throw std::bad_alloc();
+    handler();
+  }
+  return ptr;
+}
+
+static inline void *ArenaNew(size_t size) {
+  num_thread_allocations++;
+  if (current_arena != NULL) {
+    void *ptr = current_arena->Allocate(size);
+    if (ptr != NULL) return ptr;
+  }
+  return MallocOrThrow(size);
+}
+
+static inline void ArenaDelete(void *ptr) {
+  if (InArenaRegion(ptr))
+    FreeArenaObject(ptr);
+  else
+    free(ptr);
+}
+
+}  // namespace kaldi
+
+void *operator new(size_t size) {
+  return kaldi::ArenaNew(size);
+}
+
+void *operator new[](size_t size) {
+  return kaldi::ArenaNew(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return kaldi::ArenaNew(size);
+  } catch(const std::bad_alloc &) {
+    return NULL;
+  }
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return kaldi::ArenaNew(size);
+  } catch(const std::bad_alloc &) {
+    return NULL;
+  }
+}
+
+void operator delete(void *ptr) noexcept {
+  kaldi::ArenaDelete(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  kaldi::ArenaDelete(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  kaldi::ArenaDelete(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  kaldi::ArenaDelete(ptr);
+}
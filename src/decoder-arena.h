@@ -0,0 +1,115 @@
+// decoder-arena.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_DECODER_ARENA_H_
+#define KALDI_AUDIO_SERVER_DECODER_ARENA_H_
+
+#include <stddef.h>
+
+#include "base/kaldi-common.h"
+
+namespace kaldi {
+
+/*
+ * Slab allocator for the small objects of the search: the tokens and
+ * forward links LatticeFasterOnlineDecoder creates and deletes with plain
+ * new and delete by the thousand every frame.
+ *
+ * Kaldi's decoders have no allocator parameter, so this file replaces the
+ * global operator new and delete.  While a ScopedDecoderArena is alive on
+ * a thread, allocations of up to kMaxObjectSize bytes made by that thread
+ * come from the arena; everything else goes to malloc() as before.  An
+ * object is given back to the arena it came from when it is deleted, in or
+ * out of the scope, so only code whose allocations die with the decoder
+ * (the search itself, not the nnet or the lattice it outputs) may run in
+ * the scope.
+ *
+ * An arena carves 64 kB chunks, one object size per chunk, out of a
+ * single region reserved by InitDecoderArenas(); the chunks go back to a
+ * pool shared by all arenas in one piece by Release() once everything
+ * allocated from the arena has been deleted, i.e. between utterances.
+ * Chunks beyond a few MB idle in the pool are given back to the kernel.
+ *
+ * An arena is not thread-safe.  It belongs to a session, which is decoded
+ * by one thread at a time, rather than to a decoder thread, because a
+ * session moves between decoder threads from one chunk of audio to the
+ * next.
+ */
+class DecoderArena {
+ public:
+  static const size_t kMaxObjectSize = 256;
+
+  DecoderArena();
+  ~DecoderArena();
+
+  // Returns "size" bytes, or NULL if the arena cannot serve them.
+  void *Allocate(size_t size);
+
+  // Gives all chunks back to the pool if nothing allocated from the arena
+  // is alive anymore; returns false otherwise.
+  bool Release();
+
+  int64 NumLiveObjects() const { return _num_live; }
+  int32 NumChunks() const { return _num_chunks; }
+
+ private:
+  friend void FreeArenaObject(void *ptr);
+
+  static const int32 kNumSizeClasses = 16;
+
+  bool NewChunk(int32 size_class);
+
+  void *_free[kNumSizeClasses];  // free list of every size class
+  char *_next[kNumSizeClasses];  // unused space in the newest chunk
+  char *_end[kNumSizeClasses];
+  char *_chunks;                 // all chunks of the arena, linked
+  int32 _num_chunks;
+  int64 _num_live;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(DecoderArena);
+};
+
+// Reserves "region_bytes" of address space for the chunks of all arenas;
+// call it once, before any arena is created.  Returns false if the
+// space cannot be reserved.  Without it, arenas allocate nothing.
+bool InitDecoderArenas(int64 region_bytes);
+
+bool DecoderArenasEnabled();
+
+// Bytes of chunks owned by arenas, and of idle chunks kept by the pool.
+void GetDecoderArenaStats(int64 *in_use_bytes, int64 *idle_bytes);
+
+// Number of times the calling thread called operator new so far, arenas
+// enabled or not; for measuring what a piece of code allocates.
+int64 NumThreadAllocations();
+
+// Serves small allocations of the calling thread from "arena" (if not
+// NULL) for the lifetime of the object.
+class ScopedDecoderArena {
+ public:
+  explicit ScopedDecoderArena(DecoderArena *arena);
+  ~ScopedDecoderArena();
+
+ private:
+  DecoderArena *_previous;
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_DECODER_ARENA_H_
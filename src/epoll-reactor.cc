@@ -0,0 +1,129 @@
+// epoll-reactor.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "epoll-reactor.h"
+
+namespace kaldi {
+
+EpollReactor::EpollReactor() {
+  _epoll_fd = -1;
+  _wakeup_fd = -1;
+  _running = false;
+}
+
+EpollReactor::~EpollReactor() {
+  Stop();
+  if (_wakeup_fd != -1) close(_wakeup_fd);
+  if (_epoll_fd != -1) close(_epoll_fd);
+}
+
+bool EpollReactor::Start() {
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epoll_fd == -1) {
+    KALDI_WARN << "Cannot create epoll instance: " << strerror(errno);
+    return false;
+  }
+  _wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  if (_wakeup_fd == -1) {
+    KALDI_WARN << "Cannot create eventfd: " << strerror(errno);
+    return false;
+  }
+  // a NULL handler marks the wakeup descriptor
+  if (!Control(EPOLL_CTL_ADD, _wakeup_fd, EPOLLIN, NULL))
+    return false;
+
+  _running = true;
+  int32 err = pthread_create(&_tid, NULL, EpollReactor::ThreadProc, this);
+  if (err != 0) {
+    KALDI_WARN << "Can't create reactor thread: " << strerror(err);
+    _running = false;
+    return false;
+  }
+  return true;
+}
+
+void EpollReactor::Stop() {
+  if (!_running) return;
+  uint64 one = 1;
+  if (write(_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+    KALDI_WARN << "Cannot wake up reactor thread: " << strerror(errno);
+  pthread_join(_tid, NULL);
+  _running = false;
+}
+
+bool EpollReactor::Add(int32 fd, Handler *handler) {
+  return Control(EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP, handler);
+}
+
+bool EpollReactor::Remove(int32 fd) {
+  return Control(EPOLL_CTL_DEL, fd, 0, NULL);
+}
+
+bool EpollReactor::Pause(int32 fd, Handler *handler) {
+  return Control(EPOLL_CTL_MOD, fd, 0, handler);
+}
+
+bool EpollReactor::Resume(int32 fd, Handler *handler) {
+  return Control(EPOLL_CTL_MOD, fd, EPOLLIN | EPOLLRDHUP, handler);
+}
+
+bool EpollReactor::Control(int32 op, int32 fd, uint32 events,
+                           Handler *handler) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = handler;
+  if (epoll_ctl(_epoll_fd, op, fd, &ev) == -1) {
+    KALDI_WARN << "epoll_ctl failed on socket " << fd << ": "
+               << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void* EpollReactor::ThreadProc(void *para) {
+  EpollReactor *reactor = reinterpret_cast<EpollReactor*>(para);
+  const int32 kMaxEvents = 64;
+  struct epoll_event events[kMaxEvents];
+
+  KALDI_VLOG(1) << "Reactor is ready";
+  while (true) {
+    int32 n = epoll_wait(reactor->_epoll_fd, events, kMaxEvents, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      KALDI_WARN << "epoll_wait failed: " << strerror(errno);
+      break;
+    }
+    for (int32 i = 0; i < n; i++) {
+      Handler *handler = reinterpret_cast<Handler*>(events[i].data.ptr);
+      if (handler == NULL) {
+        KALDI_VLOG(1) << "Reactor is stopping";
+        return reinterpret_cast<void*>(NULL);
+      }
+      handler->OnReadable();
+    }
+  }
+  return reinterpret_cast<void*>(NULL);
+}
+
+}  // namespace kaldi
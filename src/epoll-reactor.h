@@ -0,0 +1,77 @@
+// epoll-reactor.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_EPOLL_REACTOR_H_
+#define KALDI_AUDIO_SERVER_EPOLL_REACTOR_H_
+
+#include <pthread.h>
+
+#include "base/kaldi-common.h"
+
+namespace kaldi {
+
+/*
+ * A single thread that waits on many client sockets with epoll and tells
+ * the owner of a socket when it has data to read.  Sockets are watched in
+ * level-triggered mode, so a handler may read as little as it likes per
+ * call.
+ */
+class EpollReactor {
+ public:
+  class Handler {
+   public:
+    // Called on the reactor thread when the handler's socket is readable
+    // or was closed by the peer.  The handler must call Remove() from
+    // here before it gives itself away or gets deleted.
+    virtual void OnReadable() = 0;
+    virtual ~Handler() { }
+  };
+
+  EpollReactor();
+  ~EpollReactor();
+
+  // Creates the epoll instance and starts the reactor thread.
+  bool Start();
+  // Stops the reactor thread; registered sockets are left open.
+  void Stop();
+
+  // Starts watching "fd"; may be called from any thread.
+  bool Add(int32 fd, Handler *handler);
+  // Stops watching "fd" for good.
+  bool Remove(int32 fd);
+  // Temporarily stops or restarts reading from "fd", e.g. when the owner
+  // has buffered enough data.
+  bool Pause(int32 fd, Handler *handler);
+  bool Resume(int32 fd, Handler *handler);
+
+ private:
+  static void* ThreadProc(void *para);
+  bool Control(int32 op, int32 fd, uint32 events, Handler *handler);
+
+  int32 _epoll_fd;
+  int32 _wakeup_fd;  // eventfd used to stop the thread
+  pthread_t _tid;
+  bool _running;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(EpollReactor);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_EPOLL_REACTOR_H_
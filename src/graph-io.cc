@@ -0,0 +1,110 @@
+// graph-io.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdlib>
+#include <fstream>
+
+#include "graph-io.h"
+
+namespace kaldi {
+
+fst::Fst<fst::StdArc> *ReadDecodingGraph(std::string rxfilename,
+                                         bool memory_map) {
+  if (rxfilename == "") rxfilename = "-";  // interpret "" as stdin,
+  // for compatibility with OpenFst conventions.
+  if (memory_map && ClassifyRxfilename(rxfilename) != kFileInput) {
+    KALDI_WARN << "Only plain files can be memory mapped, reading "
+               << PrintableRxfilename(rxfilename) << " into memory";
+    memory_map = false;
+  }
+
+  Timer timer;
+  fst::Fst<fst::StdArc> *fst = NULL;
+  std::string fst_type;
+  if (memory_map) {
+    // OpenFst maps the graph from the file named in the read options, so
+    // it is opened by name rather than through kaldi::Input.
+    std::ifstream is(rxfilename.c_str(), std::ios::in | std::ios::binary);
+    fst::FstHeader hdr;
+    if (!is || !hdr.Read(is, rxfilename))
+      KALDI_ERR << "Reading FST: error reading FST header from "
+                << rxfilename;
+    fst_type = hdr.FstType();
+    if (fst_type != "const")
+      KALDI_WARN << "Graph " << rxfilename << " has type " << fst_type
+                 << ", so it cannot be memory mapped; convert it with "
+                 << "fstconvert --fst_type=const --fst_align=true";
+    fst::FstReadOptions ropts(rxfilename, &hdr);
+    ropts.mode = fst::FstReadOptions::MAP;
+    fst = fst::Fst<fst::StdArc>::Read(is, ropts);
+  } else {
+    kaldi::Input ki(rxfilename);
+    fst::FstHeader hdr;
+    if (!hdr.Read(ki.Stream(), rxfilename))
+      KALDI_ERR << "Reading FST: error reading FST header from "
+                << kaldi::PrintableRxfilename(rxfilename);
+    fst_type = hdr.FstType();
+    fst::FstReadOptions ropts("<unspecified>", &hdr);
+    fst = fst::Fst<fst::StdArc>::Read(ki.Stream(), ropts);
+  }
+  if (!fst)
+    KALDI_ERR << "Could not read fst from "
+              << kaldi::PrintableRxfilename(rxfilename);
+
+  KALDI_LOG << "Read " << fst_type << " graph "
+            << PrintableRxfilename(rxfilename)
+            << (memory_map ? " (memory mapped)" : "") << " in "
+            << timer.Elapsed() << " seconds, resident memory is now "
+            << GetResidentMemoryKb() << " kB";
+  return fst;
+}
+
+fst::Fst<fst::StdArc> *ComposeDecodingGraph(const fst::Fst<fst::StdArc> &hcl,
+                                            const fst::Fst<fst::StdArc> &g,
+                                            int32 cache_mb) {
+  if (hcl.Type() != "olabel_lookahead")
+    KALDI_WARN << "HCL has type " << hcl.Type() << " instead of "
+               << "olabel_lookahead; composing without lookahead is slow";
+  // Copies of a ComposeFst copy both operands with Copy(true), which only
+  // shares the arcs of ConstFst-based FSTs.
+  fst::Fst<fst::StdArc> *g_const = NULL;
+  if (g.Type() != "const") g_const = new fst::StdConstFst(g);
+
+  fst::CacheOptions cache_opts(true, static_cast<size_t>(cache_mb) << 20);
+  fst::Fst<fst::StdArc> *graph = new fst::ComposeFst<fst::StdArc>(
+      hcl, (g_const != NULL ? *g_const : g), cache_opts);
+  if (g_const != NULL) delete g_const;
+
+  KALDI_LOG << "Composing the decoding graph on the fly, with up to "
+            << cache_mb << " MB of cached states per decoder; resident "
+            << "memory is " << GetResidentMemoryKb() << " kB";
+  return graph;
+}
+
+int64 GetResidentMemoryKb() {
+  std::ifstream is("/proc/self/status");
+  std::string line;
+  while (std::getline(is, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0)
+      return strtoll(line.c_str() + 6, NULL, 10);
+  }
+  return -1;
+}
+
+}  // namespace kaldi
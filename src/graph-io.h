@@ -0,0 +1,64 @@
+// graph-io.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_GRAPH_IO_H_
+#define KALDI_AUDIO_SERVER_GRAPH_IO_H_
+
+#include <string>
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-lib.h"
+
+namespace kaldi {
+
+/*
+ * Reads the decoding graph.  With "memory_map" set, a graph stored as a
+ * ConstFst in a plain file is mmap()ed read-only instead of being copied
+ * to the heap, so loading is almost free and every server process on the
+ * host shares the same pages of the page cache.  The graph has to be
+ * converted once with
+ *   fstconvert --fst_type=const --fst_align=true HCLG.fst HCLG.const.fst
+ * Other graphs are read as usual, with a warning.
+ */
+fst::Fst<fst::StdArc> *ReadDecodingGraph(std::string rxfilename,
+                                         bool memory_map);
+
+/*
+ * Builds the decoding graph as a lazy composition of "hcl" and "g", for
+ * graphs too big to be expanded into a static HCLG.  "hcl" has to be an
+ * olabel_lookahead FST and "g" must have been relabeled to match it, e.g.
+ *   fstconvert --fst_type=olabel_lookahead --save_relabel_opairs=relabel \
+ *     HCL.fst HCL.la.fst
+ *   fstrelabel --relabel_ipairs=relabel G.fst | fstarcsort > G.la.fst
+ * so that OpenFst composes them with label lookahead.  States are expanded
+ * when the search reaches them and kept in a cache of at most "cache_mb"
+ * MB.  The cache is not thread-safe: every decoder needs its own
+ * Copy(true) of the result, and copies share "hcl" and "g", which are
+ * copied here and may be deleted afterwards.
+ */
+fst::Fst<fst::StdArc> *ComposeDecodingGraph(const fst::Fst<fst::StdArc> &hcl,
+                                            const fst::Fst<fst::StdArc> &g,
+                                            int32 cache_mb);
+
+// Resident set size of this process in kB, or -1 if it is unknown.
+int64 GetResidentMemoryKb();
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_GRAPH_IO_H_
@@ -0,0 +1,232 @@
+// job-queue.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_JOB_QUEUE_H_
+#define KALDI_AUDIO_SERVER_JOB_QUEUE_H_
+
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+
+#include "base/kaldi-common.h"
+
+namespace kaldi {
+
+// Returns a monotonic timestamp in seconds, used for measuring how long
+// jobs stay in the queue.
+inline double MonotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+struct JobQueueStats {
+  int64 num_jobs;     // number of jobs handed to consumers so far
+  int64 num_expired;  // number of jobs removed by PopExpired()
+  double total_wait;  // summed queue wait time of handed out jobs, in seconds
+  double max_wait;    // longest queue wait time seen, in seconds
+
+  JobQueueStats(): num_jobs(0), num_expired(0), total_wait(0.0),
+                   max_wait(0.0) { }
+
+  double AverageWait() const {
+    return (num_jobs > 0 ? total_wait / num_jobs : 0.0);
+  }
+};
+
+/*
+ * A bounded multi-producer multi-consumer queue.  Consumers block on a
+ * condition variable while the queue is empty, so idle threads do not
+ * consume any CPU and are woken up as soon as a job is pushed.  The time
+ * every job spends in the queue is accumulated in JobQueueStats.
+ */
+template<class T>
+class JobQueue {
+ public:
+  explicit JobQueue(int32 capacity);
+  ~JobQueue();
+
+  // Adds a job without blocking; returns false if the queue is full or
+  // has been shut down.
+  bool TryPush(const T &job);
+
+  // Blocks until a job is available and removes it from the queue.  If
+  // "wait_secs" is not NULL it receives the time the job spent queued.
+  // Returns false once the queue has been shut down and drained.
+  bool Pop(T *job, double *wait_secs);
+
+  // Like Pop(), but returns false right away if the queue is empty.
+  bool TryPop(T *job, double *wait_secs);
+
+  // Removes all jobs that have been queued for at least "max_wait"
+  // seconds and appends them to "jobs", oldest first.  Returns the number
+  // of jobs removed.
+  int32 PopExpired(double max_wait, std::vector<T> *jobs);
+
+  // Returns how long the oldest queued job has been waiting, in seconds,
+  // or a negative value if the queue is empty.
+  double OldestWait();
+
+  // Wakes up all blocked consumers; subsequent pushes fail.
+  void Shutdown();
+
+  int32 Size();
+  JobQueueStats Stats();
+
+ private:
+  struct Entry {
+    T job;
+    double enqueue_time;
+  };
+
+  // Removes the head of the queue, if any, and releases _lock.
+  bool PopLocked(T *job, double *wait_secs);
+
+  std::vector<Entry> _entries;  // ring buffer of size "capacity"
+  int32 _head;
+  int32 _size;
+  bool _shutdown;
+  JobQueueStats _stats;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _not_empty;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(JobQueue);
+};
+
+template<class T>
+JobQueue<T>::JobQueue(int32 capacity):
+    _entries(capacity), _head(0), _size(0), _shutdown(false) {
+  KALDI_ASSERT(capacity > 0);
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_not_empty, NULL);
+}
+
+template<class T>
+JobQueue<T>::~JobQueue() {
+  pthread_cond_destroy(&_not_empty);
+  pthread_mutex_destroy(&_lock);
+}
+
+template<class T>
+bool JobQueue<T>::TryPush(const T &job) {
+  pthread_mutex_lock(&_lock);
+  int32 capacity = _entries.size();
+  if (_shutdown || _size == capacity) {
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+  Entry &entry = _entries[(_head + _size) % capacity];
+  entry.job = job;
+  entry.enqueue_time = MonotonicSeconds();
+  _size++;
+  pthread_cond_signal(&_not_empty);
+  pthread_mutex_unlock(&_lock);
+  return true;
+}
+
+template<class T>
+bool JobQueue<T>::Pop(T *job, double *wait_secs) {
+  pthread_mutex_lock(&_lock);
+  while (_size == 0 && !_shutdown)
+    pthread_cond_wait(&_not_empty, &_lock);
+  return PopLocked(job, wait_secs);
+}
+
+template<class T>
+bool JobQueue<T>::TryPop(T *job, double *wait_secs) {
+  pthread_mutex_lock(&_lock);
+  return PopLocked(job, wait_secs);
+}
+
+template<class T>
+bool JobQueue<T>::PopLocked(T *job, double *wait_secs) {
+  if (_size == 0) {
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+  Entry &entry = _entries[_head];
+  *job = entry.job;
+  double wait = MonotonicSeconds() - entry.enqueue_time;
+  _head = (_head + 1) % static_cast<int32>(_entries.size());
+  _size--;
+
+  _stats.num_jobs++;
+  _stats.total_wait += wait;
+  if (wait > _stats.max_wait) _stats.max_wait = wait;
+  pthread_mutex_unlock(&_lock);
+
+  if (wait_secs != NULL) *wait_secs = wait;
+  return true;
+}
+
+template<class T>
+int32 JobQueue<T>::PopExpired(double max_wait, std::vector<T> *jobs) {
+  pthread_mutex_lock(&_lock);
+  double now = MonotonicSeconds();
+  int32 num_expired = 0;
+  // Jobs are queued in FIFO order, so the expired ones are at the head.
+  while (_size > 0 && now - _entries[_head].enqueue_time >= max_wait) {
+    jobs->push_back(_entries[_head].job);
+    _head = (_head + 1) % static_cast<int32>(_entries.size());
+    _size--;
+    num_expired++;
+  }
+  _stats.num_expired += num_expired;
+  pthread_mutex_unlock(&_lock);
+  return num_expired;
+}
+
+template<class T>
+double JobQueue<T>::OldestWait() {
+  pthread_mutex_lock(&_lock);
+  double wait = -1.0;
+  if (_size > 0)
+    wait = MonotonicSeconds() - _entries[_head].enqueue_time;
+  pthread_mutex_unlock(&_lock);
+  return wait;
+}
+
+template<class T>
+void JobQueue<T>::Shutdown() {
+  pthread_mutex_lock(&_lock);
+  _shutdown = true;
+  pthread_cond_broadcast(&_not_empty);
+  pthread_mutex_unlock(&_lock);
+}
+
+template<class T>
+int32 JobQueue<T>::Size() {
+  pthread_mutex_lock(&_lock);
+  int32 size = _size;
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+template<class T>
+JobQueueStats JobQueue<T>::Stats() {
+  pthread_mutex_lock(&_lock);
+  JobQueueStats stats = _stats;
+  pthread_mutex_unlock(&_lock);
+  return stats;
+}
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_JOB_QUEUE_H_
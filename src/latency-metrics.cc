@@ -0,0 +1,227 @@
+// latency-metrics.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include "latency-metrics.h"
+
+namespace kaldi {
+
+namespace {
+
+// Buckets grow by a factor of 2^(1/4) from 1 microsecond, which covers
+// values up to about 18 minutes with a relative error below 19%.
+const int32 kBucketsPerOctave = 4;
+const int32 kNumBuckets = 30 * kBucketsPerOctave;
+const double kMinValue = 1.0e-6;
+
+const char *kStageNames[kNumLatencyStages] = {
+  "queue_wait", "socket_read", "features", "nnet", "decode", "best_path",
+  "word_align", "result_write"
+};
+
+// Only the owning thread writes to a histogram, so relaxed atomics are
+// enough; readers may see a sample in the count but not yet in the sum.
+struct Histogram {
+  std::atomic<uint64> buckets[kNumBuckets];
+  std::atomic<uint64> count;
+  std::atomic<double> sum;
+
+  Histogram(): count(0), sum(0.0) {
+    for (int32 i = 0; i < kNumBuckets; i++) buckets[i] = 0;
+  }
+
+  void Add(double value) {
+    int32 b = 0;
+    if (value > kMinValue)
+      b = std::min(kNumBuckets - 1, static_cast<int32>(
+          kBucketsPerOctave * std::log2(value / kMinValue)));
+    buckets[b].store(buckets[b].load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value,
+              std::memory_order_relaxed);
+  }
+};
+
+struct ThreadMetrics {
+  Histogram stages[kNumLatencyStages];
+  Histogram rtf;
+  Histogram chunk_length;
+};
+
+pthread_mutex_t g_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<ThreadMetrics*> g_thread_metrics;  // never freed
+__thread ThreadMetrics *t_metrics = NULL;
+
+ThreadMetrics *GetThreadMetrics() {
+  if (t_metrics == NULL) {
+    t_metrics = new ThreadMetrics;
+    pthread_mutex_lock(&g_metrics_lock);
+    g_thread_metrics.push_back(t_metrics);
+    pthread_mutex_unlock(&g_metrics_lock);
+  }
+  return t_metrics;
+}
+
+// A snapshot of the sum of the histograms of all threads.
+struct HistogramSum {
+  uint64 buckets[kNumBuckets];
+  uint64 count;
+  double sum;
+
+  HistogramSum(): count(0), sum(0.0) {
+    for (int32 i = 0; i < kNumBuckets; i++) buckets[i] = 0;
+  }
+
+  void Add(const Histogram &h) {
+    for (int32 i = 0; i < kNumBuckets; i++)
+      buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+    count += h.count.load(std::memory_order_relaxed);
+    sum += h.sum.load(std::memory_order_relaxed);
+  }
+
+  // Upper bound of the bucket that holds the "q" quantile.
+  double Quantile(double q) const {
+    uint64 total = 0;
+    for (int32 i = 0; i < kNumBuckets; i++) total += buckets[i];
+    if (total == 0) return 0.0;
+    uint64 rank = static_cast<uint64>(std::ceil(q * total)), seen = 0;
+    int32 i = 0;
+    for (; i < kNumBuckets - 1; i++) {
+      seen += buckets[i];
+      if (seen >= rank) break;
+    }
+    return kMinValue * std::pow(2.0, (i + 1.0) / kBucketsPerOctave);
+  }
+};
+
+void FormatRow(const std::string &name, const HistogramSum &h, double scale,
+               std::ostringstream *out) {
+  *out << std::left << std::setw(14) << name << std::right
+       << std::setw(10) << h.count << std::fixed << std::setprecision(3)
+       << std::setw(11) << (h.count > 0 ? h.sum / h.count * scale : 0.0)
+       << std::setw(11) << h.Quantile(0.50) * scale
+       << std::setw(11) << h.Quantile(0.95) * scale
+       << std::setw(11) << h.Quantile(0.99) * scale << "\n";
+}
+
+}  // namespace
+
+void RecordLatency(LatencyStage stage, double secs) {
+  GetThreadMetrics()->stages[stage].Add(secs);
+}
+
+void RecordRealTimeFactor(double rtf) {
+  GetThreadMetrics()->rtf.Add(rtf);
+}
+
+void RecordChunkLength(double secs) {
+  GetThreadMetrics()->chunk_length.Add(secs);
+}
+
+std::string FormatLatencyMetrics() {
+  HistogramSum stages[kNumLatencyStages], rtf, chunk_length;
+  pthread_mutex_lock(&g_metrics_lock);
+  for (size_t t = 0; t < g_thread_metrics.size(); t++) {
+    for (int32 s = 0; s < kNumLatencyStages; s++)
+      stages[s].Add(g_thread_metrics[t]->stages[s]);
+    rtf.Add(g_thread_metrics[t]->rtf);
+    chunk_length.Add(g_thread_metrics[t]->chunk_length);
+  }
+  pthread_mutex_unlock(&g_metrics_lock);
+
+  std::ostringstream out;
+  out << "# stage           count    mean_ms     p50_ms     p95_ms"
+      << "     p99_ms\n";
+  for (int32 s = 0; s < kNumLatencyStages; s++)
+    FormatRow(kStageNames[s], stages[s], 1000.0, &out);
+  out << "# per utterance   count       mean        p50        p95"
+      << "        p99\n";
+  FormatRow("rtf", rtf, 1.0, &out);
+  out << "# per chunk       count    mean_ms     p50_ms     p95_ms"
+      << "     p99_ms\n";
+  FormatRow("chunk_length", chunk_length, 1000.0, &out);
+  return out.str();
+}
+
+MetricsServer::MetricsServer(): _running(false), _stop(false) { }
+
+MetricsServer::~MetricsServer() {
+  Stop();
+}
+
+bool MetricsServer::Start(int32 port) {
+  if (!_server.Listen(port, 16, true)) return false;
+  _stop = false;
+  int32 err = pthread_create(&_tid, NULL, MetricsServer::ThreadProc, this);
+  if (err != 0) {
+    KALDI_WARN << "Can't create metrics thread: " << strerror(err);
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+void MetricsServer::Stop() {
+  if (!_running) return;
+  _stop = true;
+  pthread_join(_tid, NULL);
+  _running = false;
+}
+
+void* MetricsServer::ThreadProc(void *para) {
+  MetricsServer *server = reinterpret_cast<MetricsServer*>(para);
+  while (!server->_stop) {
+    int32 client_socket = server->_server.Accept(1.0);
+    if (client_socket < 0) continue;
+    // Whatever the client sent (e.g. an HTTP request) is ignored, but it
+    // is read first, so that closing the socket does not reset it.  The
+    // reply is a valid HTTP/1.0 response.
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 200000;
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+    char request[1024];
+    if (recv(client_socket, request, sizeof(request), 0) < 0)
+      KALDI_VLOG(2) << "No metrics request received";
+    std::string body = FormatLatencyMetrics();
+    std::ostringstream reply;
+    reply << "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+          << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+    std::string text = reply.str();
+    if (write(client_socket, text.c_str(), text.size()) !=
+        static_cast<ssize_t>(text.size()))
+      KALDI_VLOG(1) << "Could not send the metrics";
+    close(client_socket);
+  }
+  return reinterpret_cast<void*>(NULL);
+}
+
+}  // namespace kaldi
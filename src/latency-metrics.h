@@ -0,0 +1,100 @@
+// latency-metrics.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_LATENCY_METRICS_H_
+#define KALDI_AUDIO_SERVER_LATENCY_METRICS_H_
+
+#include <pthread.h>
+#include <string>
+
+#include "base/kaldi-common.h"
+#include "job-queue.h"
+#include "tcp-server.h"
+
+namespace kaldi {
+
+// The stages a chunk of audio goes through, timed in wall clock seconds.
+enum LatencyStage {
+  kStageQueueWait = 0,   // waiting for a decoder thread
+  kStageSocketRead,      // recv() and parsing on the reactor thread
+  kStageFeatures,        // AcceptWaveform() of the feature pipeline
+  kStageNnet,            // acoustic model forward pass
+  kStageDecode,          // AdvanceDecoding() search
+  kStageBestPath,        // GetBestPath()
+  kStageWordAlign,       // word alignment of the final result
+  kStageResultWrite,     // writing results to the client
+  kNumLatencyStages
+};
+
+// Adds a sample to the calling thread's histogram of "stage".  Every
+// thread writes to histograms of its own, so this never takes a lock
+// (apart from the first call on a thread).
+void RecordLatency(LatencyStage stage, double secs);
+
+// Adds the real-time factor (processing time / audio duration) of one
+// utterance.
+void RecordRealTimeFactor(double rtf);
+
+// Adds the chunk length in seconds a stream was decoded with, as chosen
+// by its ChunkScheduler.
+void RecordChunkLength(double secs);
+
+// Returns count, mean and p50/p95/p99 of every stage summed over all
+// threads, of the real-time factor and of the chunk length, as plain
+// text.
+std::string FormatLatencyMetrics();
+
+// Times the enclosing scope as one sample of "stage".
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(LatencyStage stage):
+      _stage(stage), _start(MonotonicSeconds()) { }
+  ~ScopedLatency() { RecordLatency(_stage, MonotonicSeconds() - _start); }
+
+ private:
+  LatencyStage _stage;
+  double _start;
+};
+
+/*
+ * Serves FormatLatencyMetrics() on a loopback port to anything that
+ * connects, e.g. "curl localhost:<port>/" or "nc localhost <port>".
+ */
+class MetricsServer {
+ public:
+  MetricsServer();
+  ~MetricsServer();
+
+  bool Start(int32 port);
+  void Stop();
+
+ private:
+  static void* ThreadProc(void *para);
+
+  TcpServer _server;
+  pthread_t _tid;
+  bool _running;
+  volatile bool _stop;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(MetricsServer);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_LATENCY_METRICS_H_
@@ -0,0 +1,270 @@
+// nnet-batch-inference.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+
+#include "cudamatrix/cu-matrix.h"
+#include "nnet3/nnet-compute.h"
+#include "nnet3/nnet-utils.h"
+#include "nnet-batch-inference.h"
+
+namespace kaldi {
+
+NnetBatchInference::NnetBatchInference(
+    const NnetBatchInferenceConfig &config,
+    const nnet3::NnetSimpleLoopedComputationOptions &opts,
+    const nnet3::AmNnetSimple &am_nnet):
+    _config(config), _opts(opts), _am_nnet(am_nnet),
+    _compiler(am_nnet.GetNnet(), opts.optimize_config), _stop(false) {
+  KALDI_ASSERT(_config.batch_size > 0);
+  if (am_nnet.GetNnet().InputDim("ivector") > 0)
+    KALDI_ERR << "Batched nnet3 inference does not support iVectors";
+
+  nnet3::ComputeSimpleNnetContext(am_nnet.GetNnet(), &_left_context,
+                                  &_right_context);
+  _frame_subsampling_factor = _opts.frame_subsampling_factor;
+  _output_frames_per_chunk = std::max(
+      1, _opts.frames_per_chunk / _frame_subsampling_factor);
+  if (am_nnet.Priors().Dim() != 0) {
+    _log_priors = am_nnet.Priors();
+    _log_priors.ApplyLog();
+  }
+
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_task_ready, NULL);
+  pthread_cond_init(&_task_done, NULL);
+  int32 err = pthread_create(&_tid, NULL, NnetBatchInference::ThreadProc,
+                             this);
+  if (err != 0)
+    KALDI_ERR << "Can't create batch inference thread: " << strerror(err);
+  KALDI_VLOG(1) << "Batched inference with up to " << _config.batch_size
+                << " chunks of " << _output_frames_per_chunk << " frames, "
+                << "context " << _left_context << "/" << _right_context;
+}
+
+NnetBatchInference::~NnetBatchInference() {
+  pthread_mutex_lock(&_lock);
+  _stop = true;
+  pthread_cond_broadcast(&_task_ready);
+  pthread_mutex_unlock(&_lock);
+  pthread_join(_tid, NULL);
+
+  pthread_cond_destroy(&_task_done);
+  pthread_cond_destroy(&_task_ready);
+  pthread_mutex_destroy(&_lock);
+}
+
+int32 NnetBatchInference::InputFramesPerChunk() const {
+  return _left_context + (_output_frames_per_chunk - 1) *
+      _frame_subsampling_factor + _right_context + 1;
+}
+
+void NnetBatchInference::Compute(const MatrixBase<BaseFloat> &input,
+                                 Matrix<BaseFloat> *output) {
+  KALDI_ASSERT(input.NumRows() == InputFramesPerChunk());
+  Task task;
+  task.input = &input;
+  task.output = output;
+  task.done = false;
+
+  pthread_mutex_lock(&_lock);
+  _tasks.push_back(&task);
+  pthread_cond_signal(&_task_ready);
+  while (!task.done)
+    pthread_cond_wait(&_task_done, &_lock);
+  pthread_mutex_unlock(&_lock);
+}
+
+void* NnetBatchInference::ThreadProc(void *para) {
+  NnetBatchInference *inference = reinterpret_cast<NnetBatchInference*>(para);
+  const NnetBatchInferenceConfig &config = inference->_config;
+  std::vector<Task*> tasks;
+
+  pthread_mutex_lock(&inference->_lock);
+  while (true) {
+    while (inference->_tasks.empty() && !inference->_stop)
+      pthread_cond_wait(&inference->_task_ready, &inference->_lock);
+    if (inference->_stop) break;
+
+    // Give other streams a chance to join the batch.
+    if (inference->_tasks.size() < config.batch_size && config.max_wait > 0) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      int64 deadline_us = now.tv_sec * 1000000LL + now.tv_usec +
+          static_cast<int64>(config.max_wait * 1.0e6);
+      struct timespec deadline;
+      deadline.tv_sec = deadline_us / 1000000;
+      deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+      while (inference->_tasks.size() < config.batch_size &&
+             !inference->_stop) {
+        if (pthread_cond_timedwait(&inference->_task_ready, &inference->_lock,
+                                   &deadline) == ETIMEDOUT)
+          break;
+      }
+    }
+
+    tasks.clear();
+    while (!inference->_tasks.empty() && tasks.size() < config.batch_size) {
+      tasks.push_back(inference->_tasks.front());
+      inference->_tasks.pop_front();
+    }
+    pthread_mutex_unlock(&inference->_lock);
+
+    inference->RunBatch(tasks);
+
+    pthread_mutex_lock(&inference->_lock);
+    for (size_t i = 0; i < tasks.size(); i++)
+      tasks[i]->done = true;
+    pthread_cond_broadcast(&inference->_task_done);
+  }
+  pthread_mutex_unlock(&inference->_lock);
+
+  return reinterpret_cast<void*>(NULL);
+}
+
+void NnetBatchInference::RunBatch(const std::vector<Task*> &tasks) {
+  int32 num_tasks = tasks.size(),
+      input_frames = InputFramesPerChunk(),
+      output_frames = _output_frames_per_chunk,
+      input_dim = tasks[0]->input->NumCols();
+
+  // Every chunk is a separate sequence ("n" index) with times relative to
+  // its first output frame, so the computation only depends on the number
+  // of chunks and is compiled once per batch size.
+  std::vector<nnet3::Index> input_indexes, output_indexes;
+  input_indexes.reserve(num_tasks * input_frames);
+  output_indexes.reserve(num_tasks * output_frames);
+  for (int32 n = 0; n < num_tasks; n++) {
+    for (int32 i = 0; i < input_frames; i++)
+      input_indexes.push_back(nnet3::Index(n, i - _left_context));
+    for (int32 i = 0; i < output_frames; i++)
+      output_indexes.push_back(nnet3::Index(n, i * _frame_subsampling_factor));
+  }
+  nnet3::ComputationRequest request;
+  request.need_model_derivative = false;
+  request.store_component_stats = false;
+  request.inputs.push_back(nnet3::IoSpecification("input", input_indexes));
+  request.outputs.push_back(nnet3::IoSpecification("output", output_indexes));
+
+  CuMatrix<BaseFloat> input(num_tasks * input_frames, input_dim, kUndefined);
+  for (int32 n = 0; n < num_tasks; n++)
+    input.RowRange(n * input_frames, input_frames).CopyFromMat(
+        *(tasks[n]->input));
+
+  auto computation = _compiler.Compile(request);
+  nnet3::NnetComputer computer(_opts.compute_config, *computation,
+                               _am_nnet.GetNnet(), NULL);
+  computer.AcceptInput("input", &input);
+  computer.Run();
+  CuMatrix<BaseFloat> cu_output;
+  computer.GetOutputDestructive("output", &cu_output);
+
+  Matrix<BaseFloat> output(cu_output.NumRows(), cu_output.NumCols(),
+                           kUndefined);
+  cu_output.CopyToMat(&output);
+  if (_log_priors.Dim() != 0)
+    output.AddVecToRows(-1.0, _log_priors);
+  output.Scale(_opts.acoustic_scale);
+
+  for (int32 n = 0; n < num_tasks; n++) {
+    tasks[n]->output->Resize(output_frames, output.NumCols(), kUndefined);
+    tasks[n]->output->CopyFromMat(output.RowRange(n * output_frames,
+                                                  output_frames));
+  }
+}
+
+DecodableNnetBatched::DecodableNnetBatched(
+    const TransitionModel &tmodel, NnetBatchInference *inference,
+    OnlineFeatureInterface *features):
+    _tmodel(tmodel), _inference(inference), _features(features),
+    _num_frames_ready(0) { }
+
+DecodableNnetBatched::~DecodableNnetBatched() {
+  for (size_t i = 0; i < _chunks.size(); i++)
+    if (_chunks[i] != NULL) delete _chunks[i];
+}
+
+int32 DecodableNnetBatched::NumOutputFrames() const {
+  int32 num_input = _features->NumFramesReady();
+  if (num_input == 0 || !_features->IsLastFrame(num_input - 1))
+    return -1;
+  int32 subsampling = _inference->FrameSubsamplingFactor();
+  return (num_input + subsampling - 1) / subsampling;
+}
+
+void DecodableNnetBatched::ComputeReadyChunks(int32 num_frames_decoded) {
+  int32 chunk_size = _inference->OutputFramesPerChunk(),
+      subsampling = _inference->FrameSubsamplingFactor(),
+      left_context = _inference->LeftContext(),
+      right_context = _inference->RightContext(),
+      input_frames = _inference->InputFramesPerChunk();
+
+  for (size_t c = 0; c < _chunks.size(); c++) {
+    if (_chunks[c] != NULL && (c + 1) * chunk_size <= num_frames_decoded) {
+      delete _chunks[c];
+      _chunks[c] = NULL;
+    }
+  }
+
+  int32 num_input = _features->NumFramesReady();
+  if (num_input == 0) return;
+  int32 num_output = NumOutputFrames();
+
+  while (true) {
+    int32 first_output = _chunks.size() * chunk_size;
+    int32 last_input = (first_output + chunk_size - 1) * subsampling +
+        right_context;
+    if (num_output >= 0 ? first_output >= num_output
+                        : last_input >= num_input)
+      break;
+
+    if (_input.NumRows() != input_frames)
+      _input.Resize(input_frames, _features->Dim(), kUndefined);
+    // Frames outside the utterance are replaced by the first or last one.
+    for (int32 i = 0; i < input_frames; i++) {
+      int32 t = first_output * subsampling - left_context + i;
+      t = std::max(0, std::min(t, num_input - 1));
+      SubVector<BaseFloat> row(_input, i);
+      _features->GetFrame(t, &row);
+    }
+    Matrix<BaseFloat> *loglikes = new Matrix<BaseFloat>();
+    _inference->Compute(_input, loglikes);
+    _chunks.push_back(loglikes);
+  }
+
+  _num_frames_ready = _chunks.size() * chunk_size;
+  if (num_output >= 0)
+    _num_frames_ready = std::min(_num_frames_ready, num_output);
+}
+
+BaseFloat DecodableNnetBatched::LogLikelihood(int32 frame, int32 index) {
+  int32 chunk_size = _inference->OutputFramesPerChunk();
+  const Matrix<BaseFloat> *chunk = _chunks[frame / chunk_size];
+  KALDI_ASSERT(chunk != NULL);
+  return (*chunk)(frame % chunk_size, _tmodel.TransitionIdToPdf(index));
+}
+
+bool DecodableNnetBatched::IsLastFrame(int32 frame) const {
+  return (frame == NumOutputFrames() - 1);
+}
+
+}  // namespace kaldi
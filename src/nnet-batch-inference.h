@@ -0,0 +1,149 @@
+// nnet-batch-inference.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_NNET_BATCH_INFERENCE_H_
+#define KALDI_AUDIO_SERVER_NNET_BATCH_INFERENCE_H_
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "itf/decodable-itf.h"
+#include "itf/online-feature-itf.h"
+#include "hmm/transition-model.h"
+#include "nnet3/am-nnet-simple.h"
+#include "nnet3/decodable-simple-looped.h"
+#include "nnet3/nnet-optimize.h"
+
+namespace kaldi {
+
+struct NnetBatchInferenceConfig {
+  int32 batch_size;
+  BaseFloat max_wait;
+
+  NnetBatchInferenceConfig(): batch_size(1), max_wait(0.01) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("nnet-batch-size", &batch_size, "If > 1, the acoustic "
+                   "model is run on chunks of up to this many sessions at "
+                   "once as one batched computation, instead of one looped "
+                   "computation per session.  Requires a model without "
+                   "iVectors; use with more decoder threads than this.");
+    opts->Register("nnet-batch-max-wait", &max_wait, "Maximum time in "
+                   "seconds a chunk waits for a batch to fill up");
+  }
+};
+
+/*
+ * Runs the acoustic model for many streams at once.  Decoder threads hand
+ * in fixed-size feature chunks (with their left and right context) and
+ * block; a dedicated thread stacks up to --nnet-batch-size of them into one
+ * matrix, runs a single nnet3 computation over it and hands the rows of
+ * the output back.  Computations are compiled once per batch size.
+ */
+class NnetBatchInference {
+ public:
+  NnetBatchInference(const NnetBatchInferenceConfig &config,
+                     const nnet3::NnetSimpleLoopedComputationOptions &opts,
+                     const nnet3::AmNnetSimple &am_nnet);
+  ~NnetBatchInference();
+
+  // Number of input frames before the first and after the last output
+  // frame of a chunk that the model needs.
+  int32 LeftContext() const { return _left_context; }
+  int32 RightContext() const { return _right_context; }
+  // Number of (subsampled) output frames per chunk.
+  int32 OutputFramesPerChunk() const { return _output_frames_per_chunk; }
+  int32 FrameSubsamplingFactor() const { return _frame_subsampling_factor; }
+  // Number of input frames per chunk, i.e. rows of "input" in Compute().
+  int32 InputFramesPerChunk() const;
+
+  // Computes the scaled acoustic log-likelihoods (with priors removed, if
+  // the model has any) of one chunk; blocks until its batch is done.
+  void Compute(const MatrixBase<BaseFloat> &input, Matrix<BaseFloat> *output);
+
+ private:
+  struct Task {
+    const MatrixBase<BaseFloat> *input;
+    Matrix<BaseFloat> *output;
+    bool done;
+  };
+
+  static void* ThreadProc(void *para);
+  void RunBatch(const std::vector<Task*> &tasks);
+
+  NnetBatchInferenceConfig _config;
+  nnet3::NnetSimpleLoopedComputationOptions _opts;
+  const nnet3::AmNnetSimple &_am_nnet;
+  Vector<BaseFloat> _log_priors;
+  nnet3::CachingOptimizingCompiler _compiler;
+  int32 _left_context, _right_context;
+  int32 _output_frames_per_chunk, _frame_subsampling_factor;
+
+  std::deque<Task*> _tasks;
+  bool _stop;
+  pthread_mutex_t _lock;
+  pthread_cond_t _task_ready;
+  pthread_cond_t _task_done;
+  pthread_t _tid;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(NnetBatchInference);
+};
+
+/*
+ * A decodable object whose log-likelihoods come from NnetBatchInference.
+ * ComputeReadyChunks() has to be called to make newly arrived features
+ * available to the decoder.
+ */
+class DecodableNnetBatched : public DecodableInterface {
+ public:
+  DecodableNnetBatched(const TransitionModel &tmodel,
+                       NnetBatchInference *inference,
+                       OnlineFeatureInterface *features);
+  ~DecodableNnetBatched();
+
+  // Runs the nnet on every chunk whose input features are all available
+  // (or which is the last one, once the input is finished), and frees the
+  // log-likelihoods of chunks before frame "num_frames_decoded".
+  void ComputeReadyChunks(int32 num_frames_decoded);
+
+  virtual BaseFloat LogLikelihood(int32 frame, int32 index);
+  virtual bool IsLastFrame(int32 frame) const;
+  virtual int32 NumFramesReady() const { return _num_frames_ready; }
+  virtual int32 NumIndices() const { return _tmodel.NumTransitionIds(); }
+
+ private:
+  // Total number of output frames, or -1 while the input is not finished.
+  int32 NumOutputFrames() const;
+
+  const TransitionModel &_tmodel;
+  NnetBatchInference *_inference;
+  OnlineFeatureInterface *_features;
+
+  Matrix<BaseFloat> _input;  // reused for every chunk
+  std::vector<Matrix<BaseFloat>*> _chunks;  // log-likelihoods per chunk
+  int32 _num_frames_ready;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(DecodableNnetBatched);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_NNET_BATCH_INFERENCE_H_
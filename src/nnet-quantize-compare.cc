@@ -0,0 +1,274 @@
+// nnet-quantize-compare.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <time.h>
+#include <iomanip>
+#include <sstream>
+
+#include "base/kaldi-common.h"
+#include "decoder/decodable-matrix.h"
+#include "decoder/lattice-faster-decoder.h"
+#include "fstext/fstext-lib.h"
+#include "hmm/transition-model.h"
+#include "lat/kaldi-lattice.h"
+#include "nnet3/am-nnet-simple.h"
+#include "nnet3/nnet-am-decodable-simple.h"
+#include "nnet3/nnet-utils.h"
+#include "util/common-utils.h"
+#include "util/edit-distance.h"
+
+#include "graph-io.h"
+#include "nnet-quantize.h"
+
+namespace kaldi {
+
+static double MonotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+// Totals for one of the two models.
+struct ModelStats {
+  double nnet_secs, search_secs;
+  int64 ref_errors;
+
+  ModelStats(): nnet_secs(0.0), search_secs(0.0), ref_errors(0) { }
+};
+
+// Runs the nnet over "feats" and decodes the result, returning the scaled
+// log-likelihoods and the words of the best path.
+static void DecodeUtterance(
+    const nnet3::NnetSimpleComputationOptions &opts,
+    const LatticeFasterDecoderConfig &decoder_config,
+    const TransitionModel &tmodel, const nnet3::Nnet &nnet,
+    const VectorBase<BaseFloat> &priors,
+    nnet3::CachingOptimizingCompiler *compiler,
+    const fst::Fst<fst::StdArc> &fst, const MatrixBase<BaseFloat> &feats,
+    Matrix<BaseFloat> *loglikes, std::vector<int32> *words,
+    ModelStats *stats) {
+  double start = MonotonicSeconds();
+  nnet3::DecodableNnetSimple nnet_output(opts, nnet, priors, feats, compiler);
+  loglikes->Resize(nnet_output.NumFrames(), nnet_output.OutputDim(),
+                   kUndefined);
+  for (int32 t = 0; t < nnet_output.NumFrames(); t++) {
+    SubVector<BaseFloat> row(*loglikes, t);
+    nnet_output.GetOutputForFrame(t, &row);
+  }
+  double nnet_done = MonotonicSeconds();
+  stats->nnet_secs += nnet_done - start;
+
+  DecodableMatrixScaledMapped decodable(tmodel, *loglikes, 1.0);
+  LatticeFasterDecoder decoder(fst, decoder_config);
+  words->clear();
+  if (decoder.Decode(&decodable)) {
+    Lattice best_path;
+    decoder.GetBestPath(&best_path);
+    std::vector<int32> alignment;
+    LatticeWeight weight;
+    GetLinearSymbolSequence(best_path, &alignment, words, &weight);
+  }
+  stats->search_secs += MonotonicSeconds() - nnet_done;
+}
+
+static void WordsToStrings(const std::vector<int32> &words,
+                           const fst::SymbolTable *word_syms,
+                           std::vector<std::string> *strings) {
+  strings->clear();
+  for (size_t i = 0; i < words.size(); i++) {
+    std::ostringstream word;
+    if (word_syms != NULL)
+      word << word_syms->Find(words[i]);
+    else
+      word << words[i];
+    strings->push_back(word.str());
+  }
+}
+
+}  // namespace kaldi
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+    typedef kaldi::int32 int32;
+    typedef kaldi::int64 int64;
+
+    const char *usage =
+        "Decodes a test set with an nnet3 model and with its affine\n"
+        "components quantized to 8 bits (as audio-server-online2-nnet3\n"
+        "--quantize-nnet does), and compares the acoustic model speed, the\n"
+        "agreement of the outputs and the word error rates.  Models with\n"
+        "iVectors are not supported.\n"
+        "\n"
+        "Usage: nnet-quantize-compare [options] <nnet3-in> <fst-in> "
+        "<feature-rspecifier>\n"
+        "e.g.: nnet-quantize-compare --word-symbol-table=words.txt \\\n"
+        "  --ref-text=ark:data/test/text final.mdl HCLG.fst \\\n"
+        "  'ark:apply-cmvn ... ark:- |'\n";
+
+    ParseOptions po(usage);
+    nnet3::NnetSimpleComputationOptions decodable_opts;
+    LatticeFasterDecoderConfig decoder_config;
+    std::string word_syms_rxfilename, ref_rspecifier;
+    decodable_opts.Register(&po);
+    decoder_config.Register(&po);
+    po.Register("word-symbol-table", &word_syms_rxfilename,
+                "Symbol table for words; needed with --ref-text");
+    po.Register("ref-text", &ref_rspecifier, "Reference transcripts, "
+                "e.g. ark:data/test/text, to compute word error rates");
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 3) {
+      po.PrintUsage();
+      return 1;
+    }
+    if (ref_rspecifier != "" && word_syms_rxfilename == "")
+      KALDI_ERR << "--ref-text requires --word-symbol-table";
+
+    TransitionModel tmodel;
+    nnet3::AmNnetSimple am_nnet;
+    {
+      bool binary;
+      Input ki(po.GetArg(1), &binary);
+      tmodel.Read(ki.Stream(), binary);
+      am_nnet.Read(ki.Stream(), binary);
+      nnet3::SetBatchnormTestMode(true, &(am_nnet.GetNnet()));
+      nnet3::SetDropoutTestMode(true, &(am_nnet.GetNnet()));
+      nnet3::CollapseModel(nnet3::CollapseModelConfig(), &(am_nnet.GetNnet()));
+    }
+    if (am_nnet.GetNnet().InputDim("ivector") > 0)
+      KALDI_ERR << "Models with iVectors are not supported";
+    const nnet3::Nnet &float_nnet = am_nnet.GetNnet();
+    nnet3::Nnet int8_nnet(float_nnet);
+    nnet3::QuantizeNnet(&int8_nnet);
+
+    fst::Fst<fst::StdArc> *decode_fst = ReadDecodingGraph(po.GetArg(2), false);
+    fst::SymbolTable *word_syms = NULL;
+    if (word_syms_rxfilename != "" &&
+        !(word_syms = fst::SymbolTable::ReadText(word_syms_rxfilename)))
+      KALDI_ERR << "Could not read symbol table from file "
+                << word_syms_rxfilename;
+
+    nnet3::CachingOptimizingCompiler float_compiler(
+        float_nnet, decodable_opts.optimize_config);
+    nnet3::CachingOptimizingCompiler int8_compiler(
+        int8_nnet, decodable_opts.optimize_config);
+
+    SequentialBaseFloatMatrixReader feature_reader(po.GetArg(3));
+    RandomAccessTokenVectorReader ref_reader(ref_rspecifier);
+
+    ModelStats float_stats, int8_stats;
+    int64 num_frames = 0, num_argmax_agree = 0, num_ref_words = 0,
+        num_float_words = 0, num_diff_errors = 0;
+    int32 num_utts = 0, num_no_ref = 0;
+    double sum_abs_diff = 0.0, sum_abs = 0.0;
+    for (; !feature_reader.Done(); feature_reader.Next()) {
+      const std::string &utt = feature_reader.Key();
+      const Matrix<BaseFloat> &feats = feature_reader.Value();
+      if (feats.NumRows() == 0) continue;
+
+      Matrix<BaseFloat> float_loglikes, int8_loglikes;
+      std::vector<int32> float_words, int8_words;
+      DecodeUtterance(decodable_opts, decoder_config, tmodel, float_nnet,
+                      am_nnet.Priors(), &float_compiler, *decode_fst, feats,
+                      &float_loglikes, &float_words, &float_stats);
+      DecodeUtterance(decodable_opts, decoder_config, tmodel, int8_nnet,
+                      am_nnet.Priors(), &int8_compiler, *decode_fst, feats,
+                      &int8_loglikes, &int8_words, &int8_stats);
+
+      for (int32 t = 0; t < float_loglikes.NumRows(); t++) {
+        SubVector<BaseFloat> f(float_loglikes, t), q(int8_loglikes, t);
+        int32 f_max, q_max;
+        f.Max(&f_max);
+        q.Max(&q_max);
+        if (f_max == q_max) num_argmax_agree++;
+        for (int32 i = 0; i < f.Dim(); i++) {
+          sum_abs_diff += fabs(f(i) - q(i));
+          sum_abs += fabs(f(i));
+        }
+      }
+      num_frames += float_loglikes.NumRows();
+
+      // The float model's output serves as the reference for the int8 one
+      // even without transcripts.
+      num_float_words += float_words.size();
+      num_diff_errors += LevenshteinEditDistance(float_words, int8_words);
+
+      if (ref_rspecifier != "") {
+        if (!ref_reader.HasKey(utt)) {
+          KALDI_WARN << "No reference for utterance " << utt;
+          num_no_ref++;
+        } else {
+          const std::vector<std::string> &ref = ref_reader.Value(utt);
+          std::vector<std::string> float_hyp, int8_hyp;
+          WordsToStrings(float_words, word_syms, &float_hyp);
+          WordsToStrings(int8_words, word_syms, &int8_hyp);
+          num_ref_words += ref.size();
+          float_stats.ref_errors += LevenshteinEditDistance(ref, float_hyp);
+          int8_stats.ref_errors += LevenshteinEditDistance(ref, int8_hyp);
+        }
+      }
+      num_utts++;
+      KALDI_VLOG(1) << utt << ": " << float_loglikes.NumRows() << " frames, "
+                    << LevenshteinEditDistance(float_words, int8_words)
+                    << " word differences";
+    }
+    if (num_utts == 0)
+      KALDI_ERR << "No features in " << po.GetArg(3);
+
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(2)
+           << "\nDecoded " << num_utts << " utterances, " << num_frames
+           << " output frames, with the " << nnet3::QuantizedKernelName()
+           << " kernel\n"
+           << "               nnet frames/s   search frames/s";
+    if (num_ref_words > 0) report << "   WER (%)";
+    report << "\n";
+    const ModelStats *stats[2] = { &float_stats, &int8_stats };
+    const char *names[2] = { "float", "int8" };
+    for (int32 i = 0; i < 2; i++) {
+      report << std::setw(6) << names[i]
+             << std::setw(24) << num_frames / stats[i]->nnet_secs
+             << std::setw(18) << num_frames / stats[i]->search_secs;
+      if (num_ref_words > 0)
+        report << std::setw(12)
+               << 100.0 * stats[i]->ref_errors / num_ref_words;
+      report << "\n";
+    }
+    report << "nnet speedup " << float_stats.nnet_secs / int8_stats.nnet_secs
+           << "x, best pdf agrees on "
+           << 100.0 * num_argmax_agree / num_frames << "% of frames, "
+           << "relative output difference "
+           << 100.0 * sum_abs_diff / std::max(sum_abs, 1.0e-10) << "%, "
+           << "int8 vs. float word differences "
+           << 100.0 * num_diff_errors / std::max<int64>(num_float_words, 1)
+           << "%";
+    if (num_no_ref > 0)
+      report << "\n" << num_no_ref << " utterances had no reference";
+    KALDI_LOG << report.str();
+
+    delete decode_fst;
+    delete word_syms;
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
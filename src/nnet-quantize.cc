@@ -0,0 +1,285 @@
+// nnet-quantize.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define QUANTIZE_X86_KERNELS 1
+#endif
+
+#include "cudamatrix/cu-device.h"
+#include "nnet-quantize.h"
+
+namespace kaldi {
+namespace nnet3 {
+
+// Rows are padded with zeros to a multiple of this many bytes, the width
+// of one AVX2 register.
+static const int32 kRowAlign = 32;
+
+// Computes out[r * num_out + o] = sum_k x[r][k] * w[o][k] for int8 rows of
+// "dim" bytes; "w_sums" holds the sum of every row of "w".
+typedef void (*Int8GemmFn)(const int8_t *x, int32 num_rows,
+                           const int8_t *w, const int32 *w_sums,
+                           int32 num_out, int32 dim, int32 *out);
+
+static void Int8GemmGeneric(const int8_t *x, int32 num_rows,
+                            const int8_t *w, const int32 *w_sums,
+                            int32 num_out, int32 dim, int32 *out) {
+  for (int32 o = 0; o < num_out; o++) {
+    const int8_t *w_row = w + o * dim;
+    for (int32 r = 0; r < num_rows; r++) {
+      const int8_t *x_row = x + r * dim;
+      int32 sum = 0;
+      for (int32 k = 0; k < dim; k++)
+        sum += x_row[k] * w_row[k];
+      out[r * num_out + o] = sum;
+    }
+  }
+}
+
+#ifdef QUANTIZE_X86_KERNELS
+__attribute__((target("avx2")))
+static inline int32 HorizontalSum(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                            _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+// Sign extends 16 bytes at a time to int16 and multiplies pairwise into
+// int32 with vpmaddwd, which cannot overflow.
+__attribute__((target("avx2")))
+static void Int8GemmAvx2(const int8_t *x, int32 num_rows,
+                         const int8_t *w, const int32 *w_sums,
+                         int32 num_out, int32 dim, int32 *out) {
+  for (int32 o = 0; o < num_out; o++) {
+    const int8_t *w_row = w + o * dim;
+    for (int32 r = 0; r < num_rows; r++) {
+      const int8_t *x_row = x + r * dim;
+      __m256i acc = _mm256_setzero_si256();
+      for (int32 k = 0; k < dim; k += 16) {
+        __m256i xv = _mm256_cvtepi8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(x_row + k)));
+        __m256i wv = _mm256_cvtepi8_epi16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(w_row + k)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xv, wv));
+      }
+      out[r * num_out + o] = HorizontalSum(acc);
+    }
+  }
+}
+
+// vpdpbusd multiplies unsigned by signed bytes, so the inputs are shifted
+// by 128 and 128 times the weight row sum is taken off again.
+#define QUANTIZE_VNNI_GEMM(name, target_isa, dpbusd)                       \
+  __attribute__((target(target_isa)))                                      \
+  static void name(const int8_t *x, int32 num_rows,                        \
+                   const int8_t *w, const int32 *w_sums,                   \
+                   int32 num_out, int32 dim, int32 *out) {                 \
+    const __m256i flip = _mm256_set1_epi8(static_cast<char>(0x80));        \
+    for (int32 o = 0; o < num_out; o++) {                                  \
+      const int8_t *w_row = w + o * dim;                                   \
+      for (int32 r = 0; r < num_rows; r++) {                               \
+        const int8_t *x_row = x + r * dim;                                 \
+        __m256i acc = _mm256_setzero_si256();                              \
+        for (int32 k = 0; k < dim; k += 32) {                              \
+          __m256i xv = _mm256_loadu_si256(                                 \
+              reinterpret_cast<const __m256i*>(x_row + k));                \
+          __m256i wv = _mm256_loadu_si256(                                 \
+              reinterpret_cast<const __m256i*>(w_row + k));                \
+          acc = dpbusd(acc, _mm256_xor_si256(xv, flip), wv);               \
+        }                                                                  \
+        out[r * num_out + o] = HorizontalSum(acc) - 128 * w_sums[o];       \
+      }                                                                    \
+    }                                                                      \
+  }
+
+#if __GNUC__ >= 8
+#define QUANTIZE_AVX512_VNNI 1
+QUANTIZE_VNNI_GEMM(Int8GemmAvx512Vnni, "avx2,avx512vl,avx512vnni",
+                   _mm256_dpbusd_epi32)
+#endif
+#if __GNUC__ >= 11
+#define QUANTIZE_AVX_VNNI 1
+QUANTIZE_VNNI_GEMM(Int8GemmAvxVnni, "avx2,avxvnni", _mm256_dpbusd_avx_epi32)
+#endif
+#endif  // QUANTIZE_X86_KERNELS
+
+static Int8GemmFn SelectKernel(const char **name) {
+#ifdef QUANTIZE_X86_KERNELS
+  __builtin_cpu_init();
+#ifdef QUANTIZE_AVX512_VNNI
+  if (__builtin_cpu_supports("avx512vnni") &&
+      __builtin_cpu_supports("avx512vl")) {
+    *name = "avx512-vnni";
+    return Int8GemmAvx512Vnni;
+  }
+#endif
+#ifdef QUANTIZE_AVX_VNNI
+  if (__builtin_cpu_supports("avxvnni")) {
+    *name = "avx-vnni";
+    return Int8GemmAvxVnni;
+  }
+#endif
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return Int8GemmAvx2;
+  }
+#endif
+  *name = "generic";
+  return Int8GemmGeneric;
+}
+
+static const char *kernel_name = NULL;
+static Int8GemmFn kernel = SelectKernel(&kernel_name);
+
+const char *QuantizedKernelName() {
+  return kernel_name;
+}
+
+// Symmetric quantization of "n" values into [-127, 127]; returns the scale
+// to multiply the integers with.
+static BaseFloat QuantizeRow(const BaseFloat *data, int32 n, int8_t *out) {
+  BaseFloat max_abs = 0.0;
+  for (int32 k = 0; k < n; k++)
+    max_abs = std::max(max_abs, static_cast<BaseFloat>(fabs(data[k])));
+  if (max_abs == 0.0) {
+    memset(out, 0, n);
+    return 0.0;
+  }
+  BaseFloat inv_scale = 127.0 / max_abs;
+  for (int32 k = 0; k < n; k++)
+    out[k] = static_cast<int8_t>(lrintf(data[k] * inv_scale));
+  return max_abs / 127.0;
+}
+
+QuantizedAffineComponent::QuantizedAffineComponent(
+    const AffineComponent &other): AffineComponent(other) {
+  Matrix<BaseFloat> linear(LinearParams());
+  _output_dim = linear.NumRows();
+  _input_dim = linear.NumCols();
+  _padded_dim = (_input_dim + kRowAlign - 1) / kRowAlign * kRowAlign;
+  _weights.assign(_output_dim * _padded_dim, 0);
+  _scales.resize(_output_dim);
+  _row_sums.resize(_output_dim);
+  for (int32 o = 0; o < _output_dim; o++) {
+    int8_t *row = &(_weights[o * _padded_dim]);
+    _scales[o] = QuantizeRow(linear.RowData(o), _input_dim, row);
+    int32 sum = 0;
+    for (int32 k = 0; k < _input_dim; k++)
+      sum += row[k];
+    _row_sums[o] = sum;
+  }
+  _bias.Resize(BiasParams().Dim(), kUndefined);
+  BiasParams().CopyToVec(&_bias);
+}
+
+Component *QuantizedAffineComponent::Copy() const {
+  return new QuantizedAffineComponent(*this);
+}
+
+void *QuantizedAffineComponent::Propagate(
+    const ComponentPrecomputedIndexes *indexes,
+    const CuMatrixBase<BaseFloat> &in,
+    CuMatrixBase<BaseFloat> *out) const {
+#if HAVE_CUDA == 1
+  if (CuDevice::Instantiate().Enabled())
+    return AffineComponent::Propagate(indexes, in, out);
+#endif
+  const MatrixBase<BaseFloat> &in_mat = in.Mat();
+  MatrixBase<BaseFloat> &out_mat = out->Mat();
+  int32 num_rows = in_mat.NumRows();
+  KALDI_ASSERT(in_mat.NumCols() == _input_dim &&
+               out_mat.NumCols() == _output_dim &&
+               out_mat.NumRows() == num_rows);
+
+  // Scratch space; Propagate() runs on many threads at once.
+  std::vector<int8_t> x(num_rows * _padded_dim, 0);
+  std::vector<BaseFloat> x_scales(num_rows);
+  std::vector<int32> products(num_rows * _output_dim);
+  for (int32 r = 0; r < num_rows; r++)
+    x_scales[r] = QuantizeRow(in_mat.RowData(r), _input_dim,
+                              &(x[r * _padded_dim]));
+
+  kernel(&(x[0]), num_rows, &(_weights[0]), &(_row_sums[0]), _output_dim,
+         _padded_dim, &(products[0]));
+
+  const BaseFloat *bias = _bias.Data();
+  for (int32 r = 0; r < num_rows; r++) {
+    const int32 *row_products = &(products[r * _output_dim]);
+    BaseFloat *out_row = out_mat.RowData(r);
+    BaseFloat x_scale = x_scales[r];
+    for (int32 o = 0; o < _output_dim; o++)
+      out_row[o] = row_products[o] * (x_scale * _scales[o]) + bias[o];
+  }
+  return NULL;
+}
+
+int32 QuantizeNnet(Nnet *nnet) {
+  int32 num_quantized = 0;
+  // Parameters of the components that are and are not quantized, the
+  // latter by component type, so that models whose weights are mostly in
+  // other components (e.g. TdnnComponent or LinearComponent of TDNN-F
+  // models, from Kaldi versions this code does not know) stand out.
+  int64 quantized_params = 0, total_params = 0;
+  std::map<std::string, int64> other_params;
+  for (int32 c = 0; c < nnet->NumComponents(); c++) {
+    Component *component = nnet->GetComponent(c);
+    UpdatableComponent *updatable =
+        dynamic_cast<UpdatableComponent*>(component);
+    if (updatable == NULL) continue;
+    int64 num_params = updatable->NumParameters();
+    total_params += num_params;
+    AffineComponent *affine = dynamic_cast<AffineComponent*>(component);
+    if (affine == NULL) {
+      other_params[component->Type()] += num_params;
+      continue;
+    }
+    quantized_params += num_params;
+    if (dynamic_cast<QuantizedAffineComponent*>(component) != NULL)
+      continue;
+    nnet->SetComponent(c, new QuantizedAffineComponent(*affine));
+    num_quantized++;
+  }
+  KALDI_LOG << "Quantized " << num_quantized << " affine components to 8 "
+            << "bits, using the " << QuantizedKernelName() << " kernel; "
+            << "they hold " << quantized_params << " of the "
+            << total_params << " parameters";
+  if (quantized_params < total_params / 2) {
+    std::ostringstream types;
+    for (std::map<std::string, int64>::const_iterator it =
+             other_params.begin(); it != other_params.end(); ++it)
+      types << " " << it->first << " (" << it->second << ")";
+    KALDI_WARN << "Most parameters are in components that stay in floating "
+               << "point, --quantize-nnet will not speed this model up "
+               << "much:" << types.str();
+  }
+  return num_quantized;
+}
+
+}  // namespace nnet3
+}  // namespace kaldi
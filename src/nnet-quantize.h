@@ -0,0 +1,74 @@
+// nnet-quantize.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_NNET_QUANTIZE_H_
+#define KALDI_AUDIO_SERVER_NNET_QUANTIZE_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "nnet3/nnet-nnet.h"
+#include "nnet3/nnet-simple-component.h"
+
+namespace kaldi {
+namespace nnet3 {
+
+/*
+ * An AffineComponent whose forward pass runs in 8 bit integers, for CPU
+ * only servers.  The weights are quantized once, symmetrically with one
+ * scale per output row; every input row is quantized on the fly with a
+ * scale of its own.  The int32 products are scaled back to floats and the
+ * (float) bias is added.
+ *
+ * The integer kernel is picked at run time: AVX512-VNNI or AVX-VNNI
+ * (vpdpbusd), AVX2 (vpmaddwd on sign extended bytes) or plain C++.  When
+ * a GPU is in use, or for anything but the forward pass, the float
+ * parameters kept by the base class are used.
+ */
+class QuantizedAffineComponent : public AffineComponent {
+ public:
+  explicit QuantizedAffineComponent(const AffineComponent &other);
+
+  virtual Component *Copy() const;
+  virtual void *Propagate(const ComponentPrecomputedIndexes *indexes,
+                          const CuMatrixBase<BaseFloat> &in,
+                          CuMatrixBase<BaseFloat> *out) const;
+
+ private:
+  int32 _input_dim, _padded_dim, _output_dim;
+  std::vector<int8_t> _weights;    // _output_dim rows of _padded_dim
+  std::vector<BaseFloat> _scales;  // per row of _weights
+  std::vector<int32> _row_sums;    // per row of _weights
+  Vector<BaseFloat> _bias;
+};
+
+// Replaces every AffineComponent of "nnet" (natural gradient ones
+// included) by a QuantizedAffineComponent; returns how many there were.
+// Logs how many of the parameters of the model that covers, and warns if
+// most of them are in other components, which stay in floating point.
+int32 QuantizeNnet(Nnet *nnet);
+
+// Name of the integer kernel used on this machine.
+const char *QuantizedKernelName();
+
+}  // namespace nnet3
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_NNET_QUANTIZE_H_
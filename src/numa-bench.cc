@@ -0,0 +1,266 @@
+// numa-bench.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <time.h>
+#include <iomanip>
+#include <sstream>
+
+#include "base/kaldi-common.h"
+#include "decoder/lattice-faster-decoder.h"
+#include "fstext/fstext-lib.h"
+#include "hmm/transition-model.h"
+#include "nnet3/am-nnet-simple.h"
+#include "nnet3/nnet-am-decodable-simple.h"
+#include "nnet3/nnet-utils.h"
+#include "util/common-utils.h"
+
+#include "cpu-affinity.h"
+#include "graph-io.h"
+
+namespace kaldi {
+
+static double MonotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+// The copy of the acoustic model and the graph placed on one node.
+struct NodeCopy {
+  nnet3::AmNnetSimple *am_nnet;
+  fst::Fst<fst::StdArc> *fst;
+};
+
+// What one decoder thread does and what it measured.
+struct BenchThread {
+  const nnet3::NnetSimpleComputationOptions *opts;
+  const LatticeFasterDecoderConfig *decoder_config;
+  const TransitionModel *tmodel;
+  const NodeCopy *copy;
+  const std::vector<Matrix<BaseFloat> > *feats;
+  int32 node;  // index of the node it runs on
+  std::vector<int32> cpus;
+  pthread_t tid;
+  int64 num_frames;
+  double seconds;
+};
+
+// Decodes all utterances, like a server thread would, with the model and
+// graph of "copy".
+static void *RunBenchThread(void *para) {
+  BenchThread *thread = reinterpret_cast<BenchThread*>(para);
+  // The features are copied so that they are local to the thread.
+  std::vector<Matrix<BaseFloat> > feats(*thread->feats);
+  const nnet3::AmNnetSimple &am_nnet = *thread->copy->am_nnet;
+  nnet3::CachingOptimizingCompiler compiler(am_nnet.GetNnet(),
+                                            thread->opts->optimize_config);
+  thread->num_frames = 0;
+  double start = MonotonicSeconds();
+  for (size_t i = 0; i < feats.size(); i++) {
+    nnet3::DecodableAmNnetSimple decodable(
+        *thread->opts, *thread->tmodel, am_nnet, feats[i], NULL, NULL, 1,
+        &compiler);
+    LatticeFasterDecoder decoder(*thread->copy->fst,
+                                 *thread->decoder_config);
+    decoder.Decode(&decodable);
+    thread->num_frames += decodable.NumFramesReady();
+  }
+  thread->seconds = MonotonicSeconds() - start;
+  return reinterpret_cast<void*>(NULL);
+}
+
+// Runs all "threads" at the same time and waits for them.
+static void RunBenchThreads(std::vector<BenchThread> *threads) {
+  for (size_t t = 0; t < threads->size(); t++) {
+    BenchThread &thread = (*threads)[t];
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    SetThreadAttrCpus(thread.cpus, &attr);
+    int32 err = pthread_create(&thread.tid, &attr, RunBenchThread, &thread);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+      KALDI_ERR << "Can't create thread " << t << ": " << strerror(err);
+  }
+  for (size_t t = 0; t < threads->size(); t++)
+    pthread_join((*threads)[t].tid, NULL);
+}
+
+// Frames per second summed over the threads on "node".
+static double NodeThroughput(const std::vector<BenchThread> &threads,
+                             int32 node) {
+  double frames_per_sec = 0.0;
+  for (size_t t = 0; t < threads.size(); t++)
+    if (threads[t].node == node)
+      frames_per_sec += threads[t].num_frames / threads[t].seconds;
+  return frames_per_sec;
+}
+
+}  // namespace kaldi
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+    typedef kaldi::int32 int32;
+
+    const char *usage =
+        "Measures how decoding throughput depends on the NUMA node the\n"
+        "acoustic model and graph are on, as audio-server-online2-nnet3\n"
+        "--numa-replicate arranges them.  Every node gets a copy of both;\n"
+        "threads on every node then decode the utterances with the copy of\n"
+        "every node in turn, and finally all nodes decode at once, first\n"
+        "with their own copies and then all with the first node's one.\n"
+        "Models with iVectors are not supported.\n"
+        "\n"
+        "Usage: numa-bench [options] <nnet3-in> <fst-in> "
+        "<feature-rspecifier>\n"
+        "e.g.: numa-bench --threads-per-node=8 final.mdl HCLG.fst \\\n"
+        "  'ark:apply-cmvn ... ark:- |'\n";
+
+    ParseOptions po(usage);
+    nnet3::NnetSimpleComputationOptions decodable_opts;
+    LatticeFasterDecoderConfig decoder_config;
+    int32 threads_per_node = 4, max_utts = 50;
+    bool one_cpu = false;
+    decodable_opts.Register(&po);
+    decoder_config.Register(&po);
+    po.Register("threads-per-node", &threads_per_node,
+                "Decoder threads run on every node");
+    po.Register("pin-to-cpu", &one_cpu, "If true, every thread runs on a "
+                "CPU of its own instead of on any CPU of its node");
+    po.Register("max-utts", &max_utts, "Number of utterances every thread "
+                "decodes");
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 3 || threads_per_node <= 0 || max_utts <= 0) {
+      po.PrintUsage();
+      return 1;
+    }
+
+    CpuTopology topology;
+    int32 num_nodes = topology.NumNodes();
+    if (num_nodes == 1)
+      KALDI_WARN << "Only one NUMA node, there is nothing to compare";
+
+    // Pages go to the node of the CPU that touches them first, so every
+    // copy is made from a CPU of its node, the way the server does it.
+    TransitionModel tmodel;
+    std::vector<NodeCopy> copies(num_nodes);
+    for (int32 n = 0; n < num_nodes; n++) {
+      ScopedThreadAffinity affinity(topology.NodeCpus(n));
+      NodeCopy &copy = copies[n];
+      if (n > 0) {
+        copy.am_nnet = new nnet3::AmNnetSimple(*copies[0].am_nnet);
+        copy.fst = new fst::ConstFst<fst::StdArc>(*copies[0].fst);
+        continue;
+      }
+      copy.am_nnet = new nnet3::AmNnetSimple;
+      bool binary;
+      Input ki(po.GetArg(1), &binary);
+      tmodel.Read(ki.Stream(), binary);
+      copy.am_nnet->Read(ki.Stream(), binary);
+      nnet3::SetBatchnormTestMode(true, &(copy.am_nnet->GetNnet()));
+      nnet3::SetDropoutTestMode(true, &(copy.am_nnet->GetNnet()));
+      nnet3::CollapseModel(nnet3::CollapseModelConfig(),
+                           &(copy.am_nnet->GetNnet()));
+      if (copy.am_nnet->GetNnet().InputDim("ivector") > 0)
+        KALDI_ERR << "Models with iVectors are not supported";
+      copy.fst = ReadDecodingGraph(po.GetArg(2), false);
+    }
+
+    std::vector<Matrix<BaseFloat> > feats;
+    SequentialBaseFloatMatrixReader feature_reader(po.GetArg(3));
+    for (; !feature_reader.Done() && feats.size() < max_utts;
+         feature_reader.Next())
+      if (feature_reader.Value().NumRows() > 0)
+        feats.push_back(feature_reader.Value());
+    if (feats.empty())
+      KALDI_ERR << "No features in " << po.GetArg(3);
+
+    BenchThread prototype;
+    prototype.opts = &decodable_opts;
+    prototype.decoder_config = &decoder_config;
+    prototype.tmodel = &tmodel;
+    prototype.feats = &feats;
+    prototype.num_frames = 0;
+    prototype.seconds = 0.0;
+
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(1)
+           << "\nFrames per second of " << threads_per_node
+           << " thread(s) on one node, " << feats.size()
+           << " utterances each\nthreads on   copy on node";
+    for (int32 m = 0; m < num_nodes; m++)
+      report << std::setw(10) << topology.NodeId(m);
+    report << "\n";
+    for (int32 n = 0; n < num_nodes; n++) {
+      report << "node " << std::setw(6) << topology.NodeId(n)
+             << std::string(13, ' ');
+      for (int32 m = 0; m < num_nodes; m++) {
+        std::vector<BenchThread> threads;
+        for (int32 t = 0; t < threads_per_node; t++) {
+          threads.push_back(prototype);
+          threads.back().copy = &copies[m];
+          threads.back().node = n;
+          // thread t * num_nodes + n of a server is the t-th one on n
+          topology.ThreadCpus(t * num_nodes + n, one_cpu,
+                              &(threads.back().cpus));
+        }
+        RunBenchThreads(&threads);
+        report << std::setw(10) << NodeThroughput(threads, n);
+      }
+      report << "\n";
+    }
+
+    report << "All nodes at once, " << threads_per_node
+           << " thread(s) each\n           ";
+    for (int32 n = 0; n < num_nodes; n++)
+      report << std::setw(10) << topology.NodeId(n);
+    report << "     total\n";
+    const char *names[2] = { "own copy  ", "first copy" };
+    for (int32 shared = 0; shared < 2; shared++) {
+      std::vector<BenchThread> threads;
+      for (int32 i = 0; i < threads_per_node * num_nodes; i++) {
+        threads.push_back(prototype);
+        threads.back().node = topology.ThreadNode(i);
+        threads.back().copy = &copies[shared ? 0 : threads.back().node];
+        topology.ThreadCpus(i, one_cpu, &(threads.back().cpus));
+      }
+      RunBenchThreads(&threads);
+      double total = 0.0;
+      report << names[shared] << " ";
+      for (int32 n = 0; n < num_nodes; n++) {
+        double node_total = NodeThroughput(threads, n);
+        report << std::setw(10) << node_total;
+        total += node_total;
+      }
+      report << std::setw(10) << total << "\n";
+    }
+    KALDI_LOG << report.str();
+
+    for (int32 n = 0; n < num_nodes; n++) {
+      delete copies[n].am_nnet;
+      delete copies[n].fst;
+    }
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -0,0 +1,70 @@
+// partial-result.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include "partial-result.h"
+
+namespace kaldi {
+
+void IncrementalTraceback::Reset() {
+  _path.clear();
+  _index.clear();
+  _words.clear();
+}
+
+int32 IncrementalTraceback::Update(
+    const LatticeFasterOnlineDecoder &decoder) {
+  // Trace back until the path joins the previous one, keeping the new
+  // tokens and the word (or 0) on the arc into each of them.
+  std::vector<Step> suffix;
+  std::vector<int32> suffix_words;
+  int32 join = -1;
+  LatticeFasterOnlineDecoder::BestPathIterator iter =
+      decoder.BestPathEnd(false);
+  while (!iter.Done()) {
+    std::unordered_map<void*, int32>::const_iterator found =
+        _index.find(iter.tok);
+    if (found != _index.end() && _path[found->second].frame == iter.frame) {
+      join = found->second;
+      break;
+    }
+    Step step;
+    step.tok = iter.tok;
+    step.frame = iter.frame;
+    suffix.push_back(step);
+    LatticeArc arc;
+    iter = decoder.TraceBackBestPath(iter, &arc);
+    suffix_words.push_back(arc.olabel);
+  }
+
+  int32 num_kept = (join >= 0 ? _path[join].num_words : 0);
+  for (size_t i = join + 1; i < _path.size(); i++)
+    _index.erase(_path[i].tok);
+  _path.resize(join + 1);
+  _words.resize(num_kept);
+
+  for (int32 i = suffix.size() - 1; i >= 0; i--) {
+    if (suffix_words[i] != 0) _words.push_back(suffix_words[i]);
+    suffix[i].num_words = _words.size();
+    _index[suffix[i].tok] = _path.size();
+    _path.push_back(suffix[i]);
+  }
+  return num_kept;
+}
+
+}  // namespace kaldi
@@ -0,0 +1,94 @@
+// partial-result.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_PARTIAL_RESULT_H_
+#define KALDI_AUDIO_SERVER_PARTIAL_RESULT_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+#include "decoder/lattice-faster-online-decoder.h"
+
+namespace kaldi {
+
+// Controls how often partial results are sent and in what form.
+struct PartialResultConfig {
+  BaseFloat interval;
+  int32 min_change;
+  bool suffix_only;
+
+  PartialResultConfig(): interval(0.3), min_change(0), suffix_only(false) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("partial-interval", &interval, "Seconds of audio between "
+                   "partial results");
+    opts->Register("partial-min-change", &min_change, "Only send a partial "
+                   "result if at least this many words were removed from or "
+                   "added to the one sent before");
+    opts->Register("partial-suffix-only", &suffix_only, "If true, partial "
+                   "results are sent as \"PARTIAL-SUFFIX:<n>:<words>\", i.e. "
+                   "the first <n> words of the previous partial result "
+                   "followed by <words>, instead of \"PARTIAL:<all words>\"");
+  }
+};
+
+/*
+ * Keeps the best path of an utterance being decoded.  Update() traces back
+ * from the current best token only until it reaches a token of the path
+ * found by the previous call; everything before that point is unchanged,
+ * so the cost depends on how much of the hypothesis changed rather than
+ * on the length of the utterance.
+ *
+ * Tokens are compared by address together with their frame: tokens of a
+ * frame are only created while the decoder processes that frame, so an
+ * address that shows up again at the same frame is the same token.
+ */
+class IncrementalTraceback {
+ public:
+  IncrementalTraceback() { }
+
+  // Forgets the path, e.g. for a new utterance.
+  void Reset();
+
+  // Brings the best path (without final-probs) up to date with "decoder"
+  // and returns the number of leading words that did not change.
+  int32 Update(const LatticeFasterOnlineDecoder &decoder);
+
+  // Words of the best path as of the last Update().
+  const std::vector<int32> &Words() const { return _words; }
+
+ private:
+  struct Step {
+    void *tok;
+    int32 frame;
+    int32 num_words;  // number of words up to and including this token
+  };
+
+  std::vector<Step> _path;  // in time order
+  std::unordered_map<void*, int32> _index;  // token -> position in _path
+  std::vector<int32> _words;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(IncrementalTraceback);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_PARTIAL_RESULT_H_
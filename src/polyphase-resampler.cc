@@ -0,0 +1,188 @@
+// polyphase-resampler.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <utility>
+
+#include "polyphase-resampler.h"
+
+namespace kaldi {
+
+// Bytes processed by one SIMD operation; 32 covers AVX and is split in two
+// on SSE and NEON.
+static const int32 kSimdBytes = 32;
+static const int32 kSimdLanes = kSimdBytes / sizeof(BaseFloat);
+
+// Filter design: zero crossings of the sinc on either side, and the
+// cutoff as a fraction of the lower Nyquist frequency (same as Kaldi's
+// LinearResample is usually run with).
+static const int32 kNumZeros = 8;
+static const double kCutoffFraction = 0.95;
+static const int32 kMaxPhases = 1024;
+
+static pthread_mutex_t bank_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::pair<int32, int32>,
+                PolyphaseResampler::FilterBank*> banks;
+
+static int32 Gcd(int32 a, int32 b) {
+  while (b != 0) {
+    int32 t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static PolyphaseResampler::FilterBank *CreateFilterBank(int32 up,
+                                                        int32 down) {
+  PolyphaseResampler::FilterBank *bank = new PolyphaseResampler::FilterBank;
+  bank->up = up;
+  bank->down = down;
+  // cutoff in cycles per input sample
+  double cutoff = 0.5 * kCutoffFraction * std::min(1.0, up /
+                                                   static_cast<double>(down));
+  bank->half = static_cast<int32>(ceil(kNumZeros / (2.0 * cutoff)));
+  bank->num_taps = (2 * bank->half + kSimdLanes - 1) / kSimdLanes *
+      kSimdLanes;
+  bank->taps.resize(up * bank->num_taps, 0.0);
+
+  for (int32 p = 0; p < up; p++) {
+    BaseFloat *taps = &(bank->taps[p * bank->num_taps]);
+    double sum = 0.0;
+    for (int32 k = 0; k < 2 * bank->half; k++) {
+      // distance of the input sample from the output position
+      double t = k - bank->half + 1 - p / static_cast<double>(up);
+      double x = 2.0 * M_PI * cutoff * t;
+      double sinc = (x == 0.0 ? 1.0 : sin(x) / x);
+      double window = (fabs(t) < bank->half ?
+                       0.5 * (1.0 + cos(M_PI * t / bank->half)) : 0.0);
+      taps[k] = 2.0 * cutoff * sinc * window;
+      sum += taps[k];
+    }
+    // exact unity gain at DC for every phase
+    for (int32 k = 0; k < 2 * bank->half; k++)
+      taps[k] /= sum;
+  }
+  KALDI_VLOG(1) << "Built resampling filters for " << down << " -> " << up
+                << ": " << up << " phases of " << bank->num_taps << " taps";
+  return bank;
+}
+
+#if defined(__GNUC__)
+typedef BaseFloat SimdVector __attribute__((vector_size(kSimdBytes)));
+
+// "n" is a multiple of kSimdLanes; loads are unaligned.
+static inline BaseFloat Dot(const BaseFloat *a, const BaseFloat *b,
+                            int32 n) {
+  SimdVector sum;
+  memset(&sum, 0, sizeof(sum));
+  for (int32 i = 0; i < n; i += kSimdLanes) {
+    SimdVector x, y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    sum += x * y;
+  }
+  BaseFloat ans = 0.0;
+  for (int32 l = 0; l < kSimdLanes; l++)
+    ans += sum[l];
+  return ans;
+}
+#else
+static inline BaseFloat Dot(const BaseFloat *a, const BaseFloat *b,
+                            int32 n) {
+  BaseFloat ans = 0.0;
+  for (int32 i = 0; i < n; i++)
+    ans += a[i] * b[i];
+  return ans;
+}
+#endif
+
+bool PolyphaseResampler::Supported(int32 input_rate, int32 output_rate) {
+  if (input_rate < 1000 || input_rate > 192000 ||
+      output_rate < 1000 || output_rate > 192000)
+    return false;
+  return output_rate / Gcd(input_rate, output_rate) <= kMaxPhases;
+}
+
+PolyphaseResampler::PolyphaseResampler(int32 input_rate, int32 output_rate):
+    _input_rate(input_rate), _output_rate(output_rate) {
+  KALDI_ASSERT(Supported(input_rate, output_rate));
+  int32 gcd = Gcd(input_rate, output_rate);
+  std::pair<int32, int32> key(output_rate / gcd, input_rate / gcd);
+
+  pthread_mutex_lock(&bank_lock);
+  FilterBank *&bank = banks[key];
+  if (bank == NULL) bank = CreateFilterBank(key.first, key.second);
+  _bank = bank;
+  pthread_mutex_unlock(&bank_lock);
+
+  Reset();
+}
+
+void PolyphaseResampler::Reset() {
+  // the input before the stream is taken as silence
+  _buffer.assign(_bank->half, 0.0);
+  _buffer_start = -_bank->half;
+  _num_input = 0;
+  _num_output = 0;
+}
+
+void PolyphaseResampler::Resample(const BaseFloat *input, int32 num_samples,
+                                  std::vector<BaseFloat> *output) {
+  _buffer.insert(_buffer.end(), input, input + num_samples);
+  _num_input += num_samples;
+  Produce(std::numeric_limits<int64>::max(), output);
+}
+
+void PolyphaseResampler::Flush(std::vector<BaseFloat> *output) {
+  // and so is the input after it
+  _buffer.resize(_buffer.size() + _bank->num_taps, 0.0);
+  int64 total = (_num_input * _bank->up + _bank->down - 1) / _bank->down;
+  Produce(total, output);
+}
+
+void PolyphaseResampler::Produce(int64 max_output,
+                                 std::vector<BaseFloat> *output) {
+  const FilterBank &bank = *_bank;
+  int64 buffer_end = _buffer_start + _buffer.size();
+  while (_num_output < max_output) {
+    int64 pos = _num_output * bank.down;
+    int64 first = pos / bank.up - bank.half + 1;
+    if (first + bank.num_taps > buffer_end) break;
+    int32 phase = pos % bank.up;
+    output->push_back(Dot(&_buffer[first - _buffer_start],
+                          &bank.taps[phase * bank.num_taps], bank.num_taps));
+    _num_output++;
+  }
+
+  int64 first = (_num_output * bank.down) / bank.up - bank.half + 1;
+  int64 used = std::min(first - _buffer_start,
+                        static_cast<int64>(_buffer.size()));
+  if (used > 0) {
+    _buffer.erase(_buffer.begin(), _buffer.begin() + used);
+    _buffer_start += used;
+  }
+}
+
+}  // namespace kaldi
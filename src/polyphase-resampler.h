@@ -0,0 +1,84 @@
+// polyphase-resampler.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_POLYPHASE_RESAMPLER_H_
+#define KALDI_AUDIO_SERVER_POLYPHASE_RESAMPLER_H_
+
+#include <vector>
+
+#include "base/kaldi-common.h"
+
+namespace kaldi {
+
+/*
+ * Streaming resampler between two integer sample rates.  With the rates
+ * reduced to "up" / "down", output sample n lies at input position
+ * n * down / up; its phase (n * down) % up selects one of "up" precomputed
+ * windowed-sinc filters, which is applied to the input around that
+ * position.  Filters are padded to a multiple of the SIMD width and the
+ * dot products use GCC vector extensions, so the compiler emits SSE, AVX
+ * or NEON code as the target allows.
+ *
+ * Filter banks depend only on the pair of rates and are built once per
+ * process and shared by all resamplers.
+ */
+class PolyphaseResampler {
+ public:
+  PolyphaseResampler(int32 input_rate, int32 output_rate);
+
+  // True if resampling between the rates is supported, i.e. they are in a
+  // sane range and the filter bank is not unreasonably large.
+  static bool Supported(int32 input_rate, int32 output_rate);
+
+  int32 InputRate() const { return _input_rate; }
+  int32 OutputRate() const { return _output_rate; }
+
+  // Starts a new stream.
+  void Reset();
+  // Appends the output samples that depend only on the input so far.
+  void Resample(const BaseFloat *input, int32 num_samples,
+                std::vector<BaseFloat> *output);
+  // Ends the stream, appending the remaining output samples.
+  void Flush(std::vector<BaseFloat> *output);
+
+  struct FilterBank {
+    int32 up, down;
+    int32 num_taps;   // per phase, a multiple of the SIMD width
+    int32 half;       // output sample n uses input from i - half + 1 on,
+                      // where i = floor(n * down / up)
+    std::vector<BaseFloat> taps;  // "up" phases of "num_taps" each
+  };
+
+ private:
+  void Produce(int64 max_output, std::vector<BaseFloat> *output);
+
+  int32 _input_rate, _output_rate;
+  const FilterBank *_bank;
+
+  std::vector<BaseFloat> _buffer;  // input not fully used yet
+  int64 _buffer_start;             // input index of _buffer[0]
+  int64 _num_input;
+  int64 _num_output;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(PolyphaseResampler);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_POLYPHASE_RESAMPLER_H_
@@ -0,0 +1,173 @@
+// resample-bench.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "base/kaldi-common.h"
+#include "feat/resample.h"
+#include "util/common-utils.h"
+
+#include "polyphase-resampler.h"
+
+namespace kaldi {
+
+static double MonotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+// A few seconds of a tone sweep plus noise, in 16 bit range.
+static void MakeSignal(int32 samp_freq, BaseFloat seconds,
+                       std::vector<BaseFloat> *signal) {
+  int32 n = seconds * samp_freq;
+  signal->resize(n);
+  double phase = 0.0;
+  for (int32 i = 0; i < n; i++) {
+    double freq = 100.0 + 3000.0 * (i % samp_freq) / samp_freq;
+    phase += 2.0 * M_PI * freq / samp_freq;
+    (*signal)[i] = 8000.0 * sin(phase) + 300.0 * RandGauss();
+  }
+}
+
+struct RunResult {
+  double seconds;
+  std::vector<BaseFloat> output;
+};
+
+static void RunPolyphase(const std::vector<BaseFloat> &input, int32 rate_in,
+                         int32 rate_out, int32 packet, RunResult *result) {
+  PolyphaseResampler resampler(rate_in, rate_out);
+  result->output.clear();
+  result->output.reserve(input.size() * (rate_out + 1.0) / rate_in + 64);
+  double start = MonotonicSeconds();
+  for (size_t i = 0; i < input.size(); i += packet) {
+    int32 n = std::min<size_t>(packet, input.size() - i);
+    resampler.Resample(&input[i], n, &(result->output));
+  }
+  resampler.Flush(&(result->output));
+  result->seconds = MonotonicSeconds() - start;
+}
+
+static void RunLinear(const std::vector<BaseFloat> &input, int32 rate_in,
+                      int32 rate_out, int32 packet, RunResult *result) {
+  // the cutoff PolyphaseResampler uses
+  BaseFloat cutoff = 0.95 * 0.5 * std::min(rate_in, rate_out);
+  LinearResample resampler(rate_in, rate_out, cutoff, 8);
+  Vector<BaseFloat> chunk(packet, kUndefined), chunk_output;
+  result->output.clear();
+  double start = MonotonicSeconds();
+  for (size_t i = 0; i < input.size(); i += packet) {
+    int32 n = std::min<size_t>(packet, input.size() - i);
+    if (n != chunk.Dim()) chunk.Resize(n, kUndefined);
+    std::copy(input.begin() + i, input.begin() + i + n, chunk.Data());
+    bool flush = (i + n == input.size());
+    resampler.Resample(chunk, flush, &chunk_output);
+    result->output.insert(result->output.end(), chunk_output.Data(),
+                          chunk_output.Data() + chunk_output.Dim());
+  }
+  result->seconds = MonotonicSeconds() - start;
+}
+
+}  // namespace kaldi
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+
+    const char *usage =
+        "Compares the speed of the server's polyphase resampler with Kaldi's\n"
+        "LinearResample on synthetic audio, fed in packets as a client\n"
+        "would send it, and reports how much their outputs differ.\n"
+        "\n"
+        "Usage: resample-bench [options]\n"
+        "e.g.: resample-bench --input-rates=8000:44100:48000\n";
+
+    ParseOptions po(usage);
+    std::string input_rates = "8000:22050:44100:48000";
+    int32 output_rate = 16000;
+    BaseFloat seconds = 60.0, packet_secs = 0.1;
+    int32 repeat = 3;
+    po.Register("input-rates", &input_rates, "Colon separated list of "
+                "input sample rates");
+    po.Register("output-rate", &output_rate, "Sample rate to resample to");
+    po.Register("seconds", &seconds, "Seconds of audio per input rate");
+    po.Register("packet-secs", &packet_secs, "Seconds of audio per call");
+    po.Register("repeat", &repeat, "Runs per resampler; the fastest counts");
+    po.Read(argc, argv);
+
+    std::vector<int32> rates;
+    if (po.NumArgs() != 0 || !SplitStringToIntegers(input_rates, ":", true,
+                                                    &rates) ||
+        seconds <= 0 || packet_secs <= 0 || repeat <= 0) {
+      po.PrintUsage();
+      return 1;
+    }
+
+    std::ostringstream report;
+    report << std::fixed << std::setprecision(1)
+           << "\n   rate  polyphase (x RT)  LinearResample (x RT)  speedup"
+           << "  difference (dB)\n";
+    for (size_t r = 0; r < rates.size(); r++) {
+      int32 rate_in = rates[r];
+      if (!PolyphaseResampler::Supported(rate_in, output_rate)) {
+        KALDI_WARN << "Skipping unsupported rate " << rate_in;
+        continue;
+      }
+      std::vector<BaseFloat> input;
+      MakeSignal(rate_in, seconds, &input);
+      int32 packet = std::max(1, static_cast<int32>(packet_secs * rate_in));
+
+      RunResult poly, linear, run;
+      poly.seconds = linear.seconds = 1.0e10;
+      for (int32 i = 0; i < repeat; i++) {
+        RunPolyphase(input, rate_in, output_rate, packet, &run);
+        if (run.seconds < poly.seconds) std::swap(run, poly);
+        RunLinear(input, rate_in, output_rate, packet, &run);
+        if (run.seconds < linear.seconds) std::swap(run, linear);
+      }
+
+      // Both put output sample n at input time n / output_rate, so the
+      // outputs line up; the edges are left out.
+      size_t n = std::min(poly.output.size(), linear.output.size());
+      double signal = 0.0, diff = 0.0;
+      for (size_t i = output_rate / 10; i + output_rate / 10 < n; i++) {
+        signal += linear.output[i] * linear.output[i];
+        diff += (poly.output[i] - linear.output[i]) *
+            (poly.output[i] - linear.output[i]);
+      }
+      report << std::setw(7) << rate_in
+             << std::setw(18) << seconds / poly.seconds
+             << std::setw(23) << seconds / linear.seconds
+             << std::setw(9) << linear.seconds / poly.seconds
+             << std::setw(17) << 10.0 * log10((diff + 1.0e-20) /
+                                              (signal + 1.0e-20))
+             << "\n";
+    }
+    KALDI_LOG << report.str();
+    return 0;
+  } catch(const std::exception& e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -0,0 +1,258 @@
+// result-writer.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <algorithm>
+
+#include "result-writer.h"
+
+namespace kaldi {
+
+bool ResultWriter::ParseFormat(const std::string &name, Format *format) {
+  if (name == "text") {
+    *format = kText;
+  } else if (name == "json") {
+    *format = kJson;
+  } else if (name == "binary") {
+    *format = kBinary;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void ResultWriter::BeginRecord(RecordType type) {
+  _record_type = type;
+  _record_start = _buffer.size();
+  _num_words = 0;
+  if (_format == kBinary) {
+    // num_words and payload_bytes are filled in by EndRecord()
+    char header[8] = { static_cast<char>(type), 0, 0, 0, 0, 0, 0, 0 };
+    _buffer.append(header, sizeof(header));
+  }
+}
+
+void ResultWriter::EndRecord() {
+  switch (_format) {
+    case kText:
+      if (_record_type != kResultFinal) AppendChar('\n');
+      break;
+    case kJson:
+      Append(_record_type == kResultDone ? "}\n" : "]}\n");
+      break;
+    case kBinary: {
+      uint32 payload_bytes = _buffer.size() - _record_start - 8;
+      char *header = &_buffer[_record_start];
+      header[2] = _num_words & 0xff;
+      header[3] = (_num_words >> 8) & 0xff;
+      for (int32 i = 0; i < 4; i++)
+        header[4 + i] = (payload_bytes >> (8 * i)) & 0xff;
+      break;
+    }
+  }
+}
+
+void ResultWriter::BeginPartial(int32 kept) {
+  BeginRecord(kResultPartial);
+  switch (_format) {
+    case kText:
+      if (kept < 0) {
+        Append("PARTIAL:");
+      } else {
+        Append("PARTIAL-SUFFIX:");
+        AppendInt(kept);
+        AppendChar(':');
+      }
+      break;
+    case kJson:
+      Append("{\"type\":\"partial\",");
+      if (kept >= 0) {
+        Append("\"kept\":");
+        AppendInt(kept);
+        AppendChar(',');
+      }
+      Append("\"words\":[");
+      break;
+    case kBinary:
+      AppendUint32(static_cast<uint32>(kept));
+      break;
+  }
+}
+
+void ResultWriter::AddWord(const std::string &word) {
+  switch (_format) {
+    case kText:
+      if (_num_words > 0) AppendChar(' ');
+      _buffer.append(word);
+      break;
+    case kJson:
+      if (_num_words > 0) AppendChar(',');
+      AppendJsonString(word);
+      break;
+    case kBinary:
+      AppendCountedString(word);
+      break;
+  }
+  _num_words++;
+}
+
+void ResultWriter::BeginFinal(int32 num_words, BaseFloat reco_dur,
+                              BaseFloat input_dur) {
+  BeginRecord(kResultFinal);
+  switch (_format) {
+    case kText:
+      Append("RESULT:NUM=");
+      AppendInt(num_words);
+      Append(",FORMAT=WSE,RECO-DUR=");
+      AppendFloat(reco_dur);
+      Append(",INPUT-DUR=");
+      AppendFloat(input_dur);
+      AppendChar('\n');
+      break;
+    case kJson:
+      Append("{\"type\":\"final\",\"reco_dur\":");
+      AppendFloat(reco_dur);
+      Append(",\"input_dur\":");
+      AppendFloat(input_dur);
+      Append(",\"words\":[");
+      break;
+    case kBinary:
+      AppendFloat32(reco_dur);
+      AppendFloat32(input_dur);
+      break;
+  }
+}
+
+void ResultWriter::AddFinalWord(const std::string &word, BaseFloat start,
+                                BaseFloat end) {
+  switch (_format) {
+    case kText:
+      Append("RESULT:WORD=");
+      _buffer.append(word);
+      AppendChar(',');
+      AppendFloat(start);
+      AppendChar(',');
+      AppendFloat(end);
+      AppendChar('\n');
+      break;
+    case kJson:
+      if (_num_words > 0) AppendChar(',');
+      Append("{\"word\":");
+      AppendJsonString(word);
+      Append(",\"start\":");
+      AppendFloat(start);
+      Append(",\"end\":");
+      AppendFloat(end);
+      AppendChar('}');
+      break;
+    case kBinary:
+      AppendFloat32(start);
+      AppendFloat32(end);
+      AppendCountedString(word);
+      break;
+  }
+  _num_words++;
+}
+
+void ResultWriter::Done() {
+  BeginRecord(kResultDone);
+  if (_format == kText)
+    Append("RESULT:DONE");
+  else if (_format == kJson)
+    Append("{\"type\":\"done\"");
+  EndRecord();
+}
+
+bool ResultWriter::Flush(int32 socket) {
+  const char *p = _buffer.data();
+  size_t to_write = _buffer.size();
+  while (to_write > 0) {
+    ssize_t ret = send(socket, p, to_write, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      _buffer.clear();
+      return false;
+    }
+    p += ret;
+    to_write -= ret;
+  }
+  _buffer.clear();
+  return true;
+}
+
+void ResultWriter::AppendInt(int64 i) {
+  char buf[32];
+  int32 len = snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(i));
+  _buffer.append(buf, len);
+}
+
+void ResultWriter::AppendFloat(BaseFloat f) {
+  // same as the default formatting of an ostream
+  char buf[32];
+  int32 len = snprintf(buf, sizeof(buf), "%g", static_cast<double>(f));
+  _buffer.append(buf, len);
+}
+
+void ResultWriter::AppendJsonString(const std::string &s) {
+  static const char kHex[] = "0123456789abcdef";
+  AppendChar('"');
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      AppendChar('\\');
+      AppendChar(c);
+    } else if (c < 0x20) {
+      Append("\\u00");
+      AppendChar(kHex[c >> 4]);
+      AppendChar(kHex[c & 0xf]);
+    } else {
+      AppendChar(c);
+    }
+  }
+  AppendChar('"');
+}
+
+void ResultWriter::AppendUint16(uint16 i) {
+  AppendChar(i & 0xff);
+  AppendChar((i >> 8) & 0xff);
+}
+
+void ResultWriter::AppendUint32(uint32 i) {
+  for (int32 b = 0; b < 4; b++)
+    AppendChar((i >> (8 * b)) & 0xff);
+}
+
+void ResultWriter::AppendFloat32(float f) {
+  uint32 i;
+  memcpy(&i, &f, sizeof(i));
+  AppendUint32(i);
+}
+
+void ResultWriter::AppendCountedString(const std::string &s) {
+  uint16 len = std::min<size_t>(s.size(), 0xffff);
+  AppendUint16(len);
+  _buffer.append(s, 0, len);
+}
+
+}  // namespace kaldi
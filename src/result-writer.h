@@ -0,0 +1,137 @@
+// result-writer.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_RESULT_WRITER_H_
+#define KALDI_AUDIO_SERVER_RESULT_WRITER_H_
+
+#include <string>
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+
+namespace kaldi {
+
+struct ResultWriterConfig {
+  std::string format;
+
+  ResultWriterConfig(): format("text") { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("result-format", &format, "Format of the results sent "
+                   "to clients: \"text\" (PARTIAL:/RESULT: lines), \"json\" "
+                   "(one object per line) or \"binary\" (see "
+                   "result-writer.h)");
+  }
+};
+
+/*
+ * Formats results into a buffer that is kept for the whole session, so
+ * that after the first few utterances no memory is allocated, and sends
+ * everything queued since the last Flush() with a single send().  A final
+ * result and its RESULT:DONE thus take one system call instead of one per
+ * word.
+ *
+ * Three formats are supported:
+ *
+ * - text, as sent by the server so far:
+ *     PARTIAL:<words>
+ *     PARTIAL-SUFFIX:<kept>:<words>
+ *     RESULT:NUM=<n>,FORMAT=WSE,RECO-DUR=<secs>,INPUT-DUR=<secs>
+ *     RESULT:WORD=<word>,<start>,<end>     (n times)
+ *     RESULT:DONE
+ *
+ * - json, one object per line:
+ *     {"type":"partial","kept":<kept>,"words":["a","b"]}
+ *     {"type":"final","reco_dur":<secs>,"input_dur":<secs>,
+ *      "words":[{"word":"a","start":<secs>,"end":<secs>}]}
+ *     {"type":"done"}
+ *   "kept" is only present for suffix-only partial results.
+ *
+ * - binary, records of an 8 byte header (all fields little endian)
+ *     uint8  type           kResultPartial, kResultFinal or kResultDone
+ *     uint8  reserved
+ *     uint16 num_words
+ *     uint32 payload_bytes
+ *   followed by the payload:
+ *     partial: int32 kept (-1 for a complete hypothesis), then per word
+ *              uint16 length and the word
+ *     final:   float32 reco_dur, float32 input_dur, then per word
+ *              float32 start, float32 end, uint16 length and the word
+ *     done:    nothing
+ */
+class ResultWriter {
+ public:
+  enum Format { kText, kJson, kBinary };
+  enum RecordType { kResultPartial = 1, kResultFinal = 2, kResultDone = 3 };
+
+  ResultWriter(): _format(kText), _record_type(kResultDone),
+                  _record_start(0), _num_words(0) { }
+
+  // Parses the value of --result-format; returns false if it is unknown.
+  static bool ParseFormat(const std::string &name, Format *format);
+  void SetFormat(Format format) { _format = format; }
+
+  // A partial result is BeginPartial(), AddWord() for each word and
+  // EndPartial(); "kept" is the number of words of the previous partial
+  // result that the words added replace the rest of, or -1 if they are
+  // the complete hypothesis.
+  void BeginPartial(int32 kept);
+  void AddWord(const std::string &word);
+  void EndPartial() { EndRecord(); }
+
+  // A final result is BeginFinal(), AddFinalWord() "num_words" times and
+  // EndFinal().
+  void BeginFinal(int32 num_words, BaseFloat reco_dur, BaseFloat input_dur);
+  void AddFinalWord(const std::string &word, BaseFloat start, BaseFloat end);
+  void EndFinal() { EndRecord(); }
+
+  // Queues RESULT:DONE.
+  void Done();
+
+  bool Empty() const { return _buffer.empty(); }
+  // Sends everything queued and empties the buffer (keeping its memory).
+  // Returns false if the client is gone.
+  bool Flush(int32 socket);
+
+ private:
+  void BeginRecord(RecordType type);
+  void EndRecord();
+
+  void Append(const char *s) { _buffer.append(s); }
+  void AppendChar(char c) { _buffer.push_back(c); }
+  void AppendInt(int64 i);
+  void AppendFloat(BaseFloat f);
+  void AppendJsonString(const std::string &s);
+  void AppendUint16(uint16 i);
+  void AppendUint32(uint32 i);
+  void AppendFloat32(float f);
+  void AppendCountedString(const std::string &s);
+
+  Format _format;
+  std::string _buffer;
+  RecordType _record_type;  // of the record being written
+  size_t _record_start;     // where it begins in _buffer
+  int32 _num_words;         // words added to it so far
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(ResultWriter);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_RESULT_WRITER_H_
@@ -0,0 +1,108 @@
+// ring-buffer.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_RING_BUFFER_H_
+#define KALDI_AUDIO_SERVER_RING_BUFFER_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "base/kaldi-common.h"
+
+namespace kaldi {
+
+/*
+ * A FIFO of elements in one block of memory that is reused as the
+ * elements are consumed.  Producers write straight into the free space
+ * (WriteSpan() + Commit()), so e.g. received PCM can be converted into
+ * place.  The block only grows, doubling when it is full, so once it
+ * holds the largest backlog nothing is allocated any more.  Not
+ * thread-safe.
+ */
+template<class T>
+class RingBuffer {
+ public:
+  RingBuffer(): _head(0), _size(0) { }
+
+  int64 Size() const { return _size; }
+  bool Empty() const { return _size == 0; }
+
+  // Returns the contiguous free space after the last element, growing the
+  // buffer if there is none; "*n" receives its length (at least 1).
+  T *WriteSpan(int64 *n);
+  // Appends the first "n" elements of the span returned by WriteSpan().
+  void Commit(int64 n);
+
+  // Copies the first "n" elements to "dst" and removes them.
+  void Read(T *dst, int64 n);
+
+ private:
+  void Grow();
+
+  std::vector<T> _data;
+  int64 _head;
+  int64 _size;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(RingBuffer);
+};
+
+template<class T>
+T *RingBuffer<T>::WriteSpan(int64 *n) {
+  int64 capacity = _data.size();
+  if (_size == capacity) {
+    Grow();
+    capacity = _data.size();
+  }
+  int64 tail = (_head + _size) % capacity;
+  // free space runs to the end of the block, or up to the head
+  *n = (tail >= _head ? capacity - tail : _head - tail);
+  return &(_data[tail]);
+}
+
+template<class T>
+void RingBuffer<T>::Commit(int64 n) {
+  KALDI_ASSERT(n >= 0 && _size + n <= static_cast<int64>(_data.size()));
+  _size += n;
+}
+
+template<class T>
+void RingBuffer<T>::Read(T *dst, int64 n) {
+  KALDI_ASSERT(n >= 0 && n <= _size);
+  int64 capacity = _data.size();
+  int64 first = std::min(n, capacity - _head);
+  std::copy(_data.begin() + _head, _data.begin() + _head + first, dst);
+  std::copy(_data.begin(), _data.begin() + (n - first), dst + first);
+  _head = (_head + n) % std::max<int64>(capacity, 1);
+  _size -= n;
+  if (_size == 0) _head = 0;
+}
+
+template<class T>
+void RingBuffer<T>::Grow() {
+  int64 size = _size;
+  std::vector<T> data(std::max<int64>(2 * _data.size(), 4096));
+  Read(&(data[0]), size);
+  _data.swap(data);
+  _head = 0;
+  _size = size;
+}
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_RING_BUFFER_H_
@@ -0,0 +1,271 @@
+// shm-ring.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include "shm-ring.h"
+
+namespace kaldi {
+
+// Both processes access the positions and flags at the same time, which
+// only works with atomics that need no lock.
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "Shared memory rings need lock-free atomics");
+
+static const uint32 kShmRingMagic = 0x5253414b;  // "KASR"
+// The data starts on the page after the header.
+static const size_t kDataOffset = 4096;
+
+// The two positions only grow; the data of position p is at byte
+// p & (capacity - 1).  Producer and consumer fields are on cache lines of
+// their own.
+struct ShmRing::Header {
+  uint32 magic;
+  uint32 capacity;  // a power of 2
+  alignas(64) std::atomic<uint64> write_pos;
+  std::atomic<uint32> closed;
+  alignas(64) std::atomic<uint64> read_pos;
+  std::atomic<uint32> consumer_waiting;
+};
+
+// What SendShmRing() sends along with the descriptors.
+struct ShmRingHello {
+  uint32 magic;
+  uint32 capacity;
+};
+
+ShmRing *ShmRing::Create(int32 capacity) {
+  uint32 size = 4096;
+  while (size < static_cast<uint32>(capacity) && size < (1u << 30))
+    size <<= 1;
+
+  // The size is sealed, so the client cannot truncate the memory under
+  // the server's mapping.
+  int32 memory_fd = memfd_create("kaldi-audio-server-ring",
+                                 MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memory_fd == -1) {
+    KALDI_WARN << "Cannot create shared memory: " << strerror(errno);
+    return NULL;
+  }
+  if (ftruncate(memory_fd, kDataOffset + size) == -1 ||
+      fcntl(memory_fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+    KALDI_WARN << "Cannot size shared memory: " << strerror(errno);
+    close(memory_fd);
+    return NULL;
+  }
+  int32 doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (doorbell_fd == -1) {
+    KALDI_WARN << "Cannot create eventfd: " << strerror(errno);
+    close(memory_fd);
+    return NULL;
+  }
+
+  ShmRing *ring = new ShmRing;
+  if (!ring->Map(memory_fd, doorbell_fd, size)) {
+    delete ring;
+    return NULL;
+  }
+  Header *header = new (ring->_header) Header;
+  header->magic = kShmRingMagic;
+  header->capacity = size;
+  header->write_pos.store(0);
+  header->closed.store(0);
+  header->read_pos.store(0);
+  header->consumer_waiting.store(0);
+  return ring;
+}
+
+bool ShmRing::Map(int32 memory_fd, int32 doorbell_fd, uint32 capacity) {
+  _memory_fd = memory_fd;
+  _doorbell_fd = doorbell_fd;
+  size_t map_bytes = kDataOffset + capacity;
+  void *memory = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      memory_fd, 0);
+  if (memory == MAP_FAILED) {
+    KALDI_WARN << "Cannot map shared memory: " << strerror(errno);
+    return false;
+  }
+  _header = static_cast<Header*>(memory);
+  _data = static_cast<char*>(memory) + kDataOffset;
+  _map_bytes = map_bytes;
+  _capacity = capacity;
+  return true;
+}
+
+ShmRing::~ShmRing() {
+  if (_header != NULL) munmap(_header, _map_bytes);
+  if (_memory_fd != -1) close(_memory_fd);
+  if (_doorbell_fd != -1) close(_doorbell_fd);
+}
+
+int32 ShmRing::Capacity() const {
+  return _capacity;
+}
+
+int32 ShmRing::Write(const char *data, int32 num_bytes) {
+  uint32 capacity = _capacity;
+  uint64 write_pos = _header->write_pos.load(std::memory_order_relaxed);
+  uint64 read_pos = _header->read_pos.load(std::memory_order_acquire);
+  int32 n = std::min<uint64>(num_bytes, capacity - (write_pos - read_pos));
+  if (n == 0) return 0;
+  uint32 offset = write_pos & (capacity - 1);
+  int32 first = std::min<uint32>(n, capacity - offset);
+  memcpy(_data + offset, data, first);
+  memcpy(_data, data + first, n - first);
+  _header->write_pos.store(write_pos + n, std::memory_order_release);
+  // Pairs with the fence in PrepareWait(): either the consumer sees the new
+  // position or we see its flag.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_header->consumer_waiting.load(std::memory_order_relaxed) &&
+      _header->consumer_waiting.exchange(0))
+    Notify();
+  return n;
+}
+
+void ShmRing::Close() {
+  _header->closed.store(1, std::memory_order_release);
+  Notify();
+}
+
+int32 ShmRing::Read(char *data, int32 max_bytes) {
+  // The other process can write anything into the header, so the capacity
+  // is our own copy and the positions are checked against it.
+  uint32 capacity = _capacity;
+  uint64 read_pos = _header->read_pos.load(std::memory_order_relaxed);
+  uint64 write_pos = _header->write_pos.load(std::memory_order_acquire);
+  if (write_pos - read_pos > capacity) return -1;
+  int32 n = std::min<uint64>(max_bytes, write_pos - read_pos);
+  if (n == 0) return 0;
+  uint32 offset = read_pos & (capacity - 1);
+  int32 first = std::min<uint32>(n, capacity - offset);
+  memcpy(data, _data + offset, first);
+  memcpy(data + first, _data, n - first);
+  _header->read_pos.store(read_pos + n, std::memory_order_release);
+  return n;
+}
+
+bool ShmRing::Done() const {
+  return _header->closed.load(std::memory_order_acquire) &&
+      _header->write_pos.load(std::memory_order_acquire) ==
+      _header->read_pos.load(std::memory_order_relaxed);
+}
+
+void ShmRing::ClearDoorbell() {
+  uint64 count;
+  if (read(_doorbell_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    KALDI_WARN << "Cannot read the doorbell: " << strerror(errno);
+}
+
+bool ShmRing::PrepareWait() {
+  _header->consumer_waiting.store(1);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_header->write_pos.load(std::memory_order_acquire) !=
+      _header->read_pos.load(std::memory_order_relaxed) ||
+      _header->closed.load(std::memory_order_acquire)) {
+    _header->consumer_waiting.store(0);
+    return false;
+  }
+  return true;
+}
+
+void ShmRing::Notify() {
+  uint64 one = 1;
+  if (write(_doorbell_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    KALDI_WARN << "Cannot ring the doorbell: " << strerror(errno);
+}
+
+bool SendShmRing(int32 socket, const ShmRing &ring) {
+  ShmRingHello hello;
+  hello.magic = kShmRingMagic;
+  hello.capacity = ring._capacity;
+  struct iovec iov;
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof(hello);
+
+  int32 fds[2] = { ring._memory_fd, ring._doorbell_fd };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(socket, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+    KALDI_WARN << "Cannot send a shared memory ring: " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+ShmRing *ReceiveShmRing(int32 socket) {
+  ShmRingHello hello;
+  struct iovec iov;
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof(hello);
+  int32 fds[2] = { -1, -1 };
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t ret = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  ShmRing *ring = new ShmRing;
+  bool power_of_2 = (hello.capacity & (hello.capacity - 1)) == 0;
+  if (ret != sizeof(hello) || hello.magic != kShmRingMagic ||
+      hello.capacity < 4096 || hello.capacity > (1u << 30) || !power_of_2 ||
+      fds[0] == -1 || fds[1] == -1 ||
+      !ring->Map(fds[0], fds[1], hello.capacity) ||
+      ring->_header->magic != kShmRingMagic ||
+      ring->_header->capacity != hello.capacity) {
+    KALDI_WARN << "Did not receive a shared memory ring";
+    if (ring->_memory_fd == -1 && fds[0] != -1) close(fds[0]);
+    if (ring->_doorbell_fd == -1 && fds[1] != -1) close(fds[1]);
+    delete ring;
+    return NULL;
+  }
+  return ring;
+}
+
+}  // namespace kaldi
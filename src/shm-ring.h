@@ -0,0 +1,104 @@
+// shm-ring.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_SHM_RING_H_
+#define KALDI_AUDIO_SERVER_SHM_RING_H_
+
+#include "base/kaldi-common.h"
+
+namespace kaldi {
+
+/*
+ * Byte stream from a client on the same host to the server through a
+ * single-producer single-consumer ring buffer in shared memory.  The
+ * client writes into the ring what it would otherwise send over TCP (the
+ * framed or the online-audio-client format), so audio and end of
+ * utterance markers stay in order, and neither side makes a system call
+ * per packet.
+ *
+ * The server creates the ring and a doorbell (an eventfd) for every
+ * connection on its Unix domain socket and passes both to the client with
+ * SendShmRing(); results still go back over the socket.  The reactor waits
+ * on the doorbell.  The consumer raises a flag in the ring before it goes
+ * to sleep, and the producer rings the doorbell only if the flag is up, so
+ * a steady stream costs no doorbell writes while the server keeps up.
+ */
+class ShmRing {
+ public:
+  // Creates a ring of at least "capacity" bytes and its doorbell; used by
+  // the server.  Returns NULL on failure.
+  static ShmRing *Create(int32 capacity);
+  ~ShmRing();
+
+  int32 MemoryFd() const { return _memory_fd; }
+  int32 DoorbellFd() const { return _doorbell_fd; }
+  int32 Capacity() const;
+
+  // Producer side.  Copies as much of "data" as fits and returns the
+  // number of bytes copied, which may be 0 while the ring is full.
+  int32 Write(const char *data, int32 num_bytes);
+  // Tells the consumer no more data will follow.
+  void Close();
+
+  // Consumer side.  Copies up to "max_bytes" into "data" and returns the
+  // number of bytes copied, or -1 if the producer corrupted the positions.
+  int32 Read(char *data, int32 max_bytes);
+  // True once the producer closed the ring and everything was read.
+  bool Done() const;
+  // Resets the doorbell after it rang.
+  void ClearDoorbell();
+  // Announces that the consumer is about to wait for the doorbell.
+  // Returns false, without waiting being announced, if there is something
+  // to read already.
+  bool PrepareWait();
+  // Rings the doorbell, e.g. for the consumer to wake itself up.
+  void Notify();
+
+ private:
+  friend bool SendShmRing(int32 socket, const ShmRing &ring);
+  friend ShmRing *ReceiveShmRing(int32 socket);
+
+  struct Header;
+
+  ShmRing(): _memory_fd(-1), _doorbell_fd(-1), _header(NULL), _data(NULL),
+             _map_bytes(0), _capacity(0) { }
+  // Maps the ring of "capacity" bytes of "memory_fd"; the header is not
+  // set up.
+  bool Map(int32 memory_fd, int32 doorbell_fd, uint32 capacity);
+
+  int32 _memory_fd;
+  int32 _doorbell_fd;
+  Header *_header;
+  char *_data;
+  size_t _map_bytes;
+  // Never read back from the header, which the other process can change.
+  uint32 _capacity;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(ShmRing);
+};
+
+// Passes the descriptors of "ring" over the Unix domain socket "socket".
+bool SendShmRing(int32 socket, const ShmRing &ring);
+// Receives a ring sent by SendShmRing() and maps it; used by clients.
+// Returns NULL on failure.
+ShmRing *ReceiveShmRing(int32 socket);
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_SHM_RING_H_
@@ -0,0 +1,224 @@
+// tcp-server.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sstream>
+#include <vector>
+
+#include "tcp-server.h"
+
+namespace kaldi {
+
+TcpServer::TcpServer() {
+  _server_desc_ = -1;
+}
+
+// Numeric host part of "addr", for logging.
+static std::string AddressName(const struct sockaddr *addr) {
+  char name[INET6_ADDRSTRLEN] = "";
+  if (addr->sa_family == AF_INET) {
+    inet_ntop(AF_INET, &((const struct sockaddr_in*) addr)->sin_addr, name,
+              sizeof name);
+  } else if (addr->sa_family == AF_INET6) {
+    inet_ntop(AF_INET6, &((const struct sockaddr_in6*) addr)->sin6_addr,
+              name, sizeof name);
+  }
+  return name;
+}
+
+bool TcpServer::Listen(int32 port, int32 backlog, bool loopback_only) {
+  return Listen(loopback_only ? "127.0.0.1" : "", port, backlog);
+}
+
+bool TcpServer::Listen(const std::string &address, int32 port,
+                       int32 backlog, bool reuse_port) {
+  struct addrinfo hints, *addrs = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  const char *node = (address.empty() ? NULL : address.c_str());
+  std::ostringstream service;
+  service << port;
+  int32 err = getaddrinfo(node, service.str().c_str(), &hints, &addrs);
+  if (err != 0) {
+    KALDI_ERR << "Cannot resolve " << address << ": " << gai_strerror(err);
+    return false;
+  }
+
+  // IPv6 first: without an address, its socket takes IPv4 connections
+  // too.  Hosts without IPv6 fail to create it and fall back to IPv4.
+  std::vector<struct addrinfo*> candidates;
+  for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next)
+    if (a->ai_family == AF_INET6) candidates.push_back(a);
+  for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next)
+    if (a->ai_family != AF_INET6) candidates.push_back(a);
+
+  std::string name;
+  for (size_t i = 0; i < candidates.size() && _server_desc_ == -1; i++) {
+    const struct addrinfo *a = candidates[i];
+    _server_desc_ = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (_server_desc_ == -1)
+      continue;
+
+    int32 flag = 1, off = 0;
+    int32 len = sizeof(int32);
+    if (setsockopt(_server_desc_, SOL_SOCKET, SO_REUSEADDR, &flag, len)
+        == -1 ||
+        (reuse_port &&
+         setsockopt(_server_desc_, SOL_SOCKET, SO_REUSEPORT, &flag, len)
+         == -1) ||
+        (a->ai_family == AF_INET6 && node == NULL &&
+         setsockopt(_server_desc_, IPPROTO_IPV6, IPV6_V6ONLY, &off, len)
+         == -1)) {
+      freeaddrinfo(addrs);
+      KALDI_ERR << "Cannot set socket options: " << strerror(errno);
+      return false;
+    }
+
+    if (bind(_server_desc_, a->ai_addr, a->ai_addrlen) == 0) {
+      name = AddressName(a->ai_addr);
+    } else {
+      close(_server_desc_);
+      _server_desc_ = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (_server_desc_ == -1) {
+    KALDI_ERR << "Cannot bind to port: " << port << " (is it taken?)";
+    return false;
+  }
+
+  if (listen(_server_desc_, backlog) == -1) {
+    KALDI_ERR << "Cannot listen on port!";
+    return false;
+  }
+
+  KALDI_VLOG(1) << "TcpServer: Listening on port: " << port << " of "
+                << name << " with backlog " << backlog;
+  signal(SIGPIPE, SIG_IGN);
+
+  return true;
+}
+
+bool TcpServer::ListenUnix(const std::string &path, int32 backlog) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    KALDI_ERR << "Invalid Unix socket path " << path;
+    return false;
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  _server_desc_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_server_desc_ == -1) {
+    KALDI_ERR << "Cannot create Unix socket!";
+    return false;
+  }
+
+  unlink(path.c_str());  // left behind by an earlier run
+  if (bind(_server_desc_, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+    KALDI_ERR << "Cannot bind to " << path << ": " << strerror(errno);
+    return false;
+  }
+  _unix_path_ = path;
+
+  if (listen(_server_desc_, backlog) == -1) {
+    KALDI_ERR << "Cannot listen on " << path;
+    return false;
+  }
+
+  KALDI_VLOG(1) << "TcpServer: Listening on " << path << " with backlog "
+                << backlog;
+  signal(SIGPIPE, SIG_IGN);
+
+  return true;
+}
+
+TcpServer::~TcpServer() {
+  if (_server_desc_ != -1)
+    close(_server_desc_);
+  if (_unix_path_ != "")
+    unlink(_unix_path_.c_str());
+}
+
+int32 TcpServer::Accept(double timeout_secs) {
+  if (timeout_secs >= 0) {
+    struct pollfd pfd;
+    pfd.fd = _server_desc_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int32 ret = poll(&pfd, 1, static_cast<int32>(timeout_secs * 1000 + 0.5));
+    if (ret <= 0)
+      return -1;
+  } else {
+    KALDI_VLOG(1) << "Waiting for client...";
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  int32 client_desc = accept(_server_desc_, (struct sockaddr*) &addr, &len);
+  if (client_desc == -1)
+    return -1;
+
+  // the address is only formatted if it is logged
+  if (_unix_path_ != "") {
+    KALDI_VLOG(1) << "TcpServer: Accepted connection on " << _unix_path_;
+  } else {
+    KALDI_VLOG(1) << "TcpServer: Accepted connection from: "
+                  << AddressName((struct sockaddr*) &addr);
+  }
+
+  return client_desc;
+}
+
+bool WriteLine(int32 socket, std::string line) {
+  line = line + "\n";
+
+  const char* p = line.c_str();
+  int32 to_write = line.size();
+  int32 wrote = 0;
+  while (to_write > 0) {
+    int32 ret = write(socket, p + wrote, to_write);
+    if (ret <= 0)
+      return false;
+
+    to_write -= ret;
+    wrote += ret;
+  }
+
+  return true;
+}
+
+void RejectBusyClient(int32 socket) {
+  WriteLine(socket, "RESULT:BUSY");
+  close(socket);
+}
+
+}  // namespace kaldi
@@ -0,0 +1,117 @@
+// tcp-server.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_TCP_SERVER_H_
+#define KALDI_AUDIO_SERVER_TCP_SERVER_H_
+
+#include <netinet/in.h>
+#include <string>
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+
+namespace kaldi {
+
+// Controls what happens to connections that arrive while every decoder is
+// busy: they are queued up to "max_pending" deep and answered with
+// "RESULT:BUSY" if no decoder picks them up within "max_queue_wait".
+struct AdmissionConfig {
+  int32 listen_backlog;
+  int32 max_pending;
+  BaseFloat max_queue_wait;
+
+  AdmissionConfig(): listen_backlog(128), max_pending(32),
+                     max_queue_wait(5.0) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("listen-backlog", &listen_backlog, "Length of the "
+                   "kernel queue of connections not yet accepted");
+    opts->Register("max-pending-connections", &max_pending, "Number of "
+                   "accepted connections allowed to wait for a free decoder; "
+                   "connections beyond that are answered with RESULT:BUSY");
+    opts->Register("max-queue-wait", &max_queue_wait, "Maximum time in "
+                   "seconds a connection waits for a free decoder before it "
+                   "is answered with RESULT:BUSY.  Set to <= 0 to wait "
+                   "forever.");
+  }
+};
+
+// Where clients connect.  The port itself is given separately.
+struct ListenConfig {
+  std::string address;
+  int32 num_acceptors;
+  std::string unix_socket_path;
+
+  ListenConfig(): num_acceptors(1) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("listen-address", &address, "IPv4 or IPv6 address or "
+                   "host name to accept connections on; empty for all "
+                   "interfaces, over IPv6 as well as IPv4 where the host "
+                   "has IPv6");
+    opts->Register("num-acceptors", &num_acceptors, "Number of threads "
+                   "accepting connections, each on a listening socket of "
+                   "its own bound to the same port with SO_REUSEPORT, so "
+                   "the kernel spreads the connections over them");
+    opts->Register("unix-socket-path", &unix_socket_path, "If set, clients "
+                   "on this host may also connect to this Unix domain "
+                   "socket and use it like a TCP connection");
+  }
+};
+
+/*
+ * This class is for a very simple TCP server implementation
+ * in UNIX sockets.
+ */
+class TcpServer {
+ public:
+  TcpServer();
+  ~TcpServer();
+
+  // start listening on a given port, on the loopback interface only if
+  // "loopback_only" is true
+  bool Listen(int32 port, int32 backlog, bool loopback_only = false);
+  // start listening on "port" of "address", an IPv4 or IPv6 address or a
+  // host name; "" means all interfaces, with one IPv6 socket that also
+  // takes IPv4 connections if the host has IPv6.  With "reuse_port", other
+  // sockets may listen on the same port, and the kernel spreads the
+  // connections over them.
+  bool Listen(const std::string &address, int32 port, int32 backlog,
+              bool reuse_port = false);
+  // start listening on the Unix domain socket "path", which is replaced if
+  // it exists and removed again by the destructor
+  bool ListenUnix(const std::string &path, int32 backlog);
+  // accept a client and return its descriptor; gives up and returns -1
+  // after "timeout_secs" seconds unless "timeout_secs" is negative.
+  int32 Accept(double timeout_secs = -1.0);
+
+ private:
+  int32 _server_desc_;
+  std::string _unix_path_;
+};
+
+bool WriteLine(int32 socket, std::string line);
+
+// Tells a client that no decoder could take its request and closes the
+// connection.
+void RejectBusyClient(int32 socket);
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_TCP_SERVER_H_
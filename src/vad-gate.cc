@@ -0,0 +1,163 @@
+// vad-gate.cc
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+
+#include "vad-gate.h"
+
+namespace kaldi {
+
+// How fast the noise floor may rise, in dB per second.
+static const BaseFloat kNoiseFloorRise = 3.0;
+
+VadGate::VadGate(const VadGateConfig &config):
+    _config(config), _samp_freq(0), _frame_samples(0), _keep_samples(0),
+    _preroll_samples(0), _preroll_begin(0), _preroll_size(0),
+    _noise_floor_db(0), _have_noise_floor(false), _dropping(false),
+    _silence_kept(0), _num_received(0), _num_fed(0),
+    _num_trailing_dropped(0) { }
+
+void VadGate::Reset(BaseFloat samp_freq) {
+  if (samp_freq != _samp_freq) {
+    _samp_freq = samp_freq;
+    _frame_samples = std::max(1, static_cast<int32>(0.01 * samp_freq));
+    _keep_samples = _config.keep_silence * samp_freq;
+    _preroll_samples = _config.preroll * samp_freq;
+    _frame.reserve(_frame_samples);
+    _preroll.resize(_preroll_samples);
+  }
+  _frame.clear();
+  _preroll_begin = 0;
+  _preroll_size = 0;
+  // The noise floor is kept from the previous utterance of the session.
+  _dropping = false;
+  _silence_kept = 0;
+  _num_received = 0;
+  _num_fed = 0;
+  _num_trailing_dropped = 0;
+  _jumps.clear();
+  _jumps.push_back(std::make_pair(0, 0));
+}
+
+void VadGate::Process(const VectorBase<BaseFloat> &wave,
+                      std::vector<BaseFloat> *out) {
+  KALDI_ASSERT(_frame_samples > 0 && "VadGate::Reset() not called");
+  const BaseFloat *data = wave.Data();
+  int32 n = wave.Dim();
+  while (n > 0) {
+    int32 take = std::min<int32>(n, _frame_samples - _frame.size());
+    _frame.insert(_frame.end(), data, data + take);
+    data += take;
+    n -= take;
+    if (_frame.size() == _frame_samples)
+      ProcessFrame(out);
+  }
+}
+
+void VadGate::Flush(std::vector<BaseFloat> *out) {
+  // too short to judge; a trailing partial frame is always decoded
+  if (!_frame.empty() && !_dropping)
+    Emit(&_frame[0], _frame.size(), out);
+  else if (!_frame.empty())
+    Drop(&_frame[0], _frame.size());
+  _num_received += _frame.size();
+  _frame.clear();
+}
+
+void VadGate::ProcessFrame(std::vector<BaseFloat> *out) {
+  int32 n = _frame.size();
+  if (IsSpeech()) {
+    if (_dropping) {
+      // the preroll is decoded again, so the skip ends where it begins
+      _jumps.push_back(std::make_pair(_num_fed,
+                                      _num_received - _preroll_size));
+      int32 first = std::min(_preroll_size,
+                             _preroll_samples - _preroll_begin);
+      if (first > 0)
+        Emit(&_preroll[_preroll_begin], first, out);
+      if (_preroll_size > first)
+        Emit(&_preroll[0], _preroll_size - first, out);
+      _preroll_begin = 0;
+      _preroll_size = 0;
+      _dropping = false;
+    }
+    Emit(&_frame[0], n, out);
+    _silence_kept = 0;
+  } else if (!_dropping && _silence_kept + n <= _keep_samples) {
+    Emit(&_frame[0], n, out);
+    _silence_kept += n;
+  } else {
+    _dropping = true;
+    Drop(&_frame[0], n);
+  }
+  _num_received += n;
+  _frame.clear();
+}
+
+bool VadGate::IsSpeech() {
+  double sumsq = 0.0;
+  for (size_t i = 0; i < _frame.size(); i++)
+    sumsq += _frame[i] * _frame[i];
+  BaseFloat energy_db = 10.0 * log10(sumsq / _frame.size() + 1.0);
+
+  if (!_have_noise_floor) {
+    _noise_floor_db = energy_db;
+    _have_noise_floor = true;
+  }
+  bool speech = energy_db > _config.min_energy_db &&
+      energy_db > _noise_floor_db + _config.margin_db;
+  _noise_floor_db = std::min(
+      energy_db,
+      _noise_floor_db + kNoiseFloorRise * _frame.size() / _samp_freq);
+  return speech;
+}
+
+void VadGate::Emit(const BaseFloat *data, int32 n,
+                   std::vector<BaseFloat> *out) {
+  out->insert(out->end(), data, data + n);
+  _num_fed += n;
+  _num_trailing_dropped = 0;
+}
+
+void VadGate::Drop(const BaseFloat *data, int32 n) {
+  _num_trailing_dropped += n;
+  if (_preroll_samples == 0) return;
+  for (int32 i = 0; i < n; i++) {
+    int32 pos = (_preroll_begin + _preroll_size) % _preroll_samples;
+    _preroll[pos] = data[i];
+    if (_preroll_size < _preroll_samples)
+      _preroll_size++;
+    else
+      _preroll_begin = (_preroll_begin + 1) % _preroll_samples;
+  }
+}
+
+BaseFloat VadGate::FedToReceivedSecs(BaseFloat secs) const {
+  if (_samp_freq <= 0) return secs;
+  int64 fed = static_cast<int64>(secs * _samp_freq + 0.5);
+  std::vector<std::pair<int64, int64> >::const_iterator it =
+      std::upper_bound(_jumps.begin(), _jumps.end(),
+                       std::make_pair(fed, std::numeric_limits<int64>::max()))
+      - 1;
+  return (it->second + fed - it->first) / _samp_freq;
+}
+
+}  // namespace kaldi
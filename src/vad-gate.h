@@ -0,0 +1,122 @@
+// vad-gate.h
+
+// Copyright 2016-2017  Junjie Wang, Yanqing Sun
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_AUDIO_SERVER_VAD_GATE_H_
+#define KALDI_AUDIO_SERVER_VAD_GATE_H_
+
+#include <utility>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+#include "matrix/kaldi-vector.h"
+
+namespace kaldi {
+
+struct VadGateConfig {
+  bool enabled;
+  BaseFloat keep_silence;
+  BaseFloat preroll;
+  BaseFloat margin_db;
+  BaseFloat min_energy_db;
+
+  VadGateConfig(): enabled(false), keep_silence(0.5), preroll(0.2),
+                   margin_db(10.0), min_energy_db(40.0) { }
+
+  void Register(OptionsItf *opts) {
+    opts->Register("vad-gate", &enabled, "If true, long stretches of "
+                   "non-speech are dropped before feature extraction.  Word "
+                   "times still refer to the audio as received.");
+    opts->Register("vad-keep-silence", &keep_silence, "Seconds of every "
+                   "non-speech stretch that are still decoded.  For "
+                   "endpointing, the dropped rest still counts as trailing "
+                   "silence.");
+    opts->Register("vad-preroll", &preroll, "Seconds of dropped audio "
+                   "decoded again before speech resumes, for weak onsets");
+    opts->Register("vad-margin-db", &margin_db, "A 10ms frame is speech if "
+                   "its energy exceeds the noise floor by this many dB");
+    opts->Register("vad-min-energy-db", &min_energy_db, "... and is above "
+                   "this absolute level (dB of 16 bit samples)");
+  }
+};
+
+/*
+ * Energy based voice activity gate in front of the feature pipeline.
+ * Audio is classified in 10ms frames against a noise floor that follows
+ * the quietest frames and rises slowly.  Non-speech is passed through for
+ * --vad-keep-silence seconds and dropped after that; when speech resumes,
+ * the last --vad-preroll seconds of dropped audio are passed on first.
+ *
+ * The gate remembers where it dropped audio, so that times on the decoded
+ * ("fed") audio can be mapped back to the audio as received.
+ */
+class VadGate {
+ public:
+  explicit VadGate(const VadGateConfig &config);
+
+  // Starts a new utterance.
+  void Reset(BaseFloat samp_freq);
+
+  // Appends the samples of "wave" that are to be decoded to "out".  Up to
+  // one frame of samples is held back until its frame is complete.
+  void Process(const VectorBase<BaseFloat> &wave, std::vector<BaseFloat> *out);
+  // Appends the samples held back, at the end of the utterance.
+  void Flush(std::vector<BaseFloat> *out);
+
+  // Maps a time in seconds on the fed audio to the received audio.
+  BaseFloat FedToReceivedSecs(BaseFloat secs) const;
+
+  int64 NumReceived() const { return _num_received; }
+  int64 NumDropped() const { return _num_received - _num_fed; }
+  // Samples dropped since audio was last passed on, i.e. the part of the
+  // current non-speech stretch the decoder does not see.
+  int64 NumTrailingDropped() const { return _num_trailing_dropped; }
+
+ private:
+  void ProcessFrame(std::vector<BaseFloat> *out);
+  bool IsSpeech();
+  void Emit(const BaseFloat *data, int32 n, std::vector<BaseFloat> *out);
+  void Drop(const BaseFloat *data, int32 n);
+
+  VadGateConfig _config;
+  BaseFloat _samp_freq;
+  int32 _frame_samples, _keep_samples, _preroll_samples;
+
+  std::vector<BaseFloat> _frame;     // samples of the incomplete frame
+  std::vector<BaseFloat> _preroll;   // ring of the last dropped samples
+  int32 _preroll_begin, _preroll_size;
+
+  BaseFloat _noise_floor_db;
+  bool _have_noise_floor;
+  bool _dropping;
+  int32 _silence_kept;   // non-speech samples passed on in a row
+
+  int64 _num_received;   // samples classified (excludes _frame)
+  int64 _num_fed;        // samples passed on
+  int64 _num_trailing_dropped;
+  // (fed offset, received offset) of every point where the fed audio
+  // skips ahead, starting with (0, 0).
+  std::vector<std::pair<int64, int64> > _jumps;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(VadGate);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_AUDIO_SERVER_VAD_GATE_H_